@@ -0,0 +1,758 @@
+#include "bluelight.hpp"
+#include "pixels.hpp"
+#include "led.hpp"
+#include "eventlog.hpp"
+#include "publisher.hpp"
+
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+
+#include <iostream>
+#include <cstdlib>
+#include <filesystem>
+#include <random>
+#include <thread>
+
+//standalone timings for the hot paths that don't need an adapter or a bus, with every heap
+//allocation counted so "doesn't allocate" claims can be checked
+
+#define BENCH_DEVICES 32
+#define BENCH_PARSE_ROUNDS 2000
+//a long strip split into rooms, at the default LED frame rate
+#define BENCH_PIXELS 3000
+#define BENCH_ZONES 10
+#define BENCH_FPS 50
+#define BENCH_FRAMES 20000
+//one fade streamed to a receiver on loopback
+constexpr auto BENCH_FADE = std::chrono::seconds(3);
+//a busy building's year of log: every key comes and goes a few times a day
+#define BENCH_LOG_KEYS 200
+#define BENCH_LOG_ZONES 20
+#define BENCH_LOG_DAYS 365
+#define BENCH_LOG_VISITS 10
+constexpr auto OCCUPANCY_TARGET = std::chrono::seconds(1);
+//a publisher flipping every key as fast as it can, against readers of the shared segment
+#define BENCH_PRESENCE_NAME "/bluelight-presence-bench"
+constexpr auto BENCH_PRESENCE_TIME = std::chrono::milliseconds(1000);
+//probes in flight at once, far more than a house of phones ever needs
+#define BENCH_TASKS 1000
+//what a suspended coroutine frame is meant to cost
+#define TASK_FRAME_BUDGET 512
+
+static std::atomic<uint64_t> allocations = 0;
+
+//libdbus allocates with malloc, so that is where the counting happens, operator new lands here too
+extern "C" {
+  void * __libc_malloc(size_t size);
+  void * __libc_calloc(size_t count, size_t size);
+  void * __libc_realloc(void * memory, size_t size);
+
+  void * malloc(size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_malloc(size);
+  }
+
+  void * calloc(size_t count, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_calloc(count, size);
+  }
+
+  void * realloc(void * memory, size_t size) {
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    return __libc_realloc(memory, size);
+  }
+}
+
+static bool operator<(const ObjectPath & a, const ObjectPath & b) {
+  return strcmp(a.path, b.path) < 0;
+}
+
+typedef std::chrono::steady_clock BenchClock;
+
+static double nsSince(BenchClock::time_point start, uint64_t count) {
+  return std::chrono::duration<double, std::nano>(BenchClock::now() - start).count() / count;
+}
+
+
+typedef std::variant<std::string, bool, int16_t> Property;
+typedef std::map<std::string, std::map<std::string, Property>> Interfaces;
+
+struct CannedDevice {
+  std::string path;
+  std::map<std::string, Property> properties;
+};
+
+//what bluetoothd hands out: every device, each with a GATT service object under its path
+static std::vector<CannedDevice> cannedDevices() {
+  std::vector<CannedDevice> retval;
+
+  for(int i = 0; i < BENCH_DEVICES; i++) {
+    char address[18];
+    snprintf(address, sizeof(address), "AA:BB:CC:DD:EE:%02X", i);
+
+    std::string path = std::string(DEVICES_PATH) + "dev_" + address;
+    for(char & c : path) if(c == ':') c = '_';
+
+    retval.push_back(CannedDevice{path, {
+      {"Address", std::string(address)},
+      {"AddressType", std::string(i % 2 ? "random" : "public")},
+      {"Alias", "phone number " + std::to_string(i)},
+      {"Bonded", i % 3 == 0},
+      {"Connected", false},
+      {"RSSI", int16_t(-40 - i)},
+      {"Paired", i % 3 == 0},
+      {"Trusted", i % 3 == 0},
+      {"Icon", std::string("phone")},
+    }});
+  }
+
+  return retval;
+}
+
+static DBusMessage * managedObjectsReply(const std::vector<CannedDevice> & devices) {
+  std::map<ObjectPath, Interfaces> objects;
+
+  for(const CannedDevice & device : devices) {
+    objects[ObjectPath{device.path.c_str()}][DEVICE_INTERFACE] = device.properties;
+    objects[ObjectPath{device.path.c_str()}]["org.freedesktop.DBus.Properties"] = {};
+  }
+
+  std::vector<std::string> services;
+  for(const CannedDevice & device : devices) services.push_back(device.path + "/service0001");
+  for(const std::string & service : services) {
+    objects[ObjectPath{service.c_str()}]["org.bluez.GattService1"] = {{"UUID", std::string("0000180f-0000-1000-8000-00805f9b34fb")}, {"Primary", true}};
+  }
+
+  DBusMessage * call = dbus_message_new_method_call(BT_SERVICE, "/", "org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
+  dbus_message_set_serial(call, 1);
+  DBusMessage * reply = dbus_message_new_method_return(call);
+  dbus_message_unref(call);
+
+  appendArgs(reply, objects);
+  return reply;
+}
+
+//what one Properties.Get for the property would have come back with
+static DBusMessage * getReply(const Property & property) {
+  DBusMessage * call = dbus_message_new_method_call(BT_SERVICE, "/", "org.freedesktop.DBus.Properties", "Get");
+  dbus_message_set_serial(call, 1);
+  DBusMessage * reply = dbus_message_new_method_return(call);
+  dbus_message_unref(call);
+
+  appendArgs(reply, property);
+  return reply;
+}
+
+
+//the removed Device::getString/getShort/getBool, minus the blocking call: a fresh std::string
+//for the name, a fresh request message, then the reply read out the old way
+struct OldGetter {
+  const char * path;
+  DBusMessage * reply;
+
+  DBusMessage * request(std::string property) {
+    const char * interface = DEVICE_INTERFACE;
+    const char * propertyCStr = property.c_str();
+
+    DBusMessage * msg = dbus_message_new_method_call(BT_SERVICE, path, "org.freedesktop.DBus.Properties", "Get");
+    dbus_message_append_args(msg, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &propertyCStr, DBUS_TYPE_INVALID);
+    return msg;
+  }
+
+  std::optional<std::string> getString(std::string property) {
+    DBusMessage * msg = request(property);
+    std::optional<std::string> retval;
+
+    DBusMessageIter iter;
+    dbus_message_iter_init(reply, &iter);
+    dbus_message_iter_recurse(&iter, &iter);
+
+    const char * result;
+    if(dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_STRING) {
+      dbus_message_iter_get_basic(&iter, &result);
+      retval = std::string(result);
+    }
+
+    dbus_message_unref(msg);
+    return retval;
+  }
+
+  std::optional<short> getShort(std::string property) {
+    DBusMessage * msg = request(property);
+    std::optional<bool> retval;
+
+    DBusMessageIter iter;
+    dbus_message_iter_init(reply, &iter);
+    dbus_message_iter_recurse(&iter, &iter);
+
+    if(dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_INT16) {
+      int result = 0;
+      dbus_message_iter_get_basic(&iter, &result);
+      retval = result;
+    }
+
+    dbus_message_unref(msg);
+    return retval;
+  }
+
+  std::optional<bool> getBool(std::string property) {
+    DBusMessage * msg = request(property);
+    std::optional<bool> retval;
+
+    DBusMessageIter iter;
+    dbus_message_iter_init(reply, &iter);
+    dbus_message_iter_recurse(&iter, &iter);
+
+    if(dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_BOOLEAN) {
+      dbus_bool_t result;
+      dbus_message_iter_get_basic(&iter, &result);
+      retval = result;
+    }
+
+    dbus_message_unref(msg);
+    return retval;
+  }
+};
+
+struct ParsedDevice {
+  std::string_view alias;
+  std::string_view address;
+  std::string_view addressType;
+  bool connected;
+  bool bonded;
+  int16_t rssi;
+};
+
+//the walk applyManagedObjects and Device::applyProperties do, into views instead of owned strings
+static int walkManagedObjects(DBusMessage * reply, ParsedDevice * parsed) {
+  DBusMessageIter iter, objects;
+  int count = 0;
+
+  dbus_message_iter_init(reply, &iter);
+  dbus_message_iter_recurse(&iter, &objects);
+
+  while(dbus_message_iter_get_arg_type(&objects) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter object, properties;
+    ObjectPath path;
+
+    dbus_message_iter_recurse(&objects, &object);
+
+    if(readValue(&object, path) && !strncmp(path.path, DEVICES_PATH, strlen(DEVICES_PATH))) {
+      dbus_message_iter_next(&object);
+
+      if(findEntry(&object, DEVICE_INTERFACE, &properties)) {
+        ParsedDevice & device = parsed[count++];
+
+        forEachProperty(&properties, [&](std::string_view name, DBusMessageIter * value){
+          if(name == "Alias") readValue(value, device.alias);
+          else if(name == "Address") readValue(value, device.address);
+          else if(name == "AddressType") readValue(value, device.addressType);
+          else if(name == "Connected") readValue(value, device.connected);
+          else if(name == "Bonded") readValue(value, device.bonded);
+          else if(name == "RSSI") readValue(value, device.rssi);
+        });
+      }
+    }
+
+    dbus_message_iter_next(&objects);
+  }
+
+  return count;
+}
+
+static void benchParse() {
+  std::vector<CannedDevice> devices = cannedDevices();
+  DBusMessage * reply = managedObjectsReply(devices);
+
+  const char * names[] = {"Alias", "Connected", "Bonded", "Address", "RSSI"};
+  std::vector<std::array<DBusMessage*, 5>> getReplies;
+  for(CannedDevice & device : devices) {
+    std::array<DBusMessage*, 5> replies;
+    for(int i = 0; i < 5; i++) replies[i] = getReply(device.properties[names[i]]);
+    getReplies.push_back(replies);
+  }
+
+  uint64_t parsed = 0;
+  uint64_t before = allocations.load();
+  auto start = BenchClock::now();
+
+  for(int round = 0; round < BENCH_PARSE_ROUNDS; round++) {
+    for(size_t i = 0; i < devices.size(); i++) {
+      OldGetter getter{devices[i].path.c_str(), nullptr};
+      getter.reply = getReplies[i][0];
+      auto alias = getter.getString("Alias");
+      getter.reply = getReplies[i][1];
+      auto connected = getter.getBool("Connected");
+      getter.reply = getReplies[i][2];
+      auto bonded = getter.getBool("Bonded");
+      getter.reply = getReplies[i][3];
+      auto address = getter.getString("Address");
+      getter.reply = getReplies[i][4];
+      auto rssi = getter.getShort("RSSI");
+      parsed += alias.has_value() + connected.has_value() + bonded.has_value() + address.has_value() + rssi.has_value();
+    }
+  }
+
+  uint64_t count = BENCH_PARSE_ROUNDS * devices.size();
+  double oldNs = nsSince(start, count);
+  double oldAllocations = double(allocations.load() - before) / count;
+
+  std::cout << "old getters, round trips not counted: " << oldNs << " ns/device, " << oldAllocations << " allocations/device\n";
+
+  std::vector<ParsedDevice> views(devices.size());
+  before = allocations.load();
+  start = BenchClock::now();
+
+  for(int round = 0; round < BENCH_PARSE_ROUNDS; round++) parsed += walkManagedObjects(reply, views.data());
+
+  uint64_t walkAllocations = allocations.load() - before;
+  std::cout << "managed objects walk: " << nsSince(start, count) << " ns/device, " << double(walkAllocations) / count << " allocations/device\n";
+  if(walkAllocations) std::cout << "FAIL the property walk allocated\n";
+
+  //the real thing, which also copies the strings each Device keeps
+  std::vector<Device> built;
+  built.reserve(devices.size());
+  before = allocations.load();
+  start = BenchClock::now();
+
+  for(int round = 0; round < BENCH_PARSE_ROUNDS; round++) {
+    built.clear();
+
+    DBusMessageIter iter, objects;
+    dbus_message_iter_init(reply, &iter);
+    dbus_message_iter_recurse(&iter, &objects);
+
+    while(dbus_message_iter_get_arg_type(&objects) == DBUS_TYPE_DICT_ENTRY) {
+      DBusMessageIter object, properties;
+      ObjectPath path;
+
+      dbus_message_iter_recurse(&objects, &object);
+      if(readValue(&object, path) && !strncmp(path.path, DEVICES_PATH, strlen(DEVICES_PATH))) {
+        dbus_message_iter_next(&object);
+        if(findEntry(&object, DEVICE_INTERFACE, &properties)) built.push_back(Device(path.path, nullptr, &properties));
+      }
+
+      dbus_message_iter_next(&objects);
+    }
+  }
+
+  std::cout << "Device construction: " << nsSince(start, count) << " ns/device, " << double(allocations.load() - before) / count << " allocations/device\n";
+
+  if(built.size() != devices.size() || parsed == 0 || views[1].addressType != "random" || built[5].getRSSI() != -45) {
+    std::cout << "FAIL the parsed devices don't match the canned ones\n";
+  }
+
+  for(auto & replies : getReplies) for(DBusMessage * message : replies) dbus_message_unref(message);
+  dbus_message_unref(reply);
+}
+
+
+//every pass FrameRenderer::render makes over one strip, with the kernel set picked by the caller
+static void renderWith(const PixelKernels & kernels, PixelPlanes & off, PixelPlanes & on, PixelPlanes & out, const uint8_t * gamma, uint16_t t, uint8_t * frame) {
+  uint64_t total = 0;
+
+  for(int c = 0; c < 3; c++) {
+    kernels.lerp(out.channels[c], off.channels[c], on.channels[c], t, out.padded);
+    kernels.lookup(out.channels[c], gamma, out.padded);
+    total += kernels.sum(out.channels[c], out.padded);
+  }
+
+  //always dimmed, so the scale pass is part of every frame
+  uint16_t factor = total ? std::min<uint64_t>(256, (total / 2 << 8) / total) : 256;
+  for(int c = 0; c < 3; c++) kernels.scale(out.channels[c], factor, out.padded);
+
+  kernels.interleave(frame, out.channels[1], out.channels[0], out.channels[2], out.count);
+}
+
+static void benchPixels() {
+  PixelArena arena(planesSize(BENCH_PIXELS) * 3);
+  PixelPlanes off = allocatePlanes(arena, BENCH_PIXELS);
+  PixelPlanes on = allocatePlanes(arena, BENCH_PIXELS);
+  PixelPlanes out = allocatePlanes(arena, BENCH_PIXELS);
+
+  std::array<uint8_t, 256> gamma;
+  for(int i = 0; i < 256; i++) gamma[i] = i * i / 255;
+  for(int i = 0; i < BENCH_PIXELS; i++) {
+    for(int c = 0; c < 3; c++) on.channels[c][i] = i * 7 + c * 85;
+  }
+
+  std::vector<uint8_t> frame(BENCH_PIXELS * 3);
+  std::vector<uint8_t> reference(BENCH_PIXELS * 3);
+  uint64_t count = uint64_t(BENCH_FRAMES) * BENCH_PIXELS;
+
+  renderWith(pixelKernels(PixelIsa::Scalar), off, on, out, gamma.data(), 180, reference.data());
+
+  for(PixelIsa isa : {PixelIsa::Scalar, PixelIsa::Sse2, PixelIsa::Avx2}) {
+    if(isa > detectPixelIsa()) continue;
+    const PixelKernels & kernels = pixelKernels(isa);
+
+    auto start = BenchClock::now();
+    for(int i = 0; i < BENCH_FRAMES; i++) renderWith(kernels, off, on, out, gamma.data(), i & 0xff, frame.data());
+    std::cout << formatPixelIsa(isa) << " kernels: " << nsSince(start, count) << " ns/pixel\n";
+
+    renderWith(kernels, off, on, out, gamma.data(), 180, frame.data());
+    if(frame != reference) std::cout << "FAIL " << formatPixelIsa(isa) << " renders differently from scalar\n";
+  }
+
+  std::vector<PixelZone> zones;
+  for(int i = 0; i < BENCH_ZONES; i++) {
+    uint8_t shade = 25 * (i + 1);
+    zones.push_back(PixelZone{size_t(i) * BENCH_PIXELS / BENCH_ZONES, BENCH_PIXELS / BENCH_ZONES, {shade, 200, uint8_t(255 - shade)}});
+  }
+
+  FrameRenderer renderer(BENCH_PIXELS, zones, 2.2f, 0.4f, ColorOrder::GRB);
+
+  uint64_t before = allocations.load();
+  auto start = BenchClock::now();
+  for(int i = 0; i < BENCH_FRAMES; i++) renderer.render((i & 0xff) / 255.0f, frame.data());
+  double ns = nsSince(start, count);
+  uint64_t renderAllocations = allocations.load() - before;
+
+  //how much of one core a whole strip takes at the frame rate
+  double load = ns * BENCH_PIXELS * BENCH_FPS / 1e9;
+  std::cout << "FrameRenderer, " << BENCH_PIXELS << " pixels in " << BENCH_ZONES << " zones with " << formatPixelIsa(renderer.getIsa()) << ": " <<
+    ns << " ns/pixel, " << 100 * load << "% of a core at " << BENCH_FPS << " fps, " << double(renderAllocations) / BENCH_FRAMES << " allocations/frame\n";
+  if(renderAllocations) std::cout << "FAIL rendering allocated\n";
+}
+
+
+struct ReceivedStats {
+  uint64_t packets = 0;
+  uint64_t frames = 0;
+  uint64_t totalJitterNs = 0;
+  uint64_t maxJitterNs = 0;
+};
+
+//what a pixel controller would see: a frame ends at its push packet, and jitter is how far the
+//gap between two frames strays from the period
+static void receive(int sock, std::chrono::nanoseconds period, std::atomic<bool> & running, ReceivedStats & stats) {
+  uint8_t packet[DDP_HEADER_SIZE + DDP_MAX_DATA];
+  std::optional<BenchClock::time_point> lastFrame;
+
+  while(running) {
+    ssize_t length = recv(sock, packet, sizeof(packet), 0);
+    if(length < DDP_HEADER_SIZE) continue;
+
+    auto now = BenchClock::now();
+    stats.packets++;
+    if(!(packet[0] & DDP_FLAGS_PUSH)) continue;
+
+    //keepalives come a second apart, only paced frames say anything about the clock
+    if(lastFrame && now - *lastFrame < 2 * period) {
+      uint64_t ns = std::abs((now - *lastFrame - period).count());
+      stats.totalJitterNs += ns;
+      stats.maxJitterNs = std::max(stats.maxJitterNs, ns);
+      stats.frames++;
+    }
+    lastFrame = now;
+  }
+}
+
+static void benchLed(int fps) {
+  int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+  sockaddr_in address{};
+  address.sin_family = AF_INET;
+  address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  socklen_t length = sizeof(address);
+
+  int buffer = 4 << 20;
+  timeval timeout{0, 100000};
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+  if(bind(sock, reinterpret_cast<sockaddr*>(&address), sizeof(address)) || getsockname(sock, reinterpret_cast<sockaddr*>(&address), &length)) {
+    std::cout << "FAIL could not open a receiver on loopback\n";
+    close(sock);
+    return;
+  }
+
+  LEDConfig config;
+  config.host = "127.0.0.1";
+  config.port = ntohs(address.sin_port);
+  config.pixels = BENCH_PIXELS;
+  config.fps = fps;
+  config.fadeIn = BENCH_FADE;
+
+  auto period = std::chrono::nanoseconds(std::chrono::seconds(1)) / fps;
+  std::atomic<bool> running = true;
+  ReceivedStats received;
+  std::thread receiver(receive, sock, period, std::ref(running), std::ref(received));
+
+  FrameStats sent;
+  double seconds;
+  {
+    LEDConnection led(config);
+    FrameStats before = led.getStats();
+    auto start = BenchClock::now();
+
+    led.setLights(true);
+    std::this_thread::sleep_for(BENCH_FADE);
+
+    sent = led.getStats();
+    seconds = std::chrono::duration<double>(BenchClock::now() - start).count();
+    sent.packets -= before.packets;
+  }
+
+  std::this_thread::sleep_for(std::chrono::milliseconds(200));
+  running = false;
+  receiver.join();
+  close(sock);
+
+  std::cout << "led at " << fps << " fps, " << BENCH_PIXELS << " pixels: sent " << (uint64_t) (sent.packets / seconds) << " packets/s, " <<
+    sent.sendFailures << " send failures, " << sent.skippedFrames << " skipped, clock jitter avg " <<
+    (sent.ticks ? sent.totalJitterNs / sent.ticks / 1000 : 0) << "us max " << sent.maxJitterNs / 1000 << "us; received " <<
+    (uint64_t) (received.packets / seconds) << " packets/s, frame gap jitter avg " <<
+    (received.frames ? received.totalJitterNs / received.frames / 1000 : 0) << "us max " << received.maxJitterNs / 1000 << "us\n";
+
+  if(received.packets < sent.packets) std::cout << "FAIL " << sent.packets - received.packets << " packets never arrived\n";
+}
+
+
+//the writer below flips every key on each publish, so a whole snapshot has every key in the state
+//its generation says, and every zone counting the keys present in it
+static bool consistent(const PresenceSnapshot & snapshot) {
+  if(snapshot.keyCount == 0) return false;
+  bool present = (snapshot.generation / snapshot.keyCount) % 2;
+
+  for(int i = 0; i < snapshot.keyCount; i++) {
+    if(snapshot.keys[i].present != present) return false;
+  }
+  for(int i = 0; i < snapshot.zoneCount; i++) {
+    uint16_t expected = 0;
+    for(int j = 0; j < snapshot.keyCount; j++) expected += snapshot.keys[j].zone == snapshot.zones[i].zone && snapshot.keys[j].present;
+    if(snapshot.zones[i].present != expected) return false;
+  }
+  return true;
+}
+
+static void benchPresence() {
+  std::vector<Key> keys;
+  for(int i = 0; i < PRESENCE_MAX_KEYS; i++) {
+    char line[48];
+    snprintf(line, sizeof(line), "AA:BB:CC:DD:EE:%02X zone=%d", i, i % PRESENCE_MAX_ZONES);
+    keys.push_back(*parseKey(line));
+  }
+
+  PresencePublisher publisher(keys, BENCH_PRESENCE_NAME);
+  PresenceReader reader(BENCH_PRESENCE_NAME);
+  if(!publisher.isOpen() || !reader.isOpen()) {
+    std::cout << "FAIL could not open the presence segment\n";
+    return;
+  }
+
+  PresenceSnapshot snapshot;
+  uint64_t reads = 0;
+  auto start = BenchClock::now();
+  while(BenchClock::now() - start < BENCH_PRESENCE_TIME / 4) {
+    for(int i = 0; i < 1000; i++) reads += reader.read(snapshot);
+  }
+  std::cout << "presence read, writer idle: " << nsSince(start, reads) << " ns/read\n";
+
+  std::atomic<bool> running = true;
+  std::atomic<uint64_t> publishes = 0;
+  std::thread writer([&](){
+    bool present = false;
+    while(running.load(std::memory_order_relaxed)) {
+      present = !present;
+      for(int i = 0; i < keys.size(); i++) publisher.setPresent(i, present);
+      publisher.publish();
+      publishes.fetch_add(1, std::memory_order_relaxed);
+    }
+  });
+
+  //the same copy with no sequence check, to show the writer really does tear an unguarded one
+  int fd = shm_open(BENCH_PRESENCE_NAME, O_RDONLY, 0);
+  void * raw = mmap(nullptr, sizeof(PresenceShared), PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  uint64_t rawReads = 0, torn = 0;
+  start = BenchClock::now();
+  while(BenchClock::now() - start < BENCH_PRESENCE_TIME / 4) {
+    memcpy(&snapshot, &static_cast<const PresenceShared*>(raw)->snapshot, sizeof(snapshot));
+    rawReads++;
+    torn += !consistent(snapshot);
+  }
+  munmap(raw, sizeof(PresenceShared));
+
+  reads = 0;
+  uint64_t failed = 0, inconsistent = 0;
+  uint64_t publishedBefore = publishes.load();
+  start = BenchClock::now();
+  while(BenchClock::now() - start < BENCH_PRESENCE_TIME) {
+    for(int i = 0; i < 1000; i++) {
+      if(!reader.read(snapshot)) failed++;
+      else inconsistent += !consistent(snapshot);
+      reads++;
+    }
+  }
+  double ns = nsSince(start, reads);
+  uint64_t published = publishes.load() - publishedBefore;
+
+  running = false;
+  writer.join();
+  shm_unlink(BENCH_PRESENCE_NAME);
+
+  std::cout << "presence read against a writer publishing " << published << " times/s: " << ns << " ns/read, " << reads << " reads, "
+    << inconsistent << " inconsistent, " << failed << " gave up; unguarded copies torn " << torn << " of " << rawReads << '\n';
+  if(inconsistent || failed) std::cout << "FAIL a read returned a torn snapshot or gave up\n";
+}
+
+
+//a segment laid out the way EventLog writes one, preallocated past its records like the one in use
+static bool writeSegment(const std::string & path, const LogRecord * records, size_t count) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if(fd < 0) return false;
+
+  uint8_t header[LOG_HEADER_SIZE] = {};
+  uint32_t version = 1;
+  uint32_t recordSize = sizeof(LogRecord);
+  memcpy(header, LOG_MAGIC, 8);
+  memcpy(header + 8, &version, 4);
+  memcpy(header + 12, &recordSize, 4);
+  memcpy(header + 16, &records[0].timestampMs, 8);
+
+  bool ok = write(fd, header, sizeof(header)) == sizeof(header);
+  ok = ok && write(fd, records, count * sizeof(LogRecord)) == (ssize_t) (count * sizeof(LogRecord));
+  ok = ok && ftruncate(fd, LOG_HEADER_SIZE + (off_t) LOG_SEGMENT_RECORDS * sizeof(LogRecord)) == 0;
+  close(fd);
+  return ok;
+}
+
+static void benchOccupancy() {
+  char name[] = "/tmp/bluelight-bench.XXXXXX";
+  if(!mkdtemp(name)) {
+    std::cout << "FAIL could not make a directory for the log\n";
+    return;
+  }
+  std::string directory = name;
+
+  std::mt19937 random(1);
+  std::uniform_int_distribution<int64_t> minute(0, 24 * 60 - 1);
+  int64_t day = 24 * 3600 * 1000LL;
+  int64_t start = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count() - BENCH_LOG_DAYS * day;
+
+  //each key's visits are spread over its day, sorted so the log stays in time order
+  std::vector<LogRecord> records;
+  records.push_back(LogRecord{start, 0, 0, 0, LogEventType::Start, 0, {}});
+  for(int d = 0; d < BENCH_LOG_DAYS; d++) {
+    std::vector<LogRecord> today;
+
+    for(int key = 0; key < BENCH_LOG_KEYS; key++) {
+      std::vector<int64_t> times;
+      for(int i = 0; i < 2 * BENCH_LOG_VISITS; i++) times.push_back(start + d * day + minute(random) * 60000);
+      std::sort(times.begin(), times.end());
+
+      for(int i = 0; i < times.size(); i++) {
+        LogEventType type = i % 2 ? LogEventType::Departed : LogEventType::Arrived;
+        today.push_back(LogRecord{times[i], (uint32_t) key + 1, (uint16_t) (key % BENCH_LOG_ZONES), -60, type, 0, {}});
+      }
+    }
+
+    std::sort(today.begin(), today.end(), [](const LogRecord & a, const LogRecord & b){ return a.timestampMs < b.timestampMs; });
+    records.insert(records.end(), today.begin(), today.end());
+  }
+
+  size_t segments = 0;
+  for(size_t at = 0; at < records.size(); at += LOG_SEGMENT_RECORDS) {
+    char file[64];
+    snprintf(file, sizeof(file), "/presence-%016lld.log", (long long) records[at].timestampMs);
+    if(!writeSegment(directory + file, records.data() + at, std::min(records.size() - at, (size_t) LOG_SEGMENT_RECORDS))) {
+      std::cout << "FAIL could not write the log\n";
+      return;
+    }
+    segments++;
+  }
+
+  auto begin = BenchClock::now();
+  std::vector<OccupancyRow> rows = occupiedMinutes(directory);
+  auto took = BenchClock::now() - begin;
+
+  std::cout << "occupancy over " << BENCH_LOG_DAYS << " days, " << records.size() << " records in " << segments << " segments: "
+    << std::chrono::duration<double, std::milli>(took).count() << " ms, " << rows.size() << " zone days\n";
+
+  if(took >= OCCUPANCY_TARGET) std::cout << "FAIL a year of log took longer than " << OCCUPANCY_TARGET.count() << "s\n";
+  if(rows.size() < (BENCH_LOG_DAYS - 1) * BENCH_LOG_ZONES) std::cout << "FAIL zone days are missing\n";
+
+  std::error_code error;
+  std::filesystem::remove_all(directory, error);
+}
+
+
+//mirrors BluetoothThread::verifyTask, which keeps its own copy of the device
+static Task<void> probe(Device device, Deadline deadline, CancelToken cancel) {
+  co_await device.verifyProximity(deadline, cancel);
+}
+
+//every probe parked in a Connect that never gets answered, which is where a real one spends its time
+static void benchTasks() {
+  //a server nobody services, so the calls go out and stay pending
+  DBusServer * server = dbus_server_listen("unix:tmpdir=/tmp", nullptr);
+  char * address = server ? dbus_server_get_address(server) : nullptr;
+  DBusConnection * connection = address ? dbus_connection_open_private(address, nullptr) : nullptr;
+  dbus_free(address);
+  if(!connection) {
+    std::cout << "FAIL could not open a connection for the task bench\n";
+    return;
+  }
+
+  std::vector<CannedDevice> canned = cannedDevices();
+  DBusMessage * reply = managedObjectsReply(canned);
+
+  //the first canned device is bonded, so its probe pages it
+  std::optional<Device> device;
+  DBusMessageIter iter, objects, object, properties;
+  ObjectPath path;
+  dbus_message_iter_init(reply, &iter);
+  dbus_message_iter_recurse(&iter, &objects);
+  dbus_message_iter_recurse(&objects, &object);
+  readValue(&object, path);
+  dbus_message_iter_next(&object);
+  if(findEntry(&object, DEVICE_INTERFACE, &properties)) device.emplace(path.path, connection, &properties);
+
+  {
+    Scheduler scheduler;
+    scheduler.makeCurrent();
+
+    CancelToken cancel = CancelToken::create();
+    Deadline deadline = std::chrono::steady_clock::now() + std::chrono::seconds(60);
+
+    uint64_t before = allocations.load();
+    auto start = BenchClock::now();
+
+    for(int i = 0; i < BENCH_TASKS; i++) scheduler.spawn(probe(*device, deadline, cancel));
+    scheduler.run();
+
+    double ns = nsSince(start, BENCH_TASKS);
+    TaskStats stats = taskStats();
+    double perFrame = stats.live ? double(stats.bytes) / stats.live : 0;
+
+    std::cout << "suspended probes: " << scheduler.spawnedCount() << " tasks, " << stats.live << " frames, " << stats.bytes / BENCH_TASKS
+      << " bytes/task, " << perFrame << " bytes/frame, " << double(allocations.load() - before) / BENCH_TASKS << " allocations/task, "
+      << ns << " ns/task to spawn and park\n";
+
+    if(scheduler.spawnedCount() != BENCH_TASKS) std::cout << "FAIL not every probe is still parked\n";
+    if(perFrame > TASK_FRAME_BUDGET) std::cout << "FAIL task frames are over " << TASK_FRAME_BUDGET << " bytes\n";
+  }
+
+  if(taskStats().live) std::cout << "FAIL " << taskStats().live << " frames outlived their scheduler\n";
+
+  device.reset();
+  dbus_message_unref(reply);
+  dbus_connection_close(connection);
+  dbus_connection_unref(connection);
+  dbus_server_disconnect(server);
+  dbus_server_unref(server);
+}
+
+
+int main() {
+  benchParse();
+  benchPixels();
+  benchTasks();
+  benchOccupancy();
+  benchPresence();
+  benchLed(50);
+  benchLed(200);
+  return 0;
+}
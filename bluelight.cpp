@@ -20,12 +20,13 @@ DBusHandlerResult BluetoothController::signalHandler(DBusConnection * connection
 
   std::string method = dbus_message_get_member(message);
 
+  //only noted here, the owner refreshes once for however many arrive, without blocking dispatch
   if(!method.compare("InterfacesAdded")) {
-    controller->updateDevices();
+    controller->refreshRequested = true;
     return DBUS_HANDLER_RESULT_HANDLED;
   }
   if(!method.compare("InterfacesRemoved")) {
-    controller->updateDevices();
+    controller->refreshRequested = true;
     return DBUS_HANDLER_RESULT_HANDLED;
   }
 
@@ -47,7 +48,49 @@ DBusHandlerResult BluetoothController::methodCallHandler(DBusConnection * connec
     return DBUS_HANDLER_RESULT_HANDLED;
   }
   else {
-    std::cerr << method << std::endl;
+    std::cerr << method << '\n';
+  }
+
+  return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+
+DBusHandlerResult BluetoothController::connectionFilter(DBusConnection * connection, DBusMessage * message, void * userData) {
+  BluetoothController * controller = static_cast<BluetoothController*>(userData);
+
+  controller->messagesReceived.fetch_add(1, std::memory_order_relaxed);
+
+  //teardown happens in poll(), the connection can't be dropped from inside its own dispatch
+  if(dbus_message_is_signal(message, DBUS_INTERFACE_LOCAL, "Disconnected")) {
+    controller->bluezAvailable = false;
+    controller->pendingResync = false;
+    return DBUS_HANDLER_RESULT_HANDLED;
+  }
+
+  if(dbus_message_is_signal(message, DBUS_INTERFACE_DBUS, "NameOwnerChanged")) {
+    const char * name;
+    const char * oldOwner;
+    const char * newOwner;
+
+    if(!dbus_message_get_args(message, nullptr,
+        DBUS_TYPE_STRING, &name,
+        DBUS_TYPE_STRING, &oldOwner,
+        DBUS_TYPE_STRING, &newOwner,
+        DBUS_TYPE_INVALID)) return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    if(strcmp(name, BT_SERVICE)) return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+    if(strlen(newOwner) > 0) {
+      std::cerr << "bluez appeared on the bus, resyncing" << '\n';
+      controller->bluezAvailable = true;
+      controller->pendingResync = true;
+      controller->bluezReturnedAt = std::chrono::steady_clock::now();
+      controller->nextResyncAttempt = controller->bluezReturnedAt;
+    } else {
+      std::cerr << "bluez left the bus, serving cached devices" << '\n';
+      controller->bluezAvailable = false;
+      controller->pendingResync = false;
+    }
   }
 
   return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
@@ -57,20 +100,30 @@ DBusHandlerResult BluetoothController::methodCallHandler(DBusConnection * connec
 void BluetoothController::registerForSignals() {
   DBusError err;
   dbus_error_init(&err);
+
   dbus_bus_add_match(connection, SIGNAL_MATCH_RULES, &err);
+  if(dbus_error_is_set(&err)) logError("adding signal match", &err);
+
+  dbus_bus_add_match(connection, OWNER_MATCH_RULES, &err);
+  if(dbus_error_is_set(&err)) logError("adding owner match", &err);
 }
 
 
-BluetoothController::BluetoothController() {
-  pendingDevicesUpdate = false;
-
+bool BluetoothController::connect() {
   DBusError err;
   dbus_error_init(&err);
-  
+
   connection = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
-  if(!connection) fail(err);
+  if(!connection) {
+    if(!connectFailed) logError("connecting to system bus", &err);
+    else dbus_error_free(&err);
+    connectFailed = true;
+    return false;
+  }
+  connectFailed = false;
 
-  onDevicesUpdated = nullptr;
+  //a dropped bus is recovered from in poll() instead of exiting the process
+  dbus_connection_set_exit_on_disconnect(connection, false);
 
   DBusObjectPathVTable vtable = {
     .message_function = BluetoothController::incomingMessageHandler
@@ -78,21 +131,104 @@ BluetoothController::BluetoothController() {
   dbus_connection_register_object_path(connection, APP_PATH, &vtable, this);
   dbus_connection_register_object_path(connection, "/", &vtable, this);
 
-  dbus_connection_set_watch_functions(connection, addWatchFunction, removeWatchFunction, NULL, &watches, freeWatchFunction);
+  for(ExportedPath & exported : exports) registerExport(exported);
+  for(std::string & name : ownedNames) claimName(name);
+
+  dbus_connection_add_filter(connection, connectionFilter, this, nullptr);
 
-  registerAgent();
+  dbus_connection_set_watch_functions(connection, addWatchFunction, removeWatchFunction, NULL, &watches, freeWatchFunction);
 
   registerForSignals();
+
+  bluezAvailable = dbus_bus_name_has_owner(connection, BT_SERVICE, &err);
+  if(dbus_error_is_set(&err)) logError("looking up bluez", &err);
+
+  return true;
+}
+
+
+void BluetoothController::dropConnection() {
+  std::cerr << "lost the system bus, serving cached devices" << '\n';
+
+  dbus_connection_set_watch_functions(connection, NULL, NULL, NULL, NULL, NULL);
+  watches.clear();
+
+  dbus_connection_remove_filter(connection, connectionFilter, this);
+  dbus_connection_unregister_object_path(connection, "/");
+  dbus_connection_unregister_object_path(connection, APP_PATH);
+  for(ExportedPath & exported : exports) dbus_connection_unregister_object_path(connection, exported.path.c_str());
+
+  if(staleConnection) dbus_connection_unref(staleConnection);
+  staleConnection = connection;
+  connection = nullptr;
+
+  bluezAvailable = false;
+  pendingResync = false;
+  nextReconnectAttempt = std::chrono::steady_clock::now();
+}
+
+
+bool BluetoothController::resync() {
+  if(!registerAgent(RECOVERY_CALL_TIMEOUT_MS)) return false;
+
+  //devices built on a dropped connection can't be reused, rebuild them all
+  std::vector<Device> cachedDevices = devices;
+  if(staleConnection) devices.clear();
+
+  if(!updateDevices(RECOVERY_CALL_TIMEOUT_MS)) {
+    devices = cachedDevices;
+    return false;
+  }
+
+  if(staleConnection) {
+    dbus_connection_unref(staleConnection);
+    staleConnection = nullptr;
+  }
+
+  generation++;
+  pendingResync = false;
+  lastRecoveryTime = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - bluezReturnedAt);
+
+  std::cerr << "resynced with bluez in " << lastRecoveryTime->count() << "ms" << '\n';
+
+  return true;
+}
+
+
+BluetoothController::BluetoothController() {
+  connection = nullptr;
+  staleConnection = nullptr;
+  connectFailed = false;
+
+  pendingDevicesUpdate = false;
+  refreshRequested = false;
+  bluezAvailable = false;
+  pendingResync = false;
+  generation = 0;
+  messagesReceived = 0;
+
+  onDevicesUpdated = nullptr;
+
+  if(!connect()) {
+    nextReconnectAttempt = std::chrono::steady_clock::now() + RECONNECT_INTERVAL;
+    return;
+  }
+
+  if(bluezAvailable) registerAgent(DBUS_TIMEOUT_USE_DEFAULT);
 }
 
 
 BluetoothController::~BluetoothController() {
   if(connection) {
-    unregisterAgent();
+    if(bluezAvailable) unregisterAgent();
+    dbus_connection_set_watch_functions(connection, NULL, NULL, NULL, NULL, NULL);
+    dbus_connection_remove_filter(connection, connectionFilter, this);
     dbus_connection_unregister_object_path(connection, "/");
     dbus_connection_unregister_object_path(connection, APP_PATH);
+    for(ExportedPath & exported : exports) dbus_connection_unregister_object_path(connection, exported.path.c_str());
     dbus_connection_unref(connection);
   }
+  if(staleConnection) dbus_connection_unref(staleConnection);
 }
 
 
@@ -115,23 +251,36 @@ void BluetoothController::removeWatchFunction(DBusWatch * watch, void * data) {
 void BluetoothController::freeWatchFunction(void* memory){}
 
 
-void BluetoothController::pollWatches() {
+void BluetoothController::pollWatches(int timeoutMs, int wakeFd) {
+  std::vector<pollfd> fds;
+  std::vector<DBusWatch*> polled;
+
   for(DBusWatch * watch : watches) {
-    if(dbus_watch_get_enabled(watch)) {
-      int fd = dbus_watch_get_unix_fd(watch);
-      int flags = dbus_watch_get_flags(watch);
-      pollfd pollResults{
-        fd,
-        POLLIN | POLLOUT,
-      };
-      ::poll(&pollResults, 1, 0);
-
-      if(flags & DBUS_WATCH_READABLE && pollResults.revents && POLLIN) {
-        dbus_watch_handle(watch, DBUS_WATCH_READABLE);
-      }
-      if(flags & DBUS_WATCH_WRITABLE && pollResults.revents && POLLOUT) {
-        dbus_watch_handle(watch, DBUS_WATCH_WRITABLE);
-      }
+    if(!dbus_watch_get_enabled(watch)) continue;
+
+    int flags = dbus_watch_get_flags(watch);
+    short events = 0;
+    if(flags & DBUS_WATCH_READABLE) events |= POLLIN;
+    if(flags & DBUS_WATCH_WRITABLE) events |= POLLOUT;
+
+    fds.push_back(pollfd{dbus_watch_get_unix_fd(watch), events, 0});
+    polled.push_back(watch);
+  }
+
+  if(wakeFd >= 0) fds.push_back(pollfd{wakeFd, POLLIN, 0});
+
+  if(::poll(fds.data(), fds.size(), timeoutMs) <= 0) return;
+
+  //handling a watch can add or remove others, so only touch the ones collected above
+  for(int i = 0; i < polled.size(); i++) {
+    unsigned int condition = 0;
+    if(fds[i].revents & POLLIN) condition |= DBUS_WATCH_READABLE;
+    if(fds[i].revents & POLLOUT) condition |= DBUS_WATCH_WRITABLE;
+    if(fds[i].revents & POLLHUP) condition |= DBUS_WATCH_HANGUP;
+    if(fds[i].revents & POLLERR) condition |= DBUS_WATCH_ERROR;
+
+    if(condition && std::find(watches.begin(), watches.end(), polled[i]) != watches.end()) {
+      dbus_watch_handle(polled[i], condition);
     }
   }
 }
@@ -139,9 +288,8 @@ void BluetoothController::pollWatches() {
 
 
 
-void BluetoothController::updateDevices() {
-  //TODO: persist existing devices
-  std::vector<Device> newDevices;
+bool BluetoothController::updateDevices(int timeoutMs) {
+  if(!connection || !bluezAvailable) return false;
 
   DBusMessage * query;
   DBusMessage * reply;
@@ -150,44 +298,69 @@ void BluetoothController::updateDevices() {
 
   query = dbus_message_new_method_call(BT_SERVICE, "/", "org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
 
-  reply = dbus_connection_send_with_reply_and_block(connection, query, DBUS_TIMEOUT_USE_DEFAULT, &err);
+  reply = dbus_connection_send_with_reply_and_block(connection, query, timeoutMs, &err);
+  dbus_message_unref(query);
+
   if(!reply) {
-    dbus_message_unref(query);
-    return;
+    logError("fetching managed objects", &err);
+    return false;
   }
 
-  DBusMessageIter objects;
+  applyManagedObjects(reply);
+  dbus_message_unref(reply);
 
-  dbus_message_iter_init(reply, &objects);
-  dbus_message_iter_recurse(&objects, &objects);
+  return true;
+}
 
-  int curType = 0;
 
-  while((curType = dbus_message_iter_get_arg_type(&objects)) != DBUS_TYPE_INVALID) {
-    DBusMessageIter object;
-    dbus_message_iter_recurse(&objects, &object);
+Task<Reply> BluetoothController::getManagedObjects(Deadline deadline, CancelToken cancel) {
+  DBusMessage * query = dbus_message_new_method_call(BT_SERVICE, "/", "org.freedesktop.DBus.ObjectManager", "GetManagedObjects");
+  co_return co_await CallAwaiter(bluezAvailable ? connection : nullptr, query, deadline, cancel);
+}
 
-    const char * path_cstr;
 
-    dbus_message_iter_get_basic(&object, &path_cstr);
+bool BluetoothController::takeRefreshRequest() {
+  bool retval = refreshRequested;
+  refreshRequested = false;
+  return retval;
+}
+
+Task<bool> BluetoothController::refreshDevices(Deadline deadline) {
+  Reply reply = co_await getManagedObjects(deadline);
+  if(!reply.ok()) co_return false;
+
+  applyManagedObjects(reply.message);
+  co_return true;
+}
+
+
+void BluetoothController::applyManagedObjects(DBusMessage * reply) {
+  TraceSpan span("apply managed objects");
+  std::vector<Device> newDevices;
+
+  DBusMessageIter iter, objects;
 
-    std::string path(path_cstr);
+  if(!dbus_message_iter_init(reply, &iter) || dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY) return;
+  dbus_message_iter_recurse(&iter, &objects);
 
-    if(path.compare(0, strlen(DEVICES_PATH), DEVICES_PATH) == 0) {//if device
-      auto existingDevice = std::find_if(devices.begin(), devices.end(), [path](Device dev){
-        return dev.getPath() == path;
-      });
+  //every device's properties ride along in this one reply, so no per-device calls are needed
+  while(dbus_message_iter_get_arg_type(&objects) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter object, properties;
+    ObjectPath path;
 
-      if(existingDevice == devices.end() || (rand() % 20 == 0)) newDevices.push_back(Device(path, connection));
-      else newDevices.push_back(*existingDevice);
+    dbus_message_iter_recurse(&objects, &object);
+
+    if(readValue(&object, path) && !strncmp(path.path, DEVICES_PATH, strlen(DEVICES_PATH))) {
+      dbus_message_iter_next(&object);
+      //GATT services and characteristics live under the device paths too
+      if(findEntry(&object, DEVICE_INTERFACE, &properties)) {
+        newDevices.push_back(Device(path.path, connection, &properties));
+      }
     }
 
     dbus_message_iter_next(&objects);
   }
 
-  dbus_message_unref(query);
-  dbus_message_unref(reply);
-
   devices = newDevices;
 
   std::sort(devices.begin(), devices.end(), [](Device a, Device b){
@@ -203,52 +376,119 @@ std::vector<Device> BluetoothController::getDevices() {
 }
 
 
+std::optional<Device> BluetoothController::getDevice(std::string path) {
+  for(Device & device : devices) {
+    if(device.getPath() == path) return device;
+  }
+  return std::nullopt;
+}
+
+
 void BluetoothController::setOnDevicesUpdated(std::function<void()> callback) {
   onDevicesUpdated = callback;
 }
 
 
-void BluetoothController::startDiscovery() {
-  DBusMessage * msg;
-  DBusError err;
-  dbus_error_init(&err);
+Task<Reply> BluetoothController::call(DBusMessage * message, Deadline deadline, CancelToken cancel) {
+  co_return co_await CallAwaiter(bluezAvailable ? connection : nullptr, message, deadline, cancel);
+}
 
-  msg = dbus_message_new_method_call(BT_SERVICE, ADAPTER_PATH, "org.bluez.Adapter1", "StartDiscovery");
 
-  if(!dbus_connection_send_with_reply_and_block(connection, msg, -1, &err)) {
-    fail(err);
-  }
+bool BluetoothController::send(DBusMessage * message) {
+  bool sent = connection && dbus_connection_send(connection, message, nullptr);
+  dbus_message_unref(message);
+  return sent;
+}
 
 
-  dbus_message_unref(msg);
+void BluetoothController::exportPath(std::string path, DBusObjectPathMessageFunction handler, void * data) {
+  exports.push_back(ExportedPath{path, handler, data});
+  if(connection) registerExport(exports.back());
 }
 
+void BluetoothController::unexportPath(std::string path) {
+  for(int i = 0; i < exports.size(); i++) {
+    if(exports[i].path != path) continue;
+    if(connection) dbus_connection_unregister_object_path(connection, path.c_str());
+    exports.erase(exports.begin() + i);
+    return;
+  }
+}
 
-void BluetoothController::stopDiscovery() {
-  DBusMessage * msg;
-  DBusError err;
-  dbus_error_init(&err);
+void BluetoothController::requestName(std::string name) {
+  ownedNames.push_back(name);
+  if(connection) claimName(name);
+}
 
-  msg = dbus_message_new_method_call(BT_SERVICE, ADAPTER_PATH, "org.bluez.Adapter1", "StartDiscovery");
+void BluetoothController::registerExport(const ExportedPath & exported) {
+  DBusObjectPathVTable vtable = {
+    .message_function = exported.handler
+  };
+  dbus_connection_register_fallback(connection, exported.path.c_str(), &vtable, exported.data);
+}
 
-  dbus_connection_send(connection, msg, nullptr);
-  dbus_connection_flush(connection);
+void BluetoothController::claimName(const std::string & name) {
+  DBusError err;
+  dbus_error_init(&err);
 
-  dbus_message_unref(msg);
+  //without the name, clients can still reach the objects through our unique name
+  int result = dbus_bus_request_name(connection, name.c_str(), DBUS_NAME_FLAG_DO_NOT_QUEUE, &err);
+  if(dbus_error_is_set(&err)) logError("requesting bus name", &err);
+  else if(result != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER && result != DBUS_REQUEST_NAME_REPLY_ALREADY_OWNER) {
+    std::cerr << name << " is already owned on the bus" << '\n';
+  }
 }
 
 
 void BluetoothController::dispatch() {
-  dbus_connection_read_write_dispatch(connection, -1);
+  if(connection) dbus_connection_read_write_dispatch(connection, -1);
 }
 
 
-void BluetoothController::poll() {
-  pollWatches();
+void BluetoothController::poll(int timeoutMs, int wakeFd) {
+  auto now = std::chrono::steady_clock::now();
+
+  if(!connection && now >= nextReconnectAttempt) {
+    if(connect()) {
+      if(bluezAvailable) {
+        pendingResync = true;
+        bluezReturnedAt = now;
+        nextResyncAttempt = now;
+      }
+    } else {
+      nextReconnectAttempt = now + RECONNECT_INTERVAL;
+    }
+  }
+
+  if(!connection) {
+    auto untilReconnect = std::chrono::duration_cast<std::chrono::milliseconds>(nextReconnectAttempt - now).count();
+    pollfd wake{wakeFd, POLLIN, 0};
+    ::poll(&wake, wakeFd >= 0 ? 1 : 0, std::min<long>(timeoutMs, std::max<long>(untilReconnect, 0)));
+    return;
+  }
+
+  if(pendingResync) {
+    auto untilResync = std::chrono::duration_cast<std::chrono::milliseconds>(nextResyncAttempt - now).count();
+    timeoutMs = std::min<long>(timeoutMs, std::max<long>(untilResync, 0));
+  }
+
+  pollWatches(timeoutMs, wakeFd);
 
   int status;
-  while((status = dbus_connection_get_dispatch_status(connection) == DBUS_DISPATCH_DATA_REMAINS))
-      dbus_connection_dispatch(connection);
+  while((status = dbus_connection_get_dispatch_status(connection) == DBUS_DISPATCH_DATA_REMAINS)) {
+    TraceSpan span("bus dispatch");
+    dbus_connection_dispatch(connection);
+  }
+
+  if(!dbus_connection_get_is_connected(connection)) {
+    dropConnection();
+    return;
+  }
+
+  if(pendingResync && std::chrono::steady_clock::now() >= nextResyncAttempt) {
+    if(!resync()) nextResyncAttempt = std::chrono::steady_clock::now() + RESYNC_RETRY_INTERVAL;
+  }
+
   if(pendingDevicesUpdate) {
     pendingDevicesUpdate = false;
     if(onDevicesUpdated) onDevicesUpdated();
@@ -256,7 +496,28 @@ void BluetoothController::poll() {
 }
 
 
-void BluetoothController::registerAgent() {
+bool BluetoothController::isConnected() {
+  return connection != nullptr;
+}
+
+bool BluetoothController::isBluezAvailable() {
+  return bluezAvailable;
+}
+
+std::optional<std::chrono::milliseconds> BluetoothController::getLastRecoveryTime() {
+  return lastRecoveryTime;
+}
+
+uint64_t BluetoothController::getGeneration() {
+  return generation;
+}
+
+uint64_t BluetoothController::getMessagesReceived() {
+  return messagesReceived.load(std::memory_order_relaxed);
+}
+
+
+bool BluetoothController::registerAgent(int timeoutMs) {
   DBusMessage * msg = dbus_message_new_method_call(BT_SERVICE, BT_SERVICE_PATH, "org.bluez.AgentManager1", "RegisterAgent");
   const char * object_path = APP_PATH;
   const char * capability = "DisplayYesNo";
@@ -268,13 +529,22 @@ void BluetoothController::registerAgent() {
 
   dbus_error_init(&err);
 
-  DBusMessage * reply = dbus_connection_send_with_reply_and_block(connection, msg, -1, &err);
+  DBusMessage * reply = dbus_connection_send_with_reply_and_block(connection, msg, timeoutMs, &err);
   dbus_message_unref(msg);
 
   if(reply) {
     dbus_message_unref(reply);
-  } else {
+    return true;
+  }
+
+  //a second registration after a partial resync is harmless
+  if(dbus_error_has_name(&err, "org.bluez.Error.AlreadyExists")) {
+    dbus_error_free(&err);
+    return true;
   }
+
+  logError("registering agent", &err);
+  return false;
 }
 
 void BluetoothController::unregisterAgent() {
@@ -296,14 +566,15 @@ void BluetoothController::unregisterAgent() {
 }
 
 
-void fail(DBusError e) {
-  std::cout << e.name;
-  std::cout << e.message;
-  exit(1);
+void logError(const char * context, DBusError * err) {
+  if(dbus_error_is_set(err)) {
+    std::cerr << context << ": " << err->name << ": " << err->message << '\n';
+  }
+  dbus_error_free(err);
 }
 
 
-Device::Device(std::string path, DBusConnection * connection) {
+Device::Device(std::string path, DBusConnection * connection, DBusMessageIter * properties) {
   this->connection = connection;
   this->path = path;
   alias = "";
@@ -311,122 +582,20 @@ Device::Device(std::string path, DBusConnection * connection) {
   bonded = false;
   rssi = 0;
 
-  auto deviceAlias = getString("Alias");
-  auto deviceConnected = getBool("Connected");
-  auto deviceBonded = getBool("Bonded");
-  auto deviceAddress = getString("Address");
-  auto deviceRSSI = getShort("RSSI");
-
-  if(deviceAlias) alias = *deviceAlias;
-
-  if(deviceConnected) connected = *deviceConnected;
-
-  if(deviceBonded) bonded = *deviceBonded;
-
-  if(deviceAddress) address = *deviceAddress;
-
-  if(deviceRSSI) rssi = *deviceRSSI;
+  applyProperties(properties);
 }
 
-
-std::optional<std::string> Device::getString(std::string property) {
-  const char * interface = "org.bluez.Device1";
-  const char * propertyCStr = property.c_str();
-  std::optional<std::string> retval;
-
-
-  DBusMessage * msg = dbus_message_new_method_call(BT_SERVICE, path.c_str(), "org.freedesktop.DBus.Properties", "Get");
-
-  dbus_message_append_args(msg, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &propertyCStr, DBUS_TYPE_INVALID);
-
-
-  DBusError err;
-  dbus_error_init(&err);
-  DBusMessage * reply = dbus_connection_send_with_reply_and_block(connection, msg, -1, &err);
-
-  if(!reply) return retval;
-
-  DBusMessageIter iter;
-  dbus_message_iter_init(reply, &iter);
-  dbus_message_iter_recurse(&iter, &iter);
-
-  const char * result;
-
-  if(dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_STRING) {
-    dbus_message_iter_get_basic(&iter, &result);
-    retval = std::string(result);
-  }
-
-  dbus_message_unref(reply);
-  dbus_message_unref(msg);
-
-  return retval;
-}
-
-std::optional<short> Device::getShort(std::string property) {
-  const char * interface = "org.bluez.Device1";
-  const char * propertyCStr = property.c_str();
-  std::optional<bool> retval;
-
-  DBusMessage * msg = dbus_message_new_method_call(BT_SERVICE, path.c_str(), "org.freedesktop.DBus.Properties", "Get");
-
-  dbus_message_append_args(msg, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &propertyCStr, DBUS_TYPE_INVALID);
-
-
-  DBusError err;
-  dbus_error_init(&err);
-  DBusMessage * reply = dbus_connection_send_with_reply_and_block(connection, msg, -1, &err);
-
-  if(!reply) return retval;
-
-  DBusMessageIter iter;
-  dbus_message_iter_init(reply, &iter);
-  dbus_message_iter_recurse(&iter, &iter);
-
-  if(dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_INT16) {
-    int result = 0;
-    dbus_message_iter_get_basic(&iter, &result);
-    retval = result;
-  }
-
-  if(reply) dbus_message_unref(reply);
-  dbus_message_unref(msg);
-
-  return retval;
+Device::Device(std::string path, std::string address, std::string addressType, short rssi) {
+  this->connection = nullptr;
+  this->path = path;
+  this->address = address;
+  this->addressType = addressType;
+  this->rssi = rssi;
+  alias = "";
+  connected = false;
+  bonded = true;
 }
 
-std::optional<bool> Device::getBool(std::string property) {
-  const char * interface = "org.bluez.Device1";
-  const char * propertyCStr = property.c_str();
-  std::optional<bool> retval;
-
-  DBusMessage * msg = dbus_message_new_method_call(BT_SERVICE, path.c_str(), "org.freedesktop.DBus.Properties", "Get");
-
-  dbus_message_append_args(msg, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &propertyCStr, DBUS_TYPE_INVALID);
-
-
-  DBusError err;
-  dbus_error_init(&err);
-  DBusMessage * reply = dbus_connection_send_with_reply_and_block(connection, msg, -1, &err);
-
-  if(!reply) return retval;
-
-  DBusMessageIter iter;
-  dbus_message_iter_init(reply, &iter);
-  dbus_message_iter_recurse(&iter, &iter);
-
-
-  if(dbus_message_iter_get_arg_type(&iter) == DBUS_TYPE_BOOLEAN) {
-    bool result = 0;
-    dbus_message_iter_get_basic(&iter, &result);
-    retval = result;
-  }
-
-  if(reply) dbus_message_unref(reply);
-  dbus_message_unref(msg);
-
-  return retval;
-}
 
 std::string Device::getAlias() {
   return alias;
@@ -436,6 +605,10 @@ std::string Device::getAddress() {
   return address;
 }
 
+bool Device::isRandomAddress() {
+  return addressType == "random";
+}
+
 bool Device::isBonded() {
   return bonded;
 }
@@ -449,73 +622,110 @@ short Device::getRSSI() {
 }
 
 
-std::optional<DBusError> Device::call(std::string functionName) {
-  DBusMessage * msg = dbus_message_new_method_call(BT_SERVICE, path.c_str(), "org.bluez.Device1", functionName.c_str());
+Task<Reply> Device::call(const char * method, Deadline deadline, CancelToken cancel) {
+  TraceAsyncSpan span(method);
+  DBusMessage * msg = dbus_message_new_method_call(BT_SERVICE, path.c_str(), DEVICE_INTERFACE, method);
+  co_return co_await CallAwaiter(connection, msg, deadline, cancel);
+}
 
-  DBusError err;
-  dbus_error_init(&err);
-  DBusMessage * reply = dbus_connection_send_with_reply_and_block(connection, msg, -1, &err);
 
-  std::optional<DBusError> retval;
+bool Device::applyProperties(DBusMessageIter * properties) {
+  return forEachProperty(properties, [this](std::string_view name, DBusMessageIter * value){
+    std::string_view text;
 
-  if(!reply) {
-    retval = err;
-  }
+    if(name == "Alias" && readValue(value, text)) alias.assign(text);
+    else if(name == "Address" && readValue(value, text)) address.assign(text);
+    else if(name == "AddressType" && readValue(value, text)) addressType.assign(text);
+    else if(name == "Connected") readValue(value, connected);
+    else if(name == "Bonded") readValue(value, bonded);
+    else if(name == "RSSI") readValue(value, rssi);
+  });
+}
 
-  if(reply) dbus_message_unref(reply);
-  dbus_message_unref(msg);
-  return retval;
+
+Task<bool> Device::getAll(Deadline deadline, CancelToken cancel) {
+  DBusMessage * msg = dbus_message_new_method_call(BT_SERVICE, path.c_str(), "org.freedesktop.DBus.Properties", "GetAll");
+  appendArgs(msg, DEVICE_INTERFACE);
+
+  Reply reply = co_await CallAwaiter(connection, msg, deadline, cancel);
+  if(!reply.ok()) co_return false;
+
+  DBusMessageIter properties;
+  if(!dbus_message_iter_init(reply.message, &properties)) co_return false;
+
+  co_return applyProperties(&properties);
+}
+
+
+Task<Reply> Device::connect(Deadline deadline, CancelToken cancel) {
+  co_return co_await call("Connect", deadline, cancel);
+}
+
+Task<Reply> Device::disconnect(Deadline deadline) {
+  co_return co_await call("Disconnect", deadline, CancelToken());
 }
 
 
-bool Device::verifyProximity() {
+Task<bool> Device::verifyProximity(Deadline deadline, CancelToken cancel) {
   if(connected) {
-    auto deviceConnected = getBool("Connected");
+    auto deviceConnected = co_await get<bool>("Connected", deadline, cancel);
     if(deviceConnected) connected = *deviceConnected;
-    if(connected) return true;
+    if(connected) co_return true;
   }
 
-  if(!bonded) return false;
+  if(!bonded) co_return false;
 
-  auto connectionStatus = call("Connect");
+  Reply attempt = co_await connect(deadline, cancel);
 
-  if(connectionStatus) {
-    const char * err = connectionStatus.value().name;
-    if(!strcmp(err, "org.bluez.Error.AlreadyConnected")) return true;
-    if(!strcmp(err, "org.bluez.Error.InProgress")) {
-      call("Disconnect");
-    }
-    return false;
-  } else {
-    call("Disconnect");
-    return true;
+  //cleanup gets its own deadline, the probe's may already be spent
+  Deadline cleanup = std::chrono::steady_clock::now() + CLEANUP_CALL_TIMEOUT;
+
+  if(attempt.ok()) {
+    co_await disconnect(cleanup);
+    co_return true;
+  }
+
+  if(attempt.error == "org.bluez.Error.AlreadyConnected") co_return true;
+
+  //an abandoned connect attempt keeps paging the device unless told otherwise
+  if(attempt.error == "org.bluez.Error.InProgress" || attempt.error == ERROR_TIMEOUT || attempt.error == ERROR_CANCELLED) {
+    co_await disconnect(cleanup);
   }
+
+  co_return false;
 }
 
 
-bool Device::pair() {
-  return call("Pair").has_value();
+Task<Reply> Device::pair(Deadline deadline, CancelToken cancel) {
+  Reply reply = co_await call("Pair", deadline, cancel);
+
+  if(reply.error == ERROR_TIMEOUT || reply.error == ERROR_CANCELLED) {
+    co_await call("CancelPairing", std::chrono::steady_clock::now() + CLEANUP_CALL_TIMEOUT, CancelToken());
+  }
+
+  co_return reply;
 }
 
-bool Device::unPair() {
+Task<Reply> Device::unPair(Deadline deadline, CancelToken cancel) {
   DBusMessage * msg = dbus_message_new_method_call(BT_SERVICE, ADAPTER_PATH, "org.bluez.Adapter1", "RemoveDevice");
-  dbus_message_append_args(msg,
-      DBUS_TYPE_OBJECT_PATH, &path,
-      DBUS_TYPE_INVALID);
+  appendArgs(msg, ObjectPath{path.c_str()});
 
-  DBusError err;
-  dbus_error_init(&err);
+  co_return co_await CallAwaiter(connection, msg, deadline, cancel);
+}
 
-  DBusMessage * reply = dbus_connection_send_with_reply_and_block(connection, msg, -1, &err);
+//a trusted device may connect back without an agent authorizing it each time
+Task<Reply> Device::trust(Deadline deadline, CancelToken cancel) {
+  DBusMessage * msg = dbus_message_new_method_call(BT_SERVICE, path.c_str(), "org.freedesktop.DBus.Properties", "Set");
+  appendArgs(msg, DEVICE_INTERFACE, "Trusted", std::variant<bool>(true));
 
-  dbus_message_unref(msg);
+  co_return co_await CallAwaiter(connection, msg, deadline, cancel);
+}
 
-  if(reply) {
-    dbus_message_unref(reply);
-    return false;
-  }
+Task<Reply> Device::setAlias(std::string alias, Deadline deadline, CancelToken cancel) {
+  DBusMessage * msg = dbus_message_new_method_call(BT_SERVICE, path.c_str(), "org.freedesktop.DBus.Properties", "Set");
+  appendArgs(msg, DEVICE_INTERFACE, "Alias", std::variant<std::string>(alias));
 
-  return true;
+  co_return co_await CallAwaiter(connection, msg, deadline, cancel);
 }
 
 
@@ -1,3 +1,9 @@
+#pragma once
+
+#include "task.hpp"
+#include "dbustypes.hpp"
+#include "trace.hpp"
+
 #include <dbus/dbus.h>
 #include <poll.h>
 
@@ -12,17 +18,29 @@
 #include <cstring>
 #include <functional>
 #include <optional>
+#include <chrono>
+#include <algorithm>
+#include <atomic>
 
 #define BT_SERVICE "org.bluez"
 #define ADAPTER_PATH "/org/bluez/hci0"
 #define DEVICES_PATH "/org/bluez/hci0/"
 #define BT_SERVICE_PATH "/org/bluez"
+#define DEVICE_INTERFACE "org.bluez.Device1"
 #define APP_PATH "/com/nickrehac/bluelight"
 #define SIGNAL_MATCH_RULES "type='signal',sender='org.bluez'"
+#define OWNER_MATCH_RULES "type='signal',sender='org.freedesktop.DBus',interface='org.freedesktop.DBus',member='NameOwnerChanged',arg0='org.bluez'"
+
+//calls made while recovering use a short timeout so a half-started bluetoothd can't stall the resync
+#define RECOVERY_CALL_TIMEOUT_MS 300
+constexpr auto RESYNC_RETRY_INTERVAL = std::chrono::milliseconds(100);
+//a missing bus socket fails to connect at once, so retrying often costs little and keeps recovery under a second
+constexpr auto RECONNECT_INTERVAL = std::chrono::milliseconds(200);
+constexpr auto CLEANUP_CALL_TIMEOUT = std::chrono::seconds(2);
 
 #define NUM_HANDLERS 1
 
-void fail(DBusError e);
+void logError(const char * context, DBusError * err);
 
 class Device {
   std::string path;
@@ -31,44 +49,106 @@ class Device {
 
   std::string alias;
   std::string address;
+  std::string addressType;
 
   bool bonded;
   bool connected;
-  int rssi;
+  int16_t rssi;
 
-  std::optional<std::string> getString(std::string property);
-  std::optional<short> getShort(std::string property);
-  std::optional<bool> getBool(std::string property);
+  //method doubles as the trace span name, so pass a literal
+  Task<Reply> call(const char * method, Deadline deadline, CancelToken cancel);
+  bool applyProperties(DBusMessageIter * properties);
 
 public:
-  Device(std::string path, DBusConnection * connection);
+  //properties is the org.bluez.Device1 a{sv} from GetManagedObjects
+  Device(std::string path, DBusConnection * connection, DBusMessageIter * properties);
+  //a snapshot with no bus behind it, for simulated device tables. only the getters work on it
+  Device(std::string path, std::string address, std::string addressType, short rssi);
 
   std::string getPath();
   std::string getAlias();
   std::string getAddress();
+  bool isRandomAddress();
 
   bool isBonded();
   short getRSSI();
   bool isConnected();
 
-  bool pair();
-  bool unPair();
+  //awaitable operations. a coroutine using them must own the Device it calls through
+  template<typename T>
+  Task<std::optional<T>> get(const char * property, Deadline deadline, CancelToken cancel = CancelToken());
+  Task<bool> getAll(Deadline deadline, CancelToken cancel = CancelToken());
+  Task<Reply> connect(Deadline deadline, CancelToken cancel = CancelToken());
+  Task<Reply> disconnect(Deadline deadline);
+  Task<Reply> pair(Deadline deadline, CancelToken cancel = CancelToken());
+  Task<Reply> unPair(Deadline deadline, CancelToken cancel = CancelToken());
+  Task<Reply> trust(Deadline deadline, CancelToken cancel = CancelToken());
+  Task<Reply> setAlias(std::string alias, Deadline deadline, CancelToken cancel = CancelToken());
+
+  Task<bool> verifyProximity(Deadline deadline, CancelToken cancel = CancelToken());
+};
+
+template<typename T>
+Task<std::optional<T>> Device::get(const char * property, Deadline deadline, CancelToken cancel) {
+  static_assert(!std::is_same_v<T, std::string_view> && !std::is_same_v<T, const char *>,
+      "the reply is gone by the time the value is returned, fetch an owning type");
+
+  DBusMessage * msg = dbus_message_new_method_call(BT_SERVICE, path.c_str(), "org.freedesktop.DBus.Properties", "Get");
+  appendArgs(msg, DEVICE_INTERFACE, property);
+
+  Reply reply = co_await CallAwaiter(connection, msg, deadline, cancel);
+  if(!reply.ok()) co_return std::nullopt;
 
-  std::optional<DBusError> call(std::string functionName);
+  DBusMessageIter iter;
+  T value;
+  if(!dbus_message_iter_init(reply.message, &iter) || !readVariant(&iter, value)) co_return std::nullopt;
 
-  bool verifyProximity();
+  co_return value;
+}
+
+
+//an object subtree served on our own connection
+struct ExportedPath {
+  std::string path;
+  DBusObjectPathMessageFunction handler;
+  void * data;
 };
 
 class BluetoothController {
   DBusConnection * connection;
+  //kept alive after a bus drop until a resync replaces every Device still pointing at it
+  DBusConnection * staleConnection;
 
   std::vector<DBusWatch*> watches;
 
+  //registered again on every new connection
+  std::vector<ExportedPath> exports;
+  std::vector<std::string> ownedNames;
+
+  bool bluezAvailable;
+  bool pendingResync;
+  //bumped each time bluez state had to be rebuilt, anything bluez keeps per client is gone by then
+  uint64_t generation;
+  std::atomic<uint64_t> messagesReceived;
+
+  std::chrono::steady_clock::time_point bluezReturnedAt;
+  std::chrono::steady_clock::time_point nextResyncAttempt;
+  std::chrono::steady_clock::time_point nextReconnectAttempt;
+  //only the first failed attempt of an outage is logged
+  bool connectFailed;
+  std::optional<std::chrono::milliseconds> lastRecoveryTime;
+
+  bool connect();
+  void dropConnection();
+  bool resync();
+
+  static DBusHandlerResult connectionFilter(DBusConnection * connection, DBusMessage * message, void * controller);
+
   static unsigned int addWatchFunction(DBusWatch * watch, void * data);
   static void removeWatchFunction(DBusWatch * watch, void * data);
   static void freeWatchFunction(void * memory);
 
-  void pollWatches();
+  void pollWatches(int timeoutMs, int wakeFd);
 
   static DBusHandlerResult incomingMessageHandler(DBusConnection * connection, DBusMessage * message, void * controller);
 
@@ -78,31 +158,56 @@ class BluetoothController {
 
   bool pendingDevicesUpdate;
   std::function<void()> onDevicesUpdated;
+  //set when bluez signals a device coming or going, see takeRefreshRequest
+  bool refreshRequested;
 
   void registerForSignals();
 
   std::vector<Device> devices;
 
-  void registerAgent();
+  void applyManagedObjects(DBusMessage * reply);
+
+  bool registerAgent(int timeoutMs);
   void unregisterAgent();
 
+  void registerExport(const ExportedPath & exported);
+  void claimName(const std::string & name);
+
 public:
   BluetoothController();
   ~BluetoothController();
 
-  void updateDevices();
+  bool updateDevices(int timeoutMs = DBUS_TIMEOUT_USE_DEFAULT);
+
+  Task<Reply> getManagedObjects(Deadline deadline, CancelToken cancel = CancelToken());
+  Task<bool> refreshDevices(Deadline deadline);
+  //true once after bluez signalled that devices came or went
+  bool takeRefreshRequest();
 
   std::vector<Device> getDevices();
+  std::optional<Device> getDevice(std::string path);
   bool setPairing(bool);
-  void startDiscovery();
-  void stopDiscovery();
 
-  void dispatch();
-  void poll();
+  //takes ownership of message
+  Task<Reply> call(DBusMessage * message, Deadline deadline, CancelToken cancel = CancelToken());
+  //takes ownership of message, false while off the bus
+  bool send(DBusMessage * message);
 
-  void setOnDevicesUpdated(std::function<void()> callback);
-};
+  //handler gets every method call at or below path, on this connection and any later one
+  void exportPath(std::string path, DBusObjectPathMessageFunction handler, void * data);
+  void unexportPath(std::string path);
+  void requestName(std::string name);
+
+  void dispatch();
+  //wakeFd, when given, is polled alongside the bus so another thread can interrupt the wait
+  void poll(int timeoutMs = 0, int wakeFd = -1);
 
-class LEDConnection {
+  bool isConnected();
+  bool isBluezAvailable();
+  std::optional<std::chrono::milliseconds> getLastRecoveryTime();
+  uint64_t getGeneration();
+  //every message the bus delivered, signals included
+  uint64_t getMessagesReceived();
 
+  void setOnDevicesUpdated(std::function<void()> callback);
 };
@@ -0,0 +1,386 @@
+#include "rpa.hpp"
+#include "sources.hpp"
+#include "task.hpp"
+#include "eventlog.hpp"
+#include "discovery.hpp"
+#include "operations.hpp"
+
+#include <iostream>
+#include <deque>
+#include <thread>
+#include <filesystem>
+#include <cmath>
+#include <ctime>
+
+
+static int failures = 0;
+
+static void expect(bool ok, const char * what) {
+  std::cout << (ok ? "ok   " : "FAIL ") << what << '\n';
+  if(!ok) failures++;
+}
+
+
+//sample data for ah() from Core spec Vol 6, Part C, 1
+static void checkRpaSample() {
+  Irk irk = *parseIrk("ec0234a357c8ad05341010a60a397d9b");
+  Irk other = *parseIrk("000102030405060708090a0b0c0d0e0f");
+
+  expect(ah(irk, 0x708194) == 0x0dfbaa, "ah(irk, 708194) is 0dfbaa");
+
+  RpaResolver resolver;
+  resolver.setIrks({other, irk});
+
+  //the sample address, the same prand with a wrong hash, and a static random address
+  std::vector<BdAddr> addresses = {
+    *parseAddress("70:81:94:0D:FB:AA"),
+    *parseAddress("70:81:94:0D:FB:AB"),
+    *parseAddress("F0:81:94:0D:FB:AA"),
+  };
+
+  std::vector<int> expected = {1, -1, -1};
+  expect(resolver.resolveBatch(addresses) == expected, "resolveBatch matches the sample address to its IRK");
+  //the second pass is answered from the cache
+  expect(resolver.resolveBatch(addresses) == expected, "resolveBatch gives the same answer from its cache");
+  expect(resolver.resolve(addresses[0]) == 1, "resolve agrees with resolveBatch");
+}
+
+
+//bluez takes one filter per client, so every session's has to fit in the merged one
+static void checkMergeFilters() {
+  DiscoveryFilter le{"le", -90, {"0000180f-0000-1000-8000-00805f9b34fb"}, false};
+  DiscoveryFilter bredr{"bredr", -70, {"0000110b-0000-1000-8000-00805f9b34fb", "0000180f-0000-1000-8000-00805f9b34fb"}, true};
+  DiscoveryFilter anything{"auto", std::nullopt, {}, false};
+
+  expect(mergeFilters({}) == DiscoveryFilter{}, "no sessions merge to the default filter");
+  expect(mergeFilters({le}) == le, "one session's filter is used as is");
+  expect(mergeFilters({le, le}).transport == "le", "sessions on the same transport keep it");
+  expect(mergeFilters({le, bredr}).transport == "auto", "sessions on different transports widen to auto");
+
+  expect(mergeFilters({bredr, le}).rssi == -90, "the lowest RSSI floor wins");
+  expect(!mergeFilters({le, anything}).rssi && !mergeFilters({anything, le}).rssi, "a session without a floor removes it for everyone");
+
+  std::vector<std::string> both = {"0000110b-0000-1000-8000-00805f9b34fb", "0000180f-0000-1000-8000-00805f9b34fb"};
+  expect(mergeFilters({le, bredr}).uuids == both, "uuid lists are joined without repeats");
+  expect(mergeFilters({le, anything}).uuids.empty() && mergeFilters({anything, bredr}).uuids.empty(), "an empty uuid list matches every device for everyone");
+
+  expect(mergeFilters({le, bredr}).duplicateData && !mergeFilters({le, anything}).duplicateData, "any session asking for duplicate data gets it");
+}
+
+
+//a bluetooth thread that keeps what it is sent and hands out whatever the check queues
+class StubLink : public BluetoothLink {
+public:
+  struct Sent {
+    uint64_t id;
+    CommandType type;
+    std::string path;
+    std::string alias;
+  };
+
+  std::vector<Sent> sent;
+  std::vector<uint64_t> cancelled;
+  std::deque<Event> events;
+  uint64_t nextId = 1;
+  //send refuses everything while set, like a full command ring
+  bool full = false;
+
+  uint64_t send(CommandType type, std::string path, std::chrono::milliseconds, uint64_t) override {
+    if(full) return 0;
+    sent.push_back(Sent{nextId, type, path, ""});
+    return nextId++;
+  }
+
+  uint64_t trust(std::string path, std::string alias, std::chrono::milliseconds) override {
+    if(full) return 0;
+    sent.push_back(Sent{nextId, CommandType::Trust, path, alias});
+    return nextId++;
+  }
+
+  void cancel(uint64_t id) override {
+    cancelled.push_back(id);
+  }
+
+  bool receive(Event & event) override {
+    if(events.empty()) return false;
+    event = events.front();
+    events.pop_front();
+    return true;
+  }
+
+  uint64_t startDiscovery(DiscoveryProfile) override { return nextId++; }
+  void updateDiscovery(uint64_t, DiscoveryProfile) override {}
+  void stopDiscovery(uint64_t) override {}
+
+  int getEventFd() override { return -1; }
+};
+
+
+//a probe result the event ring dropped must not hold the round open
+static void checkLostProbeResult() {
+  VirtualClock clock;
+  StubLink link;
+  std::vector<Key> keys = {*parseKey("AA:BB:CC:DD:EE:01 zone=1"), *parseKey("AA:BB:CC:DD:EE:02 zone=1")};
+  std::string path = "/org/bluez/hci0/dev_AA_BB_CC_DD_EE_01";
+
+  BluezSource source(link, keys, clock);
+  std::vector<Observation> observations;
+
+  link.events.push_back(Event{DevicesEvent{{Device(path, keys[0].address, "public", 0), Device(path + "2", keys[1].address, "public", 0)}}});
+  source.update(observations);
+
+  clock.advanceTo(clock.now() + PING_INTERVAL);
+  source.update(observations);
+
+  std::vector<StubLink::Sent> probes;
+  for(StubLink::Sent & sent : link.sent) if(sent.type == CommandType::Verify) probes.push_back(sent);
+  expect(probes.size() == 2, "a round probes both matched keys");
+  if(probes.size() != 2) return;
+
+  //the first answer arrives, the second is lost
+  link.events.push_back(Event{PresenceEvent{probes[0].id, probes[0].path, keys[0].address, true, -50}});
+  int timer = source.update(observations);
+  expect(observations.empty(), "the round waits on the missing result");
+  expect(timer >= 0 && timer <= std::chrono::duration_cast<std::chrono::milliseconds>(PROBE_TIMEOUT + PROBE_RESULT_MARGIN).count() + 1,
+    "a round waiting on results still sets a timer");
+
+  clock.advanceTo(clock.now() + PROBE_TIMEOUT + PROBE_RESULT_MARGIN);
+  source.update(observations);
+  expect(observations.size() == 2, "the round finishes once its deadline passes");
+  expect(observations.size() == 2 && observations[0].level == 1.0f && observations[1].level == 0.0f, "the lost probe counts as missed");
+
+  observations.clear();
+  link.sent.clear();
+  clock.advanceTo(clock.now() + PING_INTERVAL);
+  source.update(observations);
+  expect(!link.sent.empty(), "the next round starts");
+}
+
+
+//a connection to a server nobody ever services: calls go out and simply never come back
+static DBusConnection * silentConnection(DBusServer ** server) {
+  *server = dbus_server_listen("unix:tmpdir=/tmp", nullptr);
+  if(!*server) return nullptr;
+
+  char * address = dbus_server_get_address(*server);
+  DBusConnection * retval = dbus_connection_open_private(address, nullptr);
+  dbus_free(address);
+  return retval;
+}
+
+static Task<void> callInto(DBusConnection * connection, Deadline deadline, CancelToken cancel, std::string & error, bool & done) {
+  DBusMessage * message = dbus_message_new_method_call(BT_SERVICE, "/", "org.freedesktop.DBus.Peer", "Ping");
+  Reply reply = co_await CallAwaiter(connection, message, deadline, cancel);
+  error = reply.error;
+  done = true;
+}
+
+//the scheduler, not libdbus, ends calls at their deadline or on cancel
+static void checkCallAwaiter() {
+  DBusServer * server;
+  DBusConnection * connection = silentConnection(&server);
+  expect(connection, "a connection to an unserviced server opens");
+  if(!connection) return;
+
+  {
+    Scheduler scheduler;
+    scheduler.makeCurrent();
+
+    auto now = std::chrono::steady_clock::now();
+    CancelToken cancel = CancelToken::create();
+    CancelToken cancelledEarly = CancelToken::create();
+    cancelledEarly.cancel();
+
+    std::string expiredError, cancelledError, earlyError;
+    bool expired = false, cancelled = false, early = false;
+
+    scheduler.spawn(callInto(connection, now + std::chrono::milliseconds(20), CancelToken(), expiredError, expired));
+    scheduler.spawn(callInto(connection, now + std::chrono::seconds(60), cancel, cancelledError, cancelled));
+    scheduler.spawn(callInto(connection, now + std::chrono::seconds(60), cancelledEarly, earlyError, early));
+
+    auto giveUp = now + std::chrono::seconds(2);
+    while(!expired && std::chrono::steady_clock::now() < giveUp) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(scheduler.nextTimeoutMs(100)));
+      scheduler.run();
+    }
+
+    expect(expired && expiredError == ERROR_TIMEOUT, "a call past its deadline resumes with the timeout error");
+    expect(early && earlyError == ERROR_CANCELLED, "a call with a token already cancelled never goes out");
+    expect(!cancelled && scheduler.spawnedCount() == 1, "a cancellable call still waits while its deadline is far off");
+
+    cancel.cancel();
+    scheduler.run();
+    expect(cancelled && cancelledError == ERROR_CANCELLED, "cancelling the token resumes the call with the cancelled error");
+    expect(scheduler.spawnedCount() == 0 && taskStats().live == 0, "finished tasks free their frames");
+  }
+
+  dbus_connection_close(connection);
+  dbus_connection_unref(connection);
+  dbus_server_disconnect(server);
+  dbus_server_unref(server);
+}
+
+
+static std::string devicePath(int i) {
+  return "/org/bluez/hci0/dev_AA_BB_CC_DD_EE_0" + std::to_string(i);
+}
+
+//the cap, a full command ring and results that never come back
+static void checkOperationQueue() {
+  VirtualClock clock;
+  StubLink link;
+  OperationQueue queue(link, MAX_CONCURRENT_OPERATIONS, clock);
+
+  for(int i = 0; i < MAX_CONCURRENT_OPERATIONS + 2; i++) queue.submit(CommandType::Pair, devicePath(i), PAIR_TIMEOUT);
+  expect(link.sent.size() == MAX_CONCURRENT_OPERATIONS && queue.runningCount() == MAX_CONCURRENT_OPERATIONS && queue.queuedCount() == 2,
+    "no more than MAX_CONCURRENT_OPERATIONS run at once");
+  expect(!queue.submit(CommandType::UnPair, devicePath(0), FORGET_TIMEOUT), "a device with an operation running takes no second one");
+
+  expect(queue.handleResult(CommandResultEvent{link.sent[0].id, CommandType::Pair, devicePath(0), true, ""}), "a result for a sent command is taken");
+  expect(queue.find(devicePath(0))->state == OperationState::Done, "a good result finishes its operation");
+  expect(link.sent.size() == MAX_CONCURRENT_OPERATIONS + 1 && link.sent.back().path == devicePath(MAX_CONCURRENT_OPERATIONS), "a freed slot starts the next queued operation");
+
+  //the command ring turns the last one away until it has room again
+  link.full = true;
+  queue.handleResult(CommandResultEvent{link.sent[1].id, CommandType::Pair, devicePath(1), false, "org.bluez.Error.AuthenticationFailed"});
+  expect(queue.find(devicePath(1))->error == "org.bluez.Error.AuthenticationFailed", "a failed result keeps the bluez error");
+  expect(queue.find(devicePath(MAX_CONCURRENT_OPERATIONS + 1))->state == OperationState::Queued, "an operation the ring turned away stays queued");
+  link.full = false;
+  queue.update();
+  expect(queue.find(devicePath(MAX_CONCURRENT_OPERATIONS + 1))->state == OperationState::Running, "the next update sends it once the ring has room");
+
+  //nothing comes back for the rest
+  size_t cancelled = link.cancelled.size();
+  clock.advanceTo(clock.now() + PAIR_TIMEOUT + OPERATION_RESULT_MARGIN - std::chrono::milliseconds(1));
+  queue.update();
+  expect(queue.runningCount() == MAX_CONCURRENT_OPERATIONS, "an operation within its timeout and margin keeps waiting");
+
+  clock.advanceTo(clock.now() + std::chrono::milliseconds(1));
+  queue.update();
+  const Operation * lost = queue.find(devicePath(2));
+  expect(lost->state == OperationState::Failed && lost->error == ERROR_NO_RESULT, "an operation with no result past its timeout and margin fails");
+  expect(link.cancelled.size() - cancelled == MAX_CONCURRENT_OPERATIONS, "a given up command is cancelled in case it is still going");
+  expect(!queue.handleResult(CommandResultEvent{lost->id, CommandType::Pair, devicePath(2), true, ""}), "a result arriving after that is ignored");
+
+  queue.submit(CommandType::Trust, devicePath(2), std::chrono::seconds(5), "kitchen phone");
+  expect(link.sent.back().type == CommandType::Trust && link.sent.back().alias == "kitchen phone", "a trust carries its alias");
+}
+
+
+//wall clock ms of a local time in whatever TZ is set
+static int64_t localMs(int year, int month, int day, int hour, int minute) {
+  tm local{};
+  local.tm_year = year - 1900;
+  local.tm_mon = month - 1;
+  local.tm_mday = day;
+  local.tm_hour = hour;
+  local.tm_min = minute;
+  local.tm_isdst = -1;
+  return (int64_t) mktime(&local) * 1000;
+}
+
+static LogRecord logRecord(LogEventType type, int64_t timestampMs, uint32_t keyId, uint16_t zone) {
+  LogRecord retval = makeLogRecord(type, keyId, zone, 0, false);
+  retval.timestampMs = timestampMs;
+  return retval;
+}
+
+static void writeLog(EventLog & log, const std::vector<LogRecord> & records) {
+  uint64_t target = log.getWritten() + records.size();
+  for(const LogRecord & record : records) log.append(record);
+
+  auto giveUp = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+  while(log.getWritten() < target && std::chrono::steady_clock::now() < giveUp) std::this_thread::sleep_for(LOG_FLUSH_INTERVAL / 5);
+}
+
+static double minutesFor(const std::vector<OccupancyRow> & rows, const std::string & day, uint16_t zone) {
+  for(const OccupancyRow & row : rows) {
+    if(row.day == day && row.zone == zone) return row.minutes;
+  }
+  return 0;
+}
+
+//occupancy per zone per day out of synthetic segments, in a zone with both DST changes
+static void checkOccupancy() {
+  const char * tz = getenv("TZ");
+  std::string savedTz = tz ? tz : "";
+  setenv("TZ", "CET-1CEST,M3.5.0,M10.5.0/3", 1);
+  tzset();
+
+  char name[] = "/tmp/bluelight-check.XXXXXX";
+  if(!mkdtemp(name)) {
+    expect(false, "a directory for the log can be made");
+    return;
+  }
+  std::string directory = name;
+
+  {
+    //closed, so its segment is cut down to the records it holds
+    EventLog log(directory);
+    writeLog(log, {
+      //across midnight
+      logRecord(LogEventType::Arrived, localMs(2024, 1, 10, 23, 30), 1, 1),
+      logRecord(LogEventType::Departed, localMs(2024, 1, 11, 0, 45), 1, 1),
+      //the 23 hour day clocks go forward on
+      logRecord(LogEventType::Arrived, localMs(2024, 3, 30, 22, 0), 2, 2),
+      logRecord(LogEventType::Departed, localMs(2024, 4, 1, 1, 0), 2, 2),
+      //two keys in one zone only count once while they overlap
+      logRecord(LogEventType::Arrived, localMs(2024, 5, 1, 10, 0), 3, 4),
+      logRecord(LogEventType::Arrived, localMs(2024, 5, 1, 10, 30), 4, 4),
+      logRecord(LogEventType::Departed, localMs(2024, 5, 1, 11, 0), 3, 4),
+      logRecord(LogEventType::Departed, localMs(2024, 5, 1, 12, 0), 4, 4),
+      //a restart ends whatever was open, the departure after it is for a key nobody saw arrive
+      logRecord(LogEventType::Arrived, localMs(2024, 6, 1, 8, 0), 5, 5),
+      logRecord(LogEventType::Start, localMs(2024, 6, 1, 9, 0), 0, 0),
+      logRecord(LogEventType::Departed, localMs(2024, 6, 1, 10, 0), 5, 5),
+      //the 25 hour day clocks go back on
+      logRecord(LogEventType::Arrived, localMs(2024, 10, 26, 23, 0), 6, 3),
+      logRecord(LogEventType::Departed, localMs(2024, 10, 28, 0, 30), 6, 3),
+    });
+  }
+
+  //segment names are their start time in ms
+  std::this_thread::sleep_for(std::chrono::milliseconds(2));
+
+  //left open, so the query reads a preallocated segment that is mostly zeros
+  EventLog log(directory);
+  int64_t now = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+  writeLog(log, {logRecord(LogEventType::Arrived, now - 10 * 60000, 7, 6)});
+
+  expect(listSegments(directory).size() == 2, "the log wrote two segments");
+
+  std::vector<OccupancyRow> rows = occupiedMinutes(directory);
+  auto near = [](double a, double b){ return std::abs(a - b) < 0.01; };
+
+  expect(near(minutesFor(rows, "2024-01-10", 1), 30) && near(minutesFor(rows, "2024-01-11", 1), 45), "a stay is split on local midnight");
+  expect(near(minutesFor(rows, "2024-03-30", 2), 120) && near(minutesFor(rows, "2024-03-31", 2), 23 * 60) && near(minutesFor(rows, "2024-04-01", 2), 60),
+    "the day clocks go forward has 23 hours");
+  expect(near(minutesFor(rows, "2024-10-26", 3), 60) && near(minutesFor(rows, "2024-10-27", 3), 25 * 60) && near(minutesFor(rows, "2024-10-28", 3), 30),
+    "the day clocks go back has 25 hours");
+  expect(near(minutesFor(rows, "2024-05-01", 4), 120), "overlapping keys in a zone count once");
+  expect(near(minutesFor(rows, "2024-06-01", 5), 60), "a restart closes the zones that were open");
+
+  double open = 0;
+  for(const OccupancyRow & row : rows) if(row.zone == 6) open += row.minutes;
+  expect(open >= 10 && open < 10.5, "a key still present where the log ends counts up to now");
+
+  std::error_code error;
+  std::filesystem::remove_all(directory, error);
+
+  if(tz) setenv("TZ", savedTz.c_str(), 1);
+  else unsetenv("TZ");
+  tzset();
+}
+
+
+int main() {
+  checkRpaSample();
+  checkMergeFilters();
+  checkLostProbeResult();
+  checkOperationQueue();
+  checkCallAwaiter();
+  checkOccupancy();
+
+  if(failures) std::cout << failures << " failed\n";
+  return failures ? 1 : 0;
+}
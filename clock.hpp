@@ -0,0 +1,35 @@
+#pragma once
+
+#include <chrono>
+
+//where the presence logic reads the time, so a simulation can run it on virtual time instead
+class Clock {
+public:
+  virtual ~Clock() = default;
+
+  virtual std::chrono::steady_clock::time_point now() = 0;
+};
+
+class SteadyClock : public Clock {
+public:
+  std::chrono::steady_clock::time_point now() override {
+    return std::chrono::steady_clock::now();
+  }
+};
+
+//for anything that isn't handed a clock of its own
+inline SteadyClock steadyClock;
+
+//stands still until moved, never backwards
+class VirtualClock : public Clock {
+  std::chrono::steady_clock::time_point current;
+
+public:
+  std::chrono::steady_clock::time_point now() override {
+    return current;
+  }
+
+  void advanceTo(std::chrono::steady_clock::time_point at) {
+    if(at > current) current = at;
+  }
+};
@@ -0,0 +1,499 @@
+#pragma once
+
+#include <dbus/dbus.h>
+
+#include <string>
+#include <string_view>
+#include <vector>
+#include <map>
+#include <tuple>
+#include <variant>
+#include <cstdint>
+#include <cstddef>
+#include <type_traits>
+
+//D-Bus signatures derived from C++ types at compile time, and readers/writers that check the wire
+//type before touching it. string_view and const char * read straight out of the message buffer,
+//so they are only valid while the message is alive.
+
+template<size_t N>
+struct Signature {
+  char data[N + 1];
+
+  constexpr Signature() : data{} {}
+
+  constexpr Signature(const char (&text)[N + 1]) : data{} {
+    for(size_t i = 0; i < N; i++) data[i] = text[i];
+  }
+
+  constexpr const char * c_str() const { return data; }
+  constexpr size_t size() const { return N; }
+};
+
+template<size_t N>
+Signature(const char (&)[N]) -> Signature<N - 1>;
+
+template<size_t A, size_t B>
+constexpr Signature<A + B> operator+(const Signature<A> & a, const Signature<B> & b) {
+  Signature<A + B> retval;
+  for(size_t i = 0; i < A; i++) retval.data[i] = a.data[i];
+  for(size_t i = 0; i < B; i++) retval.data[A + i] = b.data[i];
+  return retval;
+}
+
+template<size_t A, size_t B>
+constexpr bool operator==(const Signature<A> & a, const Signature<B> & b) {
+  if(A != B) return false;
+  for(size_t i = 0; i < A; i++) if(a.data[i] != b.data[i]) return false;
+  return true;
+}
+
+
+struct ObjectPath {
+  const char * path;
+};
+
+//opt a plain struct into marshalling as a D-Bus struct by listing its members in order:
+//template<> struct DBusFields<Foo> { static constexpr auto members = std::make_tuple(&Foo::a, &Foo::b); };
+template<typename T>
+struct DBusFields;
+
+
+template<typename T, typename Enable = void>
+struct DBusType;
+
+template<typename T>
+bool readValue(DBusMessageIter * iter, T & value) {
+  return DBusType<T>::read(iter, value);
+}
+
+template<typename T>
+bool appendValue(DBusMessageIter * iter, const T & value) {
+  return DBusType<T>::append(iter, value);
+}
+
+template<typename T>
+constexpr auto signatureOf() {
+  return DBusType<T>::signature;
+}
+
+template<typename T>
+bool readVariant(DBusMessageIter * iter, T & value);
+
+template<typename T>
+bool appendVariant(DBusMessageIter * iter, const T & value);
+
+
+template<typename T, int Code, char Symbol>
+struct BasicDBusType {
+  static constexpr int code = Code;
+  static constexpr Signature<1> signature = Signature<1>({Symbol, 0});
+
+  static bool read(DBusMessageIter * iter, T & value) {
+    if(dbus_message_iter_get_arg_type(iter) != Code) return false;
+    dbus_message_iter_get_basic(iter, &value);
+    return true;
+  }
+
+  static bool append(DBusMessageIter * iter, const T & value) {
+    return dbus_message_iter_append_basic(iter, Code, &value);
+  }
+};
+
+template<> struct DBusType<uint8_t> : BasicDBusType<uint8_t, DBUS_TYPE_BYTE, 'y'> {};
+template<> struct DBusType<int16_t> : BasicDBusType<int16_t, DBUS_TYPE_INT16, 'n'> {};
+template<> struct DBusType<uint16_t> : BasicDBusType<uint16_t, DBUS_TYPE_UINT16, 'q'> {};
+template<> struct DBusType<int32_t> : BasicDBusType<int32_t, DBUS_TYPE_INT32, 'i'> {};
+template<> struct DBusType<uint32_t> : BasicDBusType<uint32_t, DBUS_TYPE_UINT32, 'u'> {};
+template<> struct DBusType<int64_t> : BasicDBusType<int64_t, DBUS_TYPE_INT64, 'x'> {};
+template<> struct DBusType<uint64_t> : BasicDBusType<uint64_t, DBUS_TYPE_UINT64, 't'> {};
+template<> struct DBusType<double> : BasicDBusType<double, DBUS_TYPE_DOUBLE, 'd'> {};
+
+//dbus_bool_t is four bytes on the wire side, never read it into a bool directly
+template<>
+struct DBusType<bool> {
+  static constexpr int code = DBUS_TYPE_BOOLEAN;
+  static constexpr Signature<1> signature = Signature("b");
+
+  static bool read(DBusMessageIter * iter, bool & value) {
+    if(dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_BOOLEAN) return false;
+    dbus_bool_t result;
+    dbus_message_iter_get_basic(iter, &result);
+    value = result;
+    return true;
+  }
+
+  static bool append(DBusMessageIter * iter, const bool & value) {
+    dbus_bool_t result = value;
+    return dbus_message_iter_append_basic(iter, DBUS_TYPE_BOOLEAN, &result);
+  }
+};
+
+template<>
+struct DBusType<const char *> {
+  static constexpr int code = DBUS_TYPE_STRING;
+  static constexpr Signature<1> signature = Signature("s");
+
+  static bool read(DBusMessageIter * iter, const char * & value) {
+    if(dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRING) return false;
+    dbus_message_iter_get_basic(iter, &value);
+    return true;
+  }
+
+  static bool append(DBusMessageIter * iter, const char * const & value) {
+    return dbus_message_iter_append_basic(iter, DBUS_TYPE_STRING, &value);
+  }
+};
+
+//string literals, append only
+template<size_t N>
+struct DBusType<char[N]> {
+  static constexpr int code = DBUS_TYPE_STRING;
+  static constexpr Signature<1> signature = Signature("s");
+
+  static bool append(DBusMessageIter * iter, const char (&value)[N]) {
+    return DBusType<const char *>::append(iter, value);
+  }
+};
+
+template<>
+struct DBusType<std::string_view> {
+  static constexpr int code = DBUS_TYPE_STRING;
+  static constexpr Signature<1> signature = Signature("s");
+
+  static bool read(DBusMessageIter * iter, std::string_view & value) {
+    const char * text;
+    if(!DBusType<const char *>::read(iter, text)) return false;
+    value = text;
+    return true;
+  }
+
+  //the wire wants a terminated string, which a view can't promise
+  static bool append(DBusMessageIter * iter, const std::string_view & value) {
+    std::string text(value);
+    return DBusType<const char *>::append(iter, text.c_str());
+  }
+};
+
+template<>
+struct DBusType<std::string> {
+  static constexpr int code = DBUS_TYPE_STRING;
+  static constexpr Signature<1> signature = Signature("s");
+
+  static bool read(DBusMessageIter * iter, std::string & value) {
+    const char * text;
+    if(!DBusType<const char *>::read(iter, text)) return false;
+    value.assign(text);
+    return true;
+  }
+
+  static bool append(DBusMessageIter * iter, const std::string & value) {
+    return DBusType<const char *>::append(iter, value.c_str());
+  }
+};
+
+template<>
+struct DBusType<ObjectPath> {
+  static constexpr int code = DBUS_TYPE_OBJECT_PATH;
+  static constexpr Signature<1> signature = Signature("o");
+
+  static bool read(DBusMessageIter * iter, ObjectPath & value) {
+    if(dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_OBJECT_PATH) return false;
+    dbus_message_iter_get_basic(iter, &value.path);
+    return true;
+  }
+
+  static bool append(DBusMessageIter * iter, const ObjectPath & value) {
+    return dbus_message_iter_append_basic(iter, DBUS_TYPE_OBJECT_PATH, &value.path);
+  }
+};
+
+
+template<typename T>
+struct DBusType<std::vector<T>> {
+  static constexpr int code = DBUS_TYPE_ARRAY;
+  static constexpr auto signature = Signature("a") + signatureOf<T>();
+
+  static bool read(DBusMessageIter * iter, std::vector<T> & value) {
+    if(dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY) return false;
+    if(dbus_message_iter_get_element_type(iter) != DBusType<T>::code) return false;
+
+    DBusMessageIter elements;
+    dbus_message_iter_recurse(iter, &elements);
+
+    value.clear();
+    while(dbus_message_iter_get_arg_type(&elements) != DBUS_TYPE_INVALID) {
+      T element;
+      if(!readValue(&elements, element)) return false;
+      value.push_back(std::move(element));
+      dbus_message_iter_next(&elements);
+    }
+    return true;
+  }
+
+  static bool append(DBusMessageIter * iter, const std::vector<T> & value) {
+    DBusMessageIter elements;
+    if(!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, signatureOf<T>().c_str(), &elements)) return false;
+    for(const T & element : value) {
+      if(!appendValue(&elements, element)) {
+        dbus_message_iter_abandon_container(iter, &elements);
+        return false;
+      }
+    }
+    return dbus_message_iter_close_container(iter, &elements);
+  }
+};
+
+template<typename K, typename V>
+struct DBusType<std::map<K, V>> {
+  static constexpr int code = DBUS_TYPE_ARRAY;
+  static constexpr auto entrySignature = Signature("{") + signatureOf<K>() + signatureOf<V>() + Signature("}");
+  static constexpr auto signature = Signature("a") + entrySignature;
+
+  static bool read(DBusMessageIter * iter, std::map<K, V> & value) {
+    if(dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY) return false;
+    if(dbus_message_iter_get_element_type(iter) != DBUS_TYPE_DICT_ENTRY) return false;
+
+    DBusMessageIter entries;
+    dbus_message_iter_recurse(iter, &entries);
+
+    value.clear();
+    while(dbus_message_iter_get_arg_type(&entries) == DBUS_TYPE_DICT_ENTRY) {
+      DBusMessageIter entry;
+      dbus_message_iter_recurse(&entries, &entry);
+
+      K key;
+      V element;
+      if(!readValue(&entry, key)) return false;
+      dbus_message_iter_next(&entry);
+      if(!readValue(&entry, element)) return false;
+
+      value.emplace(std::move(key), std::move(element));
+      dbus_message_iter_next(&entries);
+    }
+    return true;
+  }
+
+  static bool append(DBusMessageIter * iter, const std::map<K, V> & value) {
+    DBusMessageIter entries;
+    if(!dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY, entrySignature.c_str(), &entries)) return false;
+    for(const auto & [key, element] : value) {
+      DBusMessageIter entry;
+      dbus_message_iter_open_container(&entries, DBUS_TYPE_DICT_ENTRY, nullptr, &entry);
+      if(!appendValue(&entry, key) || !appendValue(&entry, element)) {
+        dbus_message_iter_abandon_container(&entries, &entry);
+        dbus_message_iter_abandon_container(iter, &entries);
+        return false;
+      }
+      dbus_message_iter_close_container(&entries, &entry);
+    }
+    return dbus_message_iter_close_container(iter, &entries);
+  }
+};
+
+
+template<typename... Ts>
+struct DBusType<std::tuple<Ts...>> {
+  static constexpr int code = DBUS_TYPE_STRUCT;
+  static constexpr auto signature = (Signature("(") + ... + signatureOf<Ts>()) + Signature(")");
+
+  static bool read(DBusMessageIter * iter, std::tuple<Ts...> & value) {
+    if(dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRUCT) return false;
+
+    DBusMessageIter fields;
+    dbus_message_iter_recurse(iter, &fields);
+
+    return std::apply([&fields](Ts &... members){
+      bool ok = true;
+      ((ok = ok && readValue(&fields, members) && (dbus_message_iter_next(&fields), true)), ...);
+      return ok;
+    }, value);
+  }
+
+  static bool append(DBusMessageIter * iter, const std::tuple<Ts...> & value) {
+    DBusMessageIter fields;
+    if(!dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, nullptr, &fields)) return false;
+
+    bool ok = std::apply([&fields](const Ts &... members){
+      return (appendValue(&fields, members) && ...);
+    }, value);
+
+    if(!ok) {
+      dbus_message_iter_abandon_container(iter, &fields);
+      return false;
+    }
+    return dbus_message_iter_close_container(iter, &fields);
+  }
+};
+
+template<typename T>
+struct DBusType<T, std::void_t<decltype(DBusFields<T>::members)>> {
+  template<typename M>
+  struct MemberType;
+
+  template<typename C, typename M>
+  struct MemberType<M C::*> { typedef M type; };
+
+  static constexpr auto memberSignature() {
+    return std::apply([](auto... members){
+      return (Signature("(") + ... + signatureOf<typename MemberType<decltype(members)>::type>()) + Signature(")");
+    }, DBusFields<T>::members);
+  }
+
+  static constexpr int code = DBUS_TYPE_STRUCT;
+  static constexpr auto signature = memberSignature();
+
+  static bool read(DBusMessageIter * iter, T & value) {
+    if(dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_STRUCT) return false;
+
+    DBusMessageIter fields;
+    dbus_message_iter_recurse(iter, &fields);
+
+    return std::apply([&](auto... members){
+      bool ok = true;
+      ((ok = ok && readValue(&fields, value.*members) && (dbus_message_iter_next(&fields), true)), ...);
+      return ok;
+    }, DBusFields<T>::members);
+  }
+
+  static bool append(DBusMessageIter * iter, const T & value) {
+    DBusMessageIter fields;
+    if(!dbus_message_iter_open_container(iter, DBUS_TYPE_STRUCT, nullptr, &fields)) return false;
+
+    bool ok = std::apply([&](auto... members){
+      return (appendValue(&fields, value.*members) && ...);
+    }, DBusFields<T>::members);
+
+    if(!ok) {
+      dbus_message_iter_abandon_container(iter, &fields);
+      return false;
+    }
+    return dbus_message_iter_close_container(iter, &fields);
+  }
+};
+
+
+template<typename... Ts>
+struct DBusType<std::variant<Ts...>> {
+  static constexpr int code = DBUS_TYPE_VARIANT;
+  static constexpr Signature<1> signature = Signature("v");
+
+  //the first alternative whose type reads cleanly wins
+  static bool read(DBusMessageIter * iter, std::variant<Ts...> & value) {
+    if(dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_VARIANT) return false;
+
+    DBusMessageIter content;
+    dbus_message_iter_recurse(iter, &content);
+
+    return (readAlternative<Ts>(&content, value) || ...);
+  }
+
+  template<typename A>
+  static bool readAlternative(DBusMessageIter * content, std::variant<Ts...> & value) {
+    if(dbus_message_iter_get_arg_type(content) != DBusType<A>::code) return false;
+    A alternative;
+    if(!readValue(content, alternative)) return false;
+    value = std::move(alternative);
+    return true;
+  }
+
+  static bool append(DBusMessageIter * iter, const std::variant<Ts...> & value) {
+    return std::visit([iter](const auto & alternative){
+      return appendVariant(iter, alternative);
+    }, value);
+  }
+};
+
+
+//reads a variant whose content must be exactly T
+template<typename T>
+bool readVariant(DBusMessageIter * iter, T & value) {
+  if(dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_VARIANT) return false;
+
+  DBusMessageIter content;
+  dbus_message_iter_recurse(iter, &content);
+  return readValue(&content, value);
+}
+
+template<typename T>
+bool appendVariant(DBusMessageIter * iter, const T & value) {
+  DBusMessageIter content;
+  if(!dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, signatureOf<T>().c_str(), &content)) return false;
+  if(!appendValue(&content, value)) {
+    dbus_message_iter_abandon_container(iter, &content);
+    return false;
+  }
+  return dbus_message_iter_close_container(iter, &content);
+}
+
+
+//walks an a{sv} without building a map. callback(std::string_view name, DBusMessageIter * content)
+//gets an iterator already inside the variant
+template<typename F>
+bool forEachProperty(DBusMessageIter * iter, F callback) {
+  if(dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY) return false;
+  if(dbus_message_iter_get_element_type(iter) != DBUS_TYPE_DICT_ENTRY) return false;
+
+  DBusMessageIter entries;
+  dbus_message_iter_recurse(iter, &entries);
+
+  while(dbus_message_iter_get_arg_type(&entries) == DBUS_TYPE_DICT_ENTRY) {
+    DBusMessageIter entry, content;
+    std::string_view name;
+
+    dbus_message_iter_recurse(&entries, &entry);
+    if(!readValue(&entry, name)) return false;
+    dbus_message_iter_next(&entry);
+    if(dbus_message_iter_get_arg_type(&entry) != DBUS_TYPE_VARIANT) return false;
+    dbus_message_iter_recurse(&entry, &content);
+
+    callback(name, &content);
+
+    dbus_message_iter_next(&entries);
+  }
+
+  return true;
+}
+
+
+//finds key in an a{s...} dict and leaves value on the matching entry's value
+inline bool findEntry(DBusMessageIter * iter, std::string_view key, DBusMessageIter * value) {
+  if(dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY) return false;
+  if(dbus_message_iter_get_element_type(iter) != DBUS_TYPE_DICT_ENTRY) return false;
+
+  DBusMessageIter entries;
+  dbus_message_iter_recurse(iter, &entries);
+
+  while(dbus_message_iter_get_arg_type(&entries) == DBUS_TYPE_DICT_ENTRY) {
+    std::string_view name;
+
+    dbus_message_iter_recurse(&entries, value);
+    if(readValue(value, name) && name == key) {
+      dbus_message_iter_next(value);
+      return true;
+    }
+
+    dbus_message_iter_next(&entries);
+  }
+
+  return false;
+}
+
+
+//top level message arguments, read in order
+template<typename... Ts>
+bool readArgs(DBusMessage * message, Ts &... values) {
+  DBusMessageIter iter;
+  if(!dbus_message_iter_init(message, &iter)) return sizeof...(Ts) == 0;
+
+  bool ok = true;
+  ((ok = ok && readValue(&iter, values) && (dbus_message_iter_next(&iter), true)), ...);
+  return ok;
+}
+
+template<typename... Ts>
+bool appendArgs(DBusMessage * message, const Ts &... values) {
+  DBusMessageIter iter;
+  dbus_message_iter_init_append(message, &iter);
+  return (appendValue(&iter, values) && ...);
+}
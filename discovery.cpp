@@ -0,0 +1,237 @@
+#include "discovery.hpp"
+
+#include <map>
+#include <variant>
+
+
+void DiscoveryCounter::setScanning(bool scanning) {
+  int64_t now = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+
+  if(scanning) {
+    scanningSinceNs.store(now, std::memory_order_relaxed);
+    return;
+  }
+
+  int64_t since = scanningSinceNs.exchange(0, std::memory_order_relaxed);
+  if(since) radioNs.fetch_add(now - since, std::memory_order_relaxed);
+}
+
+void DiscoveryCounter::setSessions(uint32_t sessions, float dutyCycle) {
+  this->sessions.store(sessions, std::memory_order_relaxed);
+  this->dutyCycle.store(dutyCycle, std::memory_order_relaxed);
+}
+
+void DiscoveryCounter::setBusMessages(uint64_t count) {
+  busMessages.store(count, std::memory_order_relaxed);
+}
+
+DiscoveryStats DiscoveryCounter::get() {
+  auto now = std::chrono::steady_clock::now();
+  int64_t nowNs = std::chrono::duration_cast<std::chrono::nanoseconds>(now.time_since_epoch()).count();
+
+  uint64_t radio = radioNs.load(std::memory_order_relaxed);
+  int64_t since = scanningSinceNs.load(std::memory_order_relaxed);
+  //the window that is open right now counts too
+  if(since) radio += nowNs - since;
+
+  return DiscoveryStats{
+    radio / 1000000,
+    (uint64_t) std::chrono::duration_cast<std::chrono::milliseconds>(now - started).count(),
+    busMessages.load(std::memory_order_relaxed),
+    sessions.load(std::memory_order_relaxed),
+    dutyCycle.load(std::memory_order_relaxed),
+    since != 0,
+  };
+}
+
+
+DiscoveryFilter mergeFilters(const std::vector<DiscoveryFilter> & filters) {
+  DiscoveryFilter retval;
+  if(filters.empty()) return retval;
+
+  retval = filters[0];
+
+  for(const DiscoveryFilter & filter : filters) {
+    if(filter.transport != retval.transport) retval.transport = "auto";
+
+    //the widest request wins, a session without a floor or uuid list removes it for everyone
+    if(!filter.rssi || !retval.rssi) retval.rssi.reset();
+    else retval.rssi = std::min(*retval.rssi, *filter.rssi);
+
+    retval.duplicateData = retval.duplicateData || filter.duplicateData;
+  }
+
+  bool everyDevice = std::any_of(filters.begin(), filters.end(), [](const DiscoveryFilter & filter){
+    return filter.uuids.empty();
+  });
+
+  retval.uuids.clear();
+  if(!everyDevice) {
+    for(const DiscoveryFilter & filter : filters) retval.uuids.insert(retval.uuids.end(), filter.uuids.begin(), filter.uuids.end());
+    std::sort(retval.uuids.begin(), retval.uuids.end());
+    retval.uuids.erase(std::unique(retval.uuids.begin(), retval.uuids.end()), retval.uuids.end());
+  }
+
+  return retval;
+}
+
+
+DiscoveryManager::DiscoveryManager(BluetoothController & controller, DiscoveryCounter & counter) : controller(controller), counter(counter) {
+  dutyCycle = 0;
+
+  wantScanning = false;
+  scanning = false;
+  applying = false;
+  generation = controller.getGeneration();
+
+  epoch = std::chrono::steady_clock::now();
+  nextChange = epoch;
+  nextRetry = epoch;
+}
+
+
+void DiscoveryManager::acquire(uint64_t session, DiscoveryProfile profile) {
+  sessions[session] = profile;
+  merge();
+}
+
+void DiscoveryManager::update(uint64_t session, DiscoveryProfile profile) {
+  auto existing = sessions.find(session);
+  if(existing == sessions.end()) return;
+
+  existing->second = profile;
+  merge();
+}
+
+void DiscoveryManager::release(uint64_t session) {
+  sessions.erase(session);
+  merge();
+}
+
+
+void DiscoveryManager::merge() {
+  std::vector<DiscoveryFilter> filters;
+  dutyCycle = 0;
+
+  for(auto & [id, profile] : sessions) {
+    filters.push_back(profile.filter);
+    dutyCycle = std::max(dutyCycle, profile.dutyCycle);
+  }
+
+  filter = mergeFilters(filters);
+  counter.setSessions(sessions.size(), dutyCycle);
+}
+
+
+Task<Reply> DiscoveryManager::adapterCall(DBusMessage * message) {
+  co_return co_await controller.call(message, std::chrono::steady_clock::now() + DISCOVERY_CALL_TIMEOUT);
+}
+
+static DBusMessage * filterMessage(const DiscoveryFilter & filter) {
+  typedef std::variant<std::string, int16_t, std::vector<std::string>, bool> FilterValue;
+
+  std::map<std::string, FilterValue> entries;
+  entries["Transport"] = filter.transport;
+  entries["DuplicateData"] = filter.duplicateData;
+  if(filter.rssi) entries["RSSI"] = *filter.rssi;
+  if(!filter.uuids.empty()) entries["UUIDs"] = filter.uuids;
+
+  DBusMessage * message = dbus_message_new_method_call(BT_SERVICE, ADAPTER_PATH, ADAPTER_INTERFACE, "SetDiscoveryFilter");
+  appendArgs(message, entries);
+  return message;
+}
+
+Task<void> DiscoveryManager::applyTask() {
+  //the wanted state can move while a call is out, so keep going until bluez has caught up
+  while(true) {
+    bool want = wantScanning;
+
+    if(want && appliedFilter != filter) {
+      DiscoveryFilter next = filter;
+      TraceAsyncSpan span("set discovery filter");
+      Reply reply = co_await adapterCall(filterMessage(next));
+
+      if(!reply.ok()) {
+        std::cerr << "setting discovery filter: " << reply.error << '\n';
+        nextRetry = std::chrono::steady_clock::now() + DISCOVERY_RETRY_INTERVAL;
+        break;
+      }
+
+      appliedFilter = next;
+      continue;
+    }
+
+    if(want == scanning) break;
+
+    const char * method = want ? "StartDiscovery" : "StopDiscovery";
+    TraceAsyncSpan span(method);
+    Reply reply = co_await adapterCall(dbus_message_new_method_call(BT_SERVICE, ADAPTER_PATH, ADAPTER_INTERFACE, method));
+
+    //already scanning on start, or no session left to stop, both leave bluez where we want it
+    bool settled = reply.ok() ||
+      (want && reply.error == "org.bluez.Error.InProgress") ||
+      (!want && reply.error == "org.bluez.Error.Failed");
+
+    if(!settled) {
+      std::cerr << method << ": " << reply.error << '\n';
+      nextRetry = std::chrono::steady_clock::now() + DISCOVERY_RETRY_INTERVAL;
+      break;
+    }
+
+    scanning = want;
+    counter.setScanning(want);
+  }
+
+  applying = false;
+}
+
+void DiscoveryManager::apply() {
+  //a running task picks up the newest wanted state before it finishes
+  if(applying) return;
+
+  applying = true;
+  Scheduler::current()->spawn(applyTask());
+}
+
+
+int DiscoveryManager::tick(int maxMs) {
+  auto now = std::chrono::steady_clock::now();
+
+  counter.setBusMessages(controller.getMessagesReceived());
+
+  //bluez drops client sessions and filters when it restarts or the bus goes away
+  if(controller.getGeneration() != generation) {
+    generation = controller.getGeneration();
+    if(scanning) counter.setScanning(false);
+    scanning = false;
+    appliedFilter.reset();
+    nextRetry = now;
+  }
+
+  if(sessions.empty() || dutyCycle <= 0) {
+    wantScanning = false;
+    nextChange = now + std::chrono::milliseconds(maxMs);
+  } else if(dutyCycle >= 1) {
+    wantScanning = true;
+    nextChange = now + std::chrono::milliseconds(maxMs);
+  } else {
+    auto window = std::max<std::chrono::steady_clock::duration>(DISCOVERY_MIN_WINDOW,
+      std::chrono::duration_cast<std::chrono::steady_clock::duration>(DISCOVERY_PERIOD * dutyCycle));
+    auto periodStart = epoch + (now - epoch) / DISCOVERY_PERIOD * DISCOVERY_PERIOD;
+
+    wantScanning = now < periodStart + window;
+    nextChange = wantScanning ? periodStart + window : periodStart + DISCOVERY_PERIOD;
+  }
+
+  bool settled = wantScanning == scanning && (!wantScanning || appliedFilter == filter);
+
+  auto wakeAt = nextChange;
+  if(!settled && !applying) {
+    if(now >= nextRetry) apply();
+    else wakeAt = std::min(wakeAt, nextRetry);
+  }
+
+  auto until = std::chrono::duration_cast<std::chrono::milliseconds>(wakeAt - now).count();
+  //round up so a window edge is never polled for a moment too early
+  return std::clamp<long>(until + 1, 0, maxMs);
+}
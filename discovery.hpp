@@ -0,0 +1,102 @@
+#pragma once
+
+#include "bluelight.hpp"
+
+#include <vector>
+#include <string>
+#include <optional>
+#include <unordered_map>
+#include <atomic>
+#include <chrono>
+
+#define ADAPTER_INTERFACE "org.bluez.Adapter1"
+
+//scan windows open at the start of each period and stay open for the duty cycle's share of it
+constexpr auto DISCOVERY_PERIOD = std::chrono::seconds(10);
+//advertisers commonly use intervals around a second, shorter windows mostly miss them
+constexpr auto DISCOVERY_MIN_WINDOW = std::chrono::seconds(1);
+constexpr auto DISCOVERY_CALL_TIMEOUT = std::chrono::seconds(2);
+constexpr auto DISCOVERY_RETRY_INTERVAL = std::chrono::seconds(1);
+
+//mirrors the Adapter1.SetDiscoveryFilter dictionary
+struct DiscoveryFilter {
+  //"auto", "le" or "bredr"
+  std::string transport = "auto";
+  std::optional<int16_t> rssi;
+  //empty matches every device
+  std::vector<std::string> uuids;
+  bool duplicateData = false;
+
+  bool operator==(const DiscoveryFilter&) const = default;
+};
+
+struct DiscoveryProfile {
+  DiscoveryFilter filter;
+  //share of each DISCOVERY_PERIOD spent scanning, 1 scans continuously
+  float dutyCycle = 1.0f;
+};
+
+struct DiscoveryStats {
+  uint64_t radioMs;
+  uint64_t elapsedMs;
+  uint64_t busMessages;
+  uint32_t sessions;
+  float dutyCycle;
+  bool scanning;
+};
+
+//written by the bluetooth thread, readable from any other
+class DiscoveryCounter {
+  std::atomic<uint64_t> radioNs{0};
+  std::atomic<int64_t> scanningSinceNs{0};
+  std::atomic<uint64_t> busMessages{0};
+  std::atomic<uint32_t> sessions{0};
+  std::atomic<float> dutyCycle{0};
+  std::chrono::steady_clock::time_point started = std::chrono::steady_clock::now();
+
+public:
+  void setScanning(bool scanning);
+  void setSessions(uint32_t sessions, float dutyCycle);
+  void setBusMessages(uint64_t count);
+  DiscoveryStats get();
+};
+
+
+//every user of discovery holds a session with its own profile. sessions are merged into one
+//filter and one duty cycle, so the editor and the presence loop share a single scan instead of
+//fighting over StartDiscovery and StopDiscovery. bluez merges filters across processes the same way
+class DiscoveryManager {
+  BluetoothController & controller;
+  DiscoveryCounter & counter;
+
+  std::unordered_map<uint64_t, DiscoveryProfile> sessions;
+  DiscoveryFilter filter;
+  float dutyCycle;
+
+  bool wantScanning;
+  bool scanning;
+  std::optional<DiscoveryFilter> appliedFilter;
+  bool applying;
+  uint64_t generation;
+
+  std::chrono::steady_clock::time_point epoch;
+  std::chrono::steady_clock::time_point nextChange;
+  std::chrono::steady_clock::time_point nextRetry;
+
+  void merge();
+  void apply();
+  Task<void> applyTask();
+  Task<Reply> adapterCall(DBusMessage * message);
+
+public:
+  DiscoveryManager(BluetoothController & controller, DiscoveryCounter & counter);
+
+  void acquire(uint64_t session, DiscoveryProfile profile);
+  void update(uint64_t session, DiscoveryProfile profile);
+  void release(uint64_t session);
+
+  //opens and closes scan windows, returns how long until it next needs to run
+  int tick(int maxMs);
+};
+
+DiscoveryFilter mergeFilters(const std::vector<DiscoveryFilter> & filters);
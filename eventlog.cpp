@@ -0,0 +1,342 @@
+#include "eventlog.hpp"
+#include "trace.hpp"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <filesystem>
+#include <algorithm>
+#include <unordered_map>
+#include <map>
+#include <cstring>
+#include <ctime>
+
+
+uint32_t logKeyId(const std::string & address) {
+  //FNV-1a, case folded so the id doesn't depend on how the address was typed
+  uint32_t hash = 2166136261u;
+  for(char c : address) {
+    hash ^= (uint8_t) toupper(c);
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static int64_t wallClockMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+LogRecord makeLogRecord(LogEventType type, uint32_t keyId, uint16_t zone, int16_t rssi, bool lightsOn) {
+  LogRecord retval{};
+  retval.timestampMs = wallClockMs();
+  retval.keyId = keyId;
+  retval.zone = zone;
+  retval.rssi = rssi;
+  retval.type = type;
+  retval.lightsOn = lightsOn;
+  return retval;
+}
+
+
+EventLog::EventLog(std::string directory) {
+  this->directory = directory;
+
+  fd = -1;
+  segmentRecords = 0;
+  //the writer only ever reuses this, no allocations once running
+  batch.reserve(LOG_QUEUE_SIZE);
+
+  running = true;
+  written = 0;
+  dropped = 0;
+
+  std::error_code error;
+  std::filesystem::create_directories(directory, error);
+
+  thread = std::thread(&EventLog::run, this);
+}
+
+EventLog::~EventLog() {
+  {
+    std::lock_guard<std::mutex> lock(wakeMutex);
+    running = false;
+  }
+  wake.notify_one();
+
+  thread.join();
+}
+
+
+bool EventLog::append(LogRecord record) {
+  if(!queue.push(std::move(record))) {
+    dropped.fetch_add(1, std::memory_order_relaxed);
+    return false;
+  }
+  return true;
+}
+
+uint64_t EventLog::getWritten() {
+  return written.load(std::memory_order_relaxed);
+}
+
+uint64_t EventLog::getDropped() {
+  return dropped.load(std::memory_order_relaxed);
+}
+
+
+bool EventLog::openSegment() {
+  char name[64];
+  snprintf(name, sizeof(name), "/presence-%016lld.log", (long long) wallClockMs());
+  std::string path = directory + name;
+
+  fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+  if(fd < 0) return false;
+
+  //reserve the whole segment now so appends never wait on the filesystem finding blocks
+  posix_fallocate(fd, 0, LOG_HEADER_SIZE + (off_t) LOG_SEGMENT_RECORDS * sizeof(LogRecord));
+
+  uint8_t header[LOG_HEADER_SIZE] = {};
+  uint32_t version = 1;
+  uint32_t recordSize = sizeof(LogRecord);
+  int64_t created = wallClockMs();
+  memcpy(header, LOG_MAGIC, 8);
+  memcpy(header + 8, &version, 4);
+  memcpy(header + 12, &recordSize, 4);
+  memcpy(header + 16, &created, 8);
+
+  if(pwrite(fd, header, sizeof(header), 0) != sizeof(header)) {
+    close(fd);
+    fd = -1;
+    return false;
+  }
+
+  segmentRecords = 0;
+  pruneSegments();
+  return true;
+}
+
+void EventLog::closeSegment() {
+  if(fd < 0) return;
+
+  //hand back the unused part of the preallocation
+  int result = ftruncate(fd, LOG_HEADER_SIZE + (off_t) segmentRecords * sizeof(LogRecord));
+  (void) result;
+
+  close(fd);
+  fd = -1;
+}
+
+void EventLog::pruneSegments() {
+  std::vector<std::string> segments = listSegments(directory);
+  if(segments.size() <= LOG_MAX_SEGMENTS) return;
+
+  for(size_t i = 0; i < segments.size() - LOG_MAX_SEGMENTS; i++) unlink(segments[i].c_str());
+}
+
+
+void EventLog::writeBatch() {
+  batch.clear();
+
+  LogRecord record;
+  while(batch.size() < LOG_QUEUE_SIZE && queue.pop(record)) batch.push_back(record);
+
+  size_t done = 0;
+
+  while(done < batch.size()) {
+    if(fd < 0 || segmentRecords == LOG_SEGMENT_RECORDS) {
+      closeSegment();
+      if(!openSegment()) break;
+    }
+
+    size_t count = std::min(batch.size() - done, (size_t) LOG_SEGMENT_RECORDS - segmentRecords);
+    size_t bytes = count * sizeof(LogRecord);
+    off_t offset = LOG_HEADER_SIZE + (off_t) segmentRecords * sizeof(LogRecord);
+
+    if(pwrite(fd, batch.data() + done, bytes, offset) != (ssize_t) bytes) break;
+
+    segmentRecords += count;
+    done += count;
+  }
+
+  written.fetch_add(done, std::memory_order_relaxed);
+  dropped.fetch_add(batch.size() - done, std::memory_order_relaxed);
+}
+
+void EventLog::run() {
+  traceThreadName("eventlog");
+
+  while(running) {
+    {
+      std::unique_lock<std::mutex> lock(wakeMutex);
+      wake.wait_for(lock, LOG_FLUSH_INTERVAL, [this](){ return !running; });
+    }
+
+    writeBatch();
+  }
+
+  //whatever was appended before shutdown still makes it to disk
+  writeBatch();
+  closeSegment();
+}
+
+
+MappedSegment::MappedSegment(const std::string & path) {
+  memory = nullptr;
+  size = 0;
+  records = nullptr;
+  count = 0;
+
+  int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if(fd < 0) return;
+
+  struct stat info;
+  if(fstat(fd, &info) || info.st_size < LOG_HEADER_SIZE) {
+    close(fd);
+    return;
+  }
+
+  size = info.st_size;
+  memory = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+
+  if(memory == MAP_FAILED || memcmp(memory, LOG_MAGIC, 8)) {
+    if(memory != MAP_FAILED) munmap(memory, size);
+    memory = nullptr;
+    return;
+  }
+
+  madvise(memory, size, MADV_SEQUENTIAL);
+
+  records = reinterpret_cast<const LogRecord*>(static_cast<const uint8_t*>(memory) + LOG_HEADER_SIZE);
+  count = (size - LOG_HEADER_SIZE) / sizeof(LogRecord);
+
+  //the segment still being written is zero past its last record, binary search for where
+  count = std::partition_point(records, records + count, [](const LogRecord & record){
+    return record.timestampMs != 0;
+  }) - records;
+}
+
+MappedSegment::~MappedSegment() {
+  if(memory) munmap(memory, size);
+}
+
+bool MappedSegment::isOpen() {
+  return memory != nullptr;
+}
+
+const LogRecord * MappedSegment::begin() {
+  return records;
+}
+
+const LogRecord * MappedSegment::end() {
+  return records + count;
+}
+
+
+std::vector<std::string> listSegments(const std::string & directory) {
+  std::vector<std::string> retval;
+
+  std::error_code error;
+  for(auto & entry : std::filesystem::directory_iterator(directory, error)) {
+    std::string name = entry.path().filename();
+    if(name.compare(0, 9, "presence-") || name.size() < 4 || name.compare(name.size() - 4, 4, ".log")) continue;
+    retval.push_back(entry.path());
+  }
+
+  //names carry a fixed width start time, so name order is time order
+  std::sort(retval.begin(), retval.end());
+  return retval;
+}
+
+
+std::vector<OccupancyRow> occupiedMinutes(const std::string & directory) {
+  struct KeyState {
+    uint16_t zone;
+    bool present;
+  };
+
+  struct ZoneState {
+    int present;
+    int64_t since;
+  };
+
+  std::unordered_map<uint32_t, KeyState> keys;
+  std::unordered_map<uint16_t, ZoneState> zones;
+  std::map<std::pair<std::string, uint16_t>, double> minutes;
+
+  auto addInterval = [&](uint16_t zone, int64_t fromMs, int64_t toMs) {
+    while(fromMs < toMs) {
+      time_t seconds = fromMs / 1000;
+      tm local;
+      localtime_r(&seconds, &local);
+
+      char day[16];
+      strftime(day, sizeof(day), "%Y-%m-%d", &local);
+
+      local.tm_mday++;
+      local.tm_hour = 0;
+      local.tm_min = 0;
+      local.tm_sec = 0;
+      local.tm_isdst = -1;
+      int64_t midnightMs = (int64_t) mktime(&local) * 1000;
+
+      int64_t untilMs = std::min(toMs, midnightMs);
+      minutes[{day, zone}] += (untilMs - fromMs) / 60000.0;
+      fromMs = untilMs;
+    }
+  };
+
+  auto closeAll = [&](int64_t atMs) {
+    for(auto & [zone, state] : zones) {
+      if(state.present > 0) addInterval(zone, state.since, atMs);
+    }
+    zones.clear();
+    keys.clear();
+  };
+
+  //only transitions do any work, the scan itself is a walk over mapped memory
+  for(const std::string & path : listSegments(directory)) {
+    MappedSegment segment(path);
+    if(!segment.isOpen()) continue;
+
+    for(const LogRecord & record : segment) {
+      switch(record.type) {
+        case LogEventType::Start:
+          closeAll(record.timestampMs);
+          break;
+
+        case LogEventType::Arrived: {
+          KeyState & key = keys[record.keyId];
+          if(key.present) break;
+          key = KeyState{record.zone, true};
+
+          ZoneState & zone = zones[record.zone];
+          if(zone.present++ == 0) zone.since = record.timestampMs;
+          break;
+        }
+
+        case LogEventType::Departed: {
+          auto key = keys.find(record.keyId);
+          if(key == keys.end() || !key->second.present) break;
+          key->second.present = false;
+
+          ZoneState & zone = zones[key->second.zone];
+          if(--zone.present == 0) addInterval(key->second.zone, zone.since, record.timestampMs);
+          break;
+        }
+
+        default:
+          break;
+      }
+    }
+  }
+
+  //keys still present when the log ends are counted up to now
+  closeAll(wallClockMs());
+
+  std::vector<OccupancyRow> retval;
+  for(auto & [day, total] : minutes) retval.push_back(OccupancyRow{day.first, day.second, total});
+  return retval;
+}
@@ -0,0 +1,122 @@
+#pragma once
+
+#include "ring.hpp"
+
+#include <vector>
+#include <string>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <cstdint>
+
+#define LOG_DIR "/var/lib/bluelight/log"
+
+#define LOG_MAGIC "BLLOG001"
+#define LOG_HEADER_SIZE 32
+//about 6MB per segment, preallocated when the segment is opened
+#define LOG_SEGMENT_RECORDS (1 << 18)
+#define LOG_MAX_SEGMENTS 128
+#define LOG_QUEUE_SIZE 4096
+
+constexpr auto LOG_FLUSH_INTERVAL = std::chrono::milliseconds(250);
+
+enum class LogEventType : uint8_t {
+  //the daemon (re)started, nothing before it says anything about who is present now
+  Start = 1,
+  Arrived,
+  Departed,
+  LightsOn,
+  LightsOff,
+};
+
+//fixed size and written raw, so a mapped segment is just an array of these
+struct LogRecord {
+  //wall clock milliseconds, 0 marks the unwritten tail of a preallocated segment
+  int64_t timestampMs;
+  uint32_t keyId;
+  uint16_t zone;
+  int16_t rssi;
+  LogEventType type;
+  uint8_t lightsOn;
+  uint8_t reserved[6];
+};
+
+static_assert(sizeof(LogRecord) == 24);
+
+//stable across edits of the keys file, unlike an index into it
+uint32_t logKeyId(const std::string & address);
+
+LogRecord makeLogRecord(LogEventType type, uint32_t keyId, uint16_t zone, int16_t rssi, bool lightsOn);
+
+
+//append never blocks the caller: records go into a ring, and a writer thread takes them out in
+//batches, one write per batch, rotating to a fresh preallocated segment when one fills up
+class EventLog {
+  SpscRing<LogRecord, LOG_QUEUE_SIZE> queue;
+  std::string directory;
+
+  int fd;
+  size_t segmentRecords;
+  std::vector<LogRecord> batch;
+
+  std::atomic<bool> running;
+  std::atomic<uint64_t> written;
+  std::atomic<uint64_t> dropped;
+  std::mutex wakeMutex;
+  std::condition_variable wake;
+
+  std::thread thread;
+
+  bool openSegment();
+  void closeSegment();
+  void pruneSegments();
+  void writeBatch();
+  void run();
+
+public:
+  EventLog(std::string directory = LOG_DIR);
+  ~EventLog();
+
+  EventLog(const EventLog&) = delete;
+  EventLog& operator=(const EventLog&) = delete;
+
+  //false when the writer has fallen a whole queue behind, the record is counted and dropped
+  bool append(LogRecord record);
+
+  uint64_t getWritten();
+  uint64_t getDropped();
+};
+
+
+//a read only mapping of one segment
+class MappedSegment {
+  void * memory;
+  size_t size;
+  const LogRecord * records;
+  size_t count;
+
+public:
+  MappedSegment(const std::string & path);
+  ~MappedSegment();
+
+  MappedSegment(const MappedSegment&) = delete;
+  MappedSegment& operator=(const MappedSegment&) = delete;
+
+  bool isOpen();
+  const LogRecord * begin();
+  const LogRecord * end();
+};
+
+//segment paths, oldest first
+std::vector<std::string> listSegments(const std::string & directory = LOG_DIR);
+
+struct OccupancyRow {
+  std::string day;
+  uint16_t zone;
+  double minutes;
+};
+
+//a zone counts as occupied while at least one of its keys is present, split on local midnight
+std::vector<OccupancyRow> occupiedMinutes(const std::string & directory = LOG_DIR);
@@ -0,0 +1,348 @@
+#include "iothread.hpp"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+void HandoffCounter::record(std::chrono::steady_clock::time_point sentAt) {
+  uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - sentAt).count();
+
+  count.fetch_add(1, std::memory_order_relaxed);
+  totalNs.fetch_add(ns, std::memory_order_relaxed);
+
+  uint64_t previous = maxNs.load(std::memory_order_relaxed);
+  while(ns > previous && !maxNs.compare_exchange_weak(previous, ns, std::memory_order_relaxed));
+}
+
+void HandoffCounter::drop() {
+  dropped.fetch_add(1, std::memory_order_relaxed);
+}
+
+HandoffStats HandoffCounter::get() {
+  return HandoffStats{
+    count.load(std::memory_order_relaxed),
+    totalNs.load(std::memory_order_relaxed),
+    maxNs.load(std::memory_order_relaxed),
+    dropped.load(std::memory_order_relaxed),
+  };
+}
+
+
+static void signalFd(int fd) {
+  uint64_t one = 1;
+  ssize_t written = write(fd, &one, sizeof(one));
+  (void) written;
+}
+
+static void drainFd(int fd) {
+  uint64_t count;
+  ssize_t bytesRead = read(fd, &count, sizeof(count));
+  (void) bytesRead;
+}
+
+
+BluetoothThread::BluetoothThread(std::chrono::milliseconds refreshInterval) {
+  this->refreshInterval = refreshInterval;
+
+  commandFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  eventFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+
+  running = true;
+  nextCommandId = 1;
+  eventsPending = false;
+  presenceQueued = false;
+  refreshRunning = false;
+  refreshWanted = false;
+
+  thread = std::thread(&BluetoothThread::run, this);
+}
+
+BluetoothThread::~BluetoothThread() {
+  running = false;
+  signalFd(commandFd);
+  thread.join();
+
+  close(commandFd);
+  close(eventFd);
+}
+
+
+uint64_t BluetoothThread::enqueue(Command command) {
+  uint64_t id = nextCommandId.fetch_add(1, std::memory_order_relaxed);
+  command.id = id;
+  command.sentAt = std::chrono::steady_clock::now();
+
+  if(!commands.push(std::move(command))) {
+    commandHandoff.drop();
+    return 0;
+  }
+
+  signalFd(commandFd);
+  return id;
+}
+
+uint64_t BluetoothThread::send(CommandType type, std::string path, std::chrono::milliseconds timeout, uint64_t flow) {
+  return enqueue(Command{type, path, 0, 0, std::chrono::steady_clock::now() + timeout, {}, {}, flow});
+}
+
+uint64_t BluetoothThread::trust(std::string path, std::string alias, std::chrono::milliseconds timeout) {
+  return enqueue(Command{CommandType::Trust, path, 0, 0, std::chrono::steady_clock::now() + timeout, {}, {}, 0, alias});
+}
+
+void BluetoothThread::cancel(uint64_t id) {
+  enqueue(Command{CommandType::Cancel, "", 0, id, std::chrono::steady_clock::now()});
+}
+
+
+uint64_t BluetoothThread::startDiscovery(DiscoveryProfile profile) {
+  return enqueue(Command{CommandType::StartDiscovery, "", 0, 0, {}, {}, profile});
+}
+
+void BluetoothThread::updateDiscovery(uint64_t session, DiscoveryProfile profile) {
+  enqueue(Command{CommandType::UpdateDiscovery, "", 0, session, {}, {}, profile});
+}
+
+void BluetoothThread::stopDiscovery(uint64_t session) {
+  enqueue(Command{CommandType::StopDiscovery, "", 0, session});
+}
+
+void BluetoothThread::publishPresence(const PresenceSnapshot & snapshot) {
+  bool queued;
+  {
+    std::lock_guard<std::mutex> lock(presenceMutex);
+    queued = presenceQueued;
+    presenceQueued = true;
+    pendingPresence = snapshot;
+  }
+
+  //a command already on its way will pick up the newer table
+  if(queued || enqueue(Command{CommandType::PublishPresence})) return;
+
+  //the ring was full, the table waits and the next publish tries again
+  std::lock_guard<std::mutex> lock(presenceMutex);
+  presenceQueued = false;
+}
+
+bool BluetoothThread::receive(Event & event) {
+  if(!events.pop(event)) {
+    drainFd(eventFd);
+    //an event published between the failed pop and the drain would otherwise go unnoticed
+    if(!events.pop(event)) return false;
+  }
+
+  eventHandoff.record(event.publishedAt);
+  return true;
+}
+
+int BluetoothThread::getEventFd() {
+  return eventFd;
+}
+
+HandoffStats BluetoothThread::getEventHandoff() {
+  return eventHandoff.get();
+}
+
+HandoffStats BluetoothThread::getCommandHandoff() {
+  return commandHandoff.get();
+}
+
+DiscoveryStats BluetoothThread::getDiscoveryStats() {
+  return discoveryCounter.get();
+}
+
+
+void BluetoothThread::publish(Event event) {
+  event.publishedAt = std::chrono::steady_clock::now();
+
+  if(!events.push(std::move(event))) {
+    eventHandoff.drop();
+    return;
+  }
+
+  eventsPending = true;
+}
+
+
+Task<void> BluetoothThread::pairTask(Device device, Command command, CancelToken cancel) {
+  Reply reply;
+
+  if(command.type == CommandType::Pair) reply = co_await device.pair(command.deadline, cancel);
+  else if(command.type == CommandType::Trust) {
+    reply = co_await device.trust(command.deadline, cancel);
+    if(reply.ok() && !command.alias.empty()) reply = co_await device.setAlias(command.alias, command.deadline, cancel);
+  } else reply = co_await device.unPair(command.deadline, cancel);
+
+  inFlight.erase(command.id);
+
+  publish(Event{CommandResultEvent{command.id, command.type, command.path, reply.ok(), reply.error}});
+
+  requestRefresh();
+}
+
+
+Task<void> BluetoothThread::verifyTask(Device device, Command command, CancelToken cancel) {
+  bool present;
+  {
+    TraceAsyncSpan span("verify proximity", command.flow);
+    present = co_await device.verifyProximity(command.deadline, cancel);
+  }
+
+  inFlight.erase(command.id);
+
+  TraceSpan span("probe answered", command.flow);
+  publish(Event{PresenceEvent{command.id, command.path, device.getAddress(), present, device.getRSSI()}, {}, command.flow});
+}
+
+
+Task<void> BluetoothThread::refreshLoop() {
+  while(running) {
+    Deadline next = std::chrono::steady_clock::now() + refreshInterval;
+    co_await scheduler->sleepUntil(next);
+    co_await controller->refreshDevices(next + refreshInterval);
+  }
+}
+
+
+Task<void> BluetoothThread::refreshTask() {
+  while(refreshWanted) {
+    refreshWanted = false;
+    co_await controller->refreshDevices(std::chrono::steady_clock::now() + DEFAULT_COMMAND_TIMEOUT);
+  }
+  refreshRunning = false;
+}
+
+void BluetoothThread::requestRefresh() {
+  refreshWanted = true;
+  if(refreshRunning) return;
+
+  refreshRunning = true;
+  scheduler->spawn(refreshTask());
+}
+
+
+void BluetoothThread::execute(Command & command) {
+  TraceSpan span("execute command", command.flow);
+
+  switch(command.type) {
+    case CommandType::Pair:
+    case CommandType::UnPair:
+    case CommandType::Trust:
+    case CommandType::Verify: {
+      auto device = controller->getDevice(command.path);
+
+      if(!device) {
+        if(command.type == CommandType::Verify) {
+          publish(Event{PresenceEvent{command.id, command.path, "", false, 0}});
+        } else {
+          publish(Event{CommandResultEvent{command.id, command.type, command.path, false, "device not found"}});
+        }
+        break;
+      }
+
+      CancelToken cancel = CancelToken::create();
+      inFlight[command.id] = cancel;
+
+      if(command.type == CommandType::Verify) scheduler->spawn(verifyTask(*device, command, cancel));
+      else scheduler->spawn(pairTask(*device, command, cancel));
+      break;
+    }
+
+    case CommandType::Cancel: {
+      auto task = inFlight.find(command.target);
+      if(task != inFlight.end()) task->second.cancel();
+      break;
+    }
+
+    case CommandType::Refresh:
+      requestRefresh();
+      break;
+
+    case CommandType::StartDiscovery:
+      discovery->acquire(command.id, command.discovery);
+      publish(Event{CommandResultEvent{command.id, command.type, "", true, ""}});
+      break;
+
+    case CommandType::UpdateDiscovery:
+      discovery->update(command.target, command.discovery);
+      break;
+
+    case CommandType::StopDiscovery:
+      discovery->release(command.target);
+      publish(Event{CommandResultEvent{command.id, command.type, "", true, ""}});
+      break;
+
+    case CommandType::PublishPresence: {
+      std::optional<PresenceSnapshot> snapshot;
+      {
+        std::lock_guard<std::mutex> lock(presenceMutex);
+        snapshot.swap(pendingPresence);
+        presenceQueued = false;
+      }
+      if(!snapshot) break;
+
+      if(!presenceService) {
+        presenceService = std::make_unique<PresenceService>(*controller, [this](){
+          publish(Event{ReprobeEvent{}});
+        });
+      }
+      presenceService->update(*snapshot);
+      break;
+    }
+  }
+}
+
+
+void BluetoothThread::run() {
+  traceThreadName("bluetooth");
+
+  BluetoothController bluetoothController;
+  //declared after the controller so frames still awaiting bus calls are destroyed first
+  Scheduler taskScheduler;
+  DiscoveryManager discoveryManager(bluetoothController, discoveryCounter);
+
+  controller = &bluetoothController;
+  scheduler = &taskScheduler;
+  discovery = &discoveryManager;
+  scheduler->makeCurrent();
+
+  //every table handed out starts a flow, the ones that end up changing presence run to the strip
+  controller->setOnDevicesUpdated([&](){
+    uint64_t flow = traceNewFlow();
+    TraceSpan span("devices published", flow);
+    publish(Event{DevicesEvent{controller->getDevices()}, {}, flow});
+  });
+
+  requestRefresh();
+  scheduler->spawn(refreshLoop());
+
+  while(running) {
+    //ticked first, opening or closing a scan window schedules a task the poll mustn't wait past
+    int untilDiscovery = discovery->tick(IDLE_POLL_MS);
+    controller->poll(std::min(scheduler->nextTimeoutMs(IDLE_POLL_MS), untilDiscovery), commandFd);
+
+    drainFd(commandFd);
+
+    Command command;
+    while(commands.pop(command)) {
+      commandHandoff.record(command.sentAt);
+      execute(command);
+    }
+
+    scheduler->run();
+
+    //delivers the devices update queued by commands or tasks above
+    controller->poll(0);
+
+    //spawned here, the next poll then doesn't wait
+    if(controller->takeRefreshRequest()) requestRefresh();
+
+    //one wakeup per loop iteration no matter how many events went out
+    if(eventsPending) {
+      eventsPending = false;
+      signalFd(eventFd);
+    }
+  }
+
+  //unexports itself, so it has to go before the controller does
+  presenceService.reset();
+}
@@ -0,0 +1,203 @@
+#pragma once
+
+#include "bluelight.hpp"
+#include "discovery.hpp"
+#include "service.hpp"
+#include "ring.hpp"
+#include "trace.hpp"
+
+#include <thread>
+#include <variant>
+#include <atomic>
+#include <unordered_map>
+#include <mutex>
+#include <memory>
+
+#define EVENT_QUEUE_SIZE 256
+#define COMMAND_QUEUE_SIZE 256
+
+//upper bound on how long the thread blocks in poll with nothing scheduled
+#define IDLE_POLL_MS 1000
+
+constexpr auto DEFAULT_COMMAND_TIMEOUT = std::chrono::seconds(25);
+
+enum class CommandType {
+  Pair,
+  UnPair,
+  Trust,
+  Verify,
+  Refresh,
+  StartDiscovery,
+  UpdateDiscovery,
+  StopDiscovery,
+  PublishPresence,
+  Cancel,
+};
+
+struct Command {
+  CommandType type;
+  std::string path;
+  uint64_t id;
+  //the command a Cancel is aimed at, or the discovery session to update or stop
+  uint64_t target;
+  Deadline deadline;
+  std::chrono::steady_clock::time_point sentAt;
+  DiscoveryProfile discovery;
+  //trace flow the command continues, 0 for none
+  uint64_t flow = 0;
+  //the name a Trust also gives the device, empty leaves its name alone
+  std::string alias;
+};
+
+struct DevicesEvent {
+  std::vector<Device> devices;
+};
+
+struct CommandResultEvent {
+  uint64_t id;
+  CommandType type;
+  std::string path;
+  bool ok;
+  std::string error;
+};
+
+struct PresenceEvent {
+  uint64_t id;
+  std::string path;
+  std::string address;
+  bool present;
+  short rssi;
+};
+
+//a bus client asked for presence to be checked now rather than at the next round
+struct ReprobeEvent {
+};
+
+//Devices inside events are snapshots, only the bluetooth thread may make D-Bus calls through them
+struct Event {
+  std::variant<DevicesEvent, CommandResultEvent, PresenceEvent, ReprobeEvent> payload;
+  std::chrono::steady_clock::time_point publishedAt;
+  uint64_t flow = 0;
+};
+
+
+struct HandoffStats {
+  uint64_t count;
+  uint64_t totalNs;
+  uint64_t maxNs;
+  uint64_t dropped;
+};
+
+class HandoffCounter {
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> totalNs{0};
+  std::atomic<uint64_t> maxNs{0};
+  std::atomic<uint64_t> dropped{0};
+
+public:
+  void record(std::chrono::steady_clock::time_point sentAt);
+  void drop();
+  HandoffStats get();
+};
+
+
+//the part of the bluetooth thread the presence sources talk to, so they can run against a
+//simulated radio as well
+class BluetoothLink {
+public:
+  virtual ~BluetoothLink() = default;
+
+  //returns the command id, or 0 when the queue is full
+  virtual uint64_t send(CommandType type, std::string path = "", std::chrono::milliseconds timeout = DEFAULT_COMMAND_TIMEOUT, uint64_t flow = 0) = 0;
+  //a Trust that also sets the device's alias, the name desktops show for it
+  virtual uint64_t trust(std::string path, std::string alias, std::chrono::milliseconds timeout) = 0;
+  //the command still answers, with ERROR_CANCELLED
+  virtual void cancel(uint64_t id) = 0;
+  virtual bool receive(Event & event) = 0;
+
+  //the returned session id keeps discovery running until stopDiscovery, 0 when the queue is full
+  virtual uint64_t startDiscovery(DiscoveryProfile profile) = 0;
+  virtual void updateDiscovery(uint64_t session, DiscoveryProfile profile) = 0;
+  virtual void stopDiscovery(uint64_t session) = 0;
+
+  //readable while receive has events, -1 when there is nothing to poll
+  virtual int getEventFd() = 0;
+};
+
+
+//owns the DBusConnection on its own thread. device and presence events flow out over an
+//SPSC ring, commands from any thread flow in over an MPSC ring, and eventfds wake each side
+class BluetoothThread : public BluetoothLink {
+  SpscRing<Event, EVENT_QUEUE_SIZE> events;
+  MpscRing<Command, COMMAND_QUEUE_SIZE> commands;
+
+  int commandFd;
+  int eventFd;
+
+  std::atomic<bool> running;
+  std::atomic<uint64_t> nextCommandId;
+  std::chrono::milliseconds refreshInterval;
+
+  HandoffCounter eventHandoff;
+  HandoffCounter commandHandoff;
+  DiscoveryCounter discoveryCounter;
+
+  bool eventsPending;
+
+  //only the newest table matters, so publishing overwrites this instead of queueing copies
+  std::mutex presenceMutex;
+  std::optional<PresenceSnapshot> pendingPresence;
+  //a PublishPresence command is in the ring, cleared when it runs or couldn't be queued
+  bool presenceQueued;
+
+  //only touched from the bluetooth thread
+  BluetoothController * controller;
+  Scheduler * scheduler;
+  DiscoveryManager * discovery;
+  //created by the first published table, so only the daemon owns the bus name
+  std::unique_ptr<PresenceService> presenceService;
+  std::unordered_map<uint64_t, CancelToken> inFlight;
+  //at most one refreshTask runs, requests that land while it does are folded into one more pass
+  bool refreshRunning;
+  bool refreshWanted;
+
+  std::thread thread;
+
+  void run();
+  uint64_t enqueue(Command command);
+  void execute(Command & command);
+  void publish(Event event);
+
+  //each command runs as its own task, so slow pairings and probes overlap instead of queueing.
+  //pairTask also forgets and trusts
+  Task<void> pairTask(Device device, Command command, CancelToken cancel);
+  Task<void> verifyTask(Device device, Command command, CancelToken cancel);
+  Task<void> refreshLoop();
+  Task<void> refreshTask();
+  void requestRefresh();
+
+public:
+  BluetoothThread(std::chrono::milliseconds refreshInterval);
+  ~BluetoothThread();
+
+  BluetoothThread(const BluetoothThread&) = delete;
+  BluetoothThread& operator=(const BluetoothThread&) = delete;
+
+  uint64_t send(CommandType type, std::string path = "", std::chrono::milliseconds timeout = DEFAULT_COMMAND_TIMEOUT, uint64_t flow = 0) override;
+  uint64_t trust(std::string path, std::string alias, std::chrono::milliseconds timeout) override;
+  void cancel(uint64_t id) override;
+  bool receive(Event & event) override;
+
+  uint64_t startDiscovery(DiscoveryProfile profile) override;
+  void updateDiscovery(uint64_t session, DiscoveryProfile profile) override;
+  void stopDiscovery(uint64_t session) override;
+
+  //exports the table on the bus, see PresenceService
+  void publishPresence(const PresenceSnapshot & snapshot);
+
+  int getEventFd() override;
+
+  HandoffStats getEventHandoff();
+  HandoffStats getCommandHandoff();
+  DiscoveryStats getDiscoveryStats();
+};
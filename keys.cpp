@@ -0,0 +1,88 @@
+#include "keys.hpp"
+
+#include <unistd.h>
+
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <cstdlib>
+#include <cstdio>
+#include <cerrno>
+
+
+std::optional<Key> parseKey(const std::string & line) {
+  std::istringstream stream(line);
+  std::string token;
+
+  if(!(stream >> token)) return std::nullopt;
+
+  Key retval;
+  retval.address = token;
+
+  while(stream >> token) {
+    if(!token.compare(0, 4, "irk=")) {
+      retval.irk = parseIrk(token.substr(4));
+      //without its IRK the phone is only ever seen at its public address
+      if(!retval.irk) std::cerr << "ignoring malformed irk for " << retval.address << ", it needs 32 hex digits\n";
+    } else if(!token.compare(0, 5, "zone=")) {
+      retval.zone = strtoul(token.c_str() + 5, nullptr, 10);
+    } else if(!token.compare(0, 5, "wifi=")) {
+      retval.wifi = parseAddress(token.substr(5));
+      //without it the neighbor source has nothing to match the phone on
+      if(!retval.wifi) std::cerr << "ignoring malformed wifi address for " << retval.address << '\n';
+    }
+  }
+
+  return retval;
+}
+
+std::string formatKey(const Key & key) {
+  std::string retval = key.address;
+  if(key.irk) retval += " irk=" + formatIrk(*key.irk);
+  if(key.zone) retval += " zone=" + std::to_string(key.zone);
+  if(key.wifi) retval += " wifi=" + formatAddress(*key.wifi);
+  return retval;
+}
+
+
+std::vector<Key> loadKeys() {
+  std::vector<Key> retval;
+  std::fstream file(KEYS_FILE, std::ios_base::in);
+
+  std::string line;
+
+  while(std::getline(file, line)) {
+    auto key = parseKey(line);
+    if(key) retval.push_back(*key);
+  }
+
+  return retval;
+}
+
+//written beside the store and renamed over it, so the daemon never loads half a file
+bool saveKeys(std::vector<Key> keys) {
+  //a name of its own, the editor and provision can both be saving at once
+  std::string temporary = std::string(KEYS_FILE) + ".XXXXXX";
+  int fd = mkstemp(temporary.data());
+  if(fd < 0) return false;
+
+  std::string contents;
+  for(const Key & key : keys) contents += formatKey(key) + '\n';
+
+  //mkstemp makes it 0600 and the rename keeps that, IRKs let whoever reads them track the phone
+  bool ok = true;
+  for(size_t written = 0; ok && written < contents.size();) {
+    ssize_t count = write(fd, contents.data() + written, contents.size() - written);
+    if(count < 0 && errno == EINTR) continue;
+    ok = count > 0;
+    if(ok) written += count;
+  }
+
+  //without this a crash right after the rename can leave an empty keys file behind
+  ok = ok && fsync(fd) == 0;
+  ok = close(fd) == 0 && ok;
+  ok = ok && rename(temporary.c_str(), KEYS_FILE) == 0;
+
+  if(!ok) unlink(temporary.c_str());
+  return ok;
+}
@@ -0,0 +1,25 @@
+#pragma once
+
+#include "rpa.hpp"
+
+#include <vector>
+#include <string>
+#include <optional>
+
+#define KEYS_FILE "/etc/bluelight/keys"
+
+//one line per key: "<address> [irk=<32 hex digits>] [zone=<n>] [wifi=<mac>]"
+struct Key {
+  std::string address;
+  std::optional<Irk> irk;
+  uint16_t zone = 0;
+  //the same owner's phone on the LAN, watched through the kernel neighbor table
+  std::optional<BdAddr> wifi;
+};
+
+std::vector<Key> loadKeys();
+//false when the store could not be replaced, it is left as it was
+bool saveKeys(std::vector<Key> keys);
+
+std::optional<Key> parseKey(const std::string & line);
+std::string formatKey(const Key & key);
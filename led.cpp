@@ -0,0 +1,335 @@
+#include "led.hpp"
+
+#include <netdb.h>
+#include <unistd.h>
+#include <time.h>
+
+#include <fstream>
+#include <sstream>
+#include <iostream>
+#include <cerrno>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+
+LEDConfig loadLEDConfig() {
+  LEDConfig retval;
+  std::fstream file(LED_FILE, std::ios_base::in);
+
+  std::string line;
+
+  while(std::getline(file, line)) {
+    std::istringstream stream(line);
+    std::string name;
+
+    if(!(stream >> name) || name[0] == '#') continue;
+
+    if(name == "host") stream >> retval.host;
+    else if(name == "port") stream >> retval.port;
+    else if(name == "pixels") stream >> retval.pixels;
+    else if(name == "fps") stream >> retval.fps;
+    else if(name == "color") {
+      int r, g, b;
+      if(stream >> r >> g >> b) retval.color = {(uint8_t) r, (uint8_t) g, (uint8_t) b};
+    } else if(name == "fade_in") {
+      int ms;
+      if(stream >> ms) retval.fadeIn = std::chrono::milliseconds(ms);
+    } else if(name == "fade_out") {
+      int ms;
+      if(stream >> ms) retval.fadeOut = std::chrono::milliseconds(ms);
+    } else if(name == "gamma") stream >> retval.gamma;
+    else if(name == "max_brightness") stream >> retval.maxBrightness;
+    else if(name == "order") {
+      std::string order;
+      stream >> order;
+      if(auto parsed = parseColorOrder(order)) retval.order = *parsed;
+    } else if(name == "zone") {
+      size_t start, count;
+      int r, g, b;
+      if(stream >> start >> count >> r >> g >> b) {
+        retval.zones.push_back(PixelZone{start, count, {(uint8_t) r, (uint8_t) g, (uint8_t) b}});
+      }
+    }
+  }
+
+  retval.fps = std::clamp(retval.fps, 1, 1000);
+  retval.gamma = std::clamp(retval.gamma, 0.1f, 5.0f);
+
+  return retval;
+}
+
+
+LEDConnection::LEDConnection(LEDConfig config) {
+  this->config = config;
+
+  sock = -1;
+  sequence = 0;
+
+  running = true;
+  lightsOn = false;
+  lightsFlow = 0;
+
+  frames = 0;
+  packets = 0;
+  sendFailures = 0;
+  skippedFrames = 0;
+  ticks = 0;
+  totalJitterNs = 0;
+  maxJitterNs = 0;
+  renders = 0;
+  renderNs = 0;
+  started = std::chrono::steady_clock::now();
+
+  if(!open()) return;
+
+  buildPackets();
+  thread = std::thread(&LEDConnection::run, this);
+}
+
+LEDConnection::~LEDConnection() {
+  {
+    std::lock_guard<std::mutex> lock(wakeMutex);
+    running = false;
+  }
+  wake.notify_one();
+
+  if(thread.joinable()) thread.join();
+  if(sock >= 0) close(sock);
+}
+
+
+bool LEDConnection::open() {
+  addrinfo hints{};
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_DGRAM;
+
+  addrinfo * result;
+  int error = getaddrinfo(config.host.c_str(), std::to_string(config.port).c_str(), &hints, &result);
+  if(error) {
+    std::cerr << "led: could not resolve " << config.host << ": " << gai_strerror(error) << '\n';
+    return false;
+  }
+
+  for(addrinfo * address = result; address; address = address->ai_next) {
+    //non-blocking so a full socket buffer costs a frame instead of stalling the frame clock
+    sock = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, address->ai_protocol);
+    if(sock < 0) continue;
+
+    if(!connect(sock, address->ai_addr, address->ai_addrlen)) break;
+
+    close(sock);
+    sock = -1;
+  }
+
+  freeaddrinfo(result);
+
+  if(sock < 0) std::cerr << "led: could not open a socket to " << config.host << '\n';
+  return sock >= 0;
+}
+
+
+//every packet is a header plus a slice of the frame buffer, so sends never copy pixel data
+void LEDConnection::buildPackets() {
+  std::vector<PixelZone> zones = config.zones;
+  if(zones.empty()) zones.push_back(PixelZone{0, config.pixels, config.color});
+
+  renderer = std::make_unique<FrameRenderer>(config.pixels, zones, config.gamma, config.maxBrightness, config.order);
+  frame.assign(config.pixels * 3, 0);
+
+  size_t count = (frame.size() + DDP_MAX_DATA - 1) / DDP_MAX_DATA;
+
+  headers.resize(count);
+  iovecs.resize(count * 2);
+  messages.assign(count, mmsghdr{});
+
+  for(size_t i = 0; i < count; i++) {
+    uint32_t offset = i * DDP_MAX_DATA;
+    uint16_t length = std::min<size_t>(DDP_MAX_DATA, frame.size() - offset);
+
+    auto & header = headers[i];
+    header[0] = DDP_FLAGS_VER1 | (i == count - 1 ? DDP_FLAGS_PUSH : 0);
+    header[1] = 0;
+    header[2] = DDP_TYPE_RGB24;
+    header[3] = DDP_ID_DISPLAY;
+    header[4] = offset >> 24;
+    header[5] = offset >> 16;
+    header[6] = offset >> 8;
+    header[7] = offset;
+    header[8] = length >> 8;
+    header[9] = length;
+
+    iovecs[i * 2] = iovec{header.data(), DDP_HEADER_SIZE};
+    iovecs[i * 2 + 1] = iovec{frame.data() + offset, length};
+
+    messages[i].msg_hdr.msg_iov = &iovecs[i * 2];
+    messages[i].msg_hdr.msg_iovlen = 2;
+  }
+}
+
+void LEDConnection::render(float level) {
+  auto start = std::chrono::steady_clock::now();
+
+  renderer->render(level, frame.data());
+
+  renders.fetch_add(1, std::memory_order_relaxed);
+  renderNs.fetch_add(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count(), std::memory_order_relaxed);
+}
+
+bool LEDConnection::sendFrame() {
+  //sequence numbers run 1-15, 0 tells the receiver not to track them
+  sequence = sequence % 15 + 1;
+  for(auto & header : headers) header[1] = sequence;
+
+  size_t sent = 0;
+
+  while(sent < messages.size()) {
+    int result = sendmmsg(sock, &messages[sent], messages.size() - sent, 0);
+
+    if(result < 0) {
+      if(errno == EINTR) continue;
+      //EAGAIN and friends, the rest of this frame is stale by the time the socket drains
+      packets.fetch_add(sent, std::memory_order_relaxed);
+      return false;
+    }
+
+    sent += result;
+  }
+
+  packets.fetch_add(sent, std::memory_order_relaxed);
+  return true;
+}
+
+
+void LEDConnection::recordJitter(std::chrono::nanoseconds jitter) {
+  uint64_t ns = std::max<int64_t>(jitter.count(), 0);
+
+  ticks.fetch_add(1, std::memory_order_relaxed);
+  totalJitterNs.fetch_add(ns, std::memory_order_relaxed);
+
+  uint64_t previous = maxJitterNs.load(std::memory_order_relaxed);
+  while(ns > previous && !maxJitterNs.compare_exchange_weak(previous, ns, std::memory_order_relaxed));
+}
+
+
+static void sleepUntil(std::chrono::steady_clock::time_point at) {
+  auto ns = std::chrono::duration_cast<std::chrono::nanoseconds>(at.time_since_epoch()).count();
+  timespec time{(time_t) (ns / 1000000000), (long) (ns % 1000000000)};
+
+  //absolute deadlines so time spent rendering and sending doesn't push the clock back
+  while(clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &time, nullptr) == EINTR);
+}
+
+void LEDConnection::run() {
+  traceThreadName("led");
+
+  const auto period = std::chrono::nanoseconds(std::chrono::seconds(1)) / config.fps;
+
+  bool target = false;
+  float level = 0;
+  float from = 0;
+  float sentLevel = -1;
+  //DDP is never acknowledged, so a traced change ends at the first frame sent and at the end of its fade
+  uint64_t flow = 0;
+  bool firstFrame = false;
+
+  std::chrono::steady_clock::time_point fadeStart;
+  std::chrono::nanoseconds fadeLength(0);
+
+  auto tick = std::chrono::steady_clock::now();
+  auto lastSent = tick;
+
+  while(running) {
+    auto now = std::chrono::steady_clock::now();
+
+    bool on = lightsOn.load(std::memory_order_acquire);
+    if(on != target) {
+      flow = lightsFlow.load(std::memory_order_relaxed);
+      firstFrame = true;
+      target = on;
+      from = level;
+      fadeStart = now;
+      //a fade reversed part way through only covers the remaining distance
+      fadeLength = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        (on ? config.fadeIn : config.fadeOut) * std::fabs((on ? 1.0f : 0.0f) - level));
+    }
+
+    float goal = target ? 1.0f : 0.0f;
+    if(level != goal) {
+      float progress = fadeLength.count() > 0 ? std::chrono::duration<float>(now - fadeStart) / fadeLength : 1.0f;
+      level = progress >= 1.0f ? goal : from + (goal - from) * progress;
+    }
+
+    if(level != sentLevel || now - lastSent >= LED_KEEPALIVE_INTERVAL) {
+      bool fadeComplete = !firstFrame && level == goal && level != sentLevel;
+      TraceSpan span(firstFrame ? "first frame" : fadeComplete ? "fade complete" : "frame", firstFrame || fadeComplete ? flow : 0);
+
+      render(level);
+
+      if(sendFrame()) {
+        sentLevel = level;
+        firstFrame = false;
+        frames.fetch_add(1, std::memory_order_relaxed);
+      } else {
+        sendFailures.fetch_add(1, std::memory_order_relaxed);
+      }
+
+      lastSent = now;
+    }
+
+    if(level != goal) {
+      tick += period;
+      now = std::chrono::steady_clock::now();
+
+      //whole frames that were missed are skipped rather than sent as a burst
+      if(now >= tick + period) {
+        auto missed = (now - tick) / period;
+        skippedFrames.fetch_add(missed, std::memory_order_relaxed);
+        tick += missed * period;
+      }
+
+      sleepUntil(tick);
+      recordJitter(std::chrono::steady_clock::now() - tick);
+    } else {
+      //a steady strip only needs keepalives, so sleep until one is due or the scene changes
+      std::unique_lock<std::mutex> lock(wakeMutex);
+      wake.wait_until(lock, lastSent + LED_KEEPALIVE_INTERVAL, [&](){
+        return !running || lightsOn.load(std::memory_order_acquire) != target;
+      });
+      tick = std::chrono::steady_clock::now();
+    }
+  }
+}
+
+
+bool LEDConnection::isOpen() {
+  return sock >= 0;
+}
+
+void LEDConnection::setLights(bool on, uint64_t flow) {
+  TraceSpan span("lights requested", flow);
+
+  {
+    std::lock_guard<std::mutex> lock(wakeMutex);
+    lightsFlow.store(flow, std::memory_order_relaxed);
+    lightsOn.store(on, std::memory_order_release);
+  }
+  wake.notify_one();
+}
+
+FrameStats LEDConnection::getStats() {
+  return FrameStats{
+    frames.load(std::memory_order_relaxed),
+    packets.load(std::memory_order_relaxed),
+    sendFailures.load(std::memory_order_relaxed),
+    skippedFrames.load(std::memory_order_relaxed),
+    ticks.load(std::memory_order_relaxed),
+    totalJitterNs.load(std::memory_order_relaxed),
+    maxJitterNs.load(std::memory_order_relaxed),
+    renders.load(std::memory_order_relaxed),
+    renderNs.load(std::memory_order_relaxed),
+    config.pixels,
+    renderer ? renderer->getIsa() : PixelIsa::Scalar,
+    started,
+  };
+}
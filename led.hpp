@@ -0,0 +1,123 @@
+#pragma once
+
+#include "pixels.hpp"
+#include "trace.hpp"
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+#include <vector>
+#include <string>
+#include <array>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <chrono>
+#include <cstdint>
+
+#define LED_FILE "/etc/bluelight/led"
+
+//Distributed Display Protocol, as spoken by WLED, xLights and most pixel controllers
+#define DDP_PORT 4048
+#define DDP_HEADER_SIZE 10
+#define DDP_MAX_DATA 1440
+#define DDP_FLAGS_VER1 0x40
+#define DDP_FLAGS_PUSH 0x01
+#define DDP_TYPE_RGB24 0x0B
+#define DDP_ID_DISPLAY 1
+
+//receivers drop back to their own effects when a stream goes quiet, so idle strips get a resend
+constexpr auto LED_KEEPALIVE_INTERVAL = std::chrono::seconds(1);
+
+//one line per setting: "<name> <value...>", e.g. "host 192.168.1.40" or "color 255 180 100".
+//"zone <start> <count> <r> <g> <b>" lines split the strip, without any the whole strip uses color
+struct LEDConfig {
+  std::string host;
+  uint16_t port = DDP_PORT;
+  size_t pixels = 60;
+  int fps = 50;
+  std::array<uint8_t, 3> color = {255, 180, 100};
+  std::chrono::milliseconds fadeIn = std::chrono::milliseconds(800);
+  std::chrono::milliseconds fadeOut = std::chrono::milliseconds(3000);
+  float gamma = 2.2f;
+  //fraction of full white the supply can carry across the whole strip
+  float maxBrightness = 1.0f;
+  ColorOrder order = ColorOrder::RGB;
+  std::vector<PixelZone> zones;
+};
+
+LEDConfig loadLEDConfig();
+
+struct FrameStats {
+  uint64_t frames;
+  uint64_t packets;
+  //frames the socket refused part or all of
+  uint64_t sendFailures;
+  //frame clock ticks that passed while the thread was still busy with an earlier one
+  uint64_t skippedFrames;
+  //jitter is sampled once per paced frame, keepalives aren't paced
+  uint64_t ticks;
+  uint64_t totalJitterNs;
+  uint64_t maxJitterNs;
+  uint64_t renders;
+  uint64_t renderNs;
+  size_t pixels;
+  PixelIsa isa;
+  std::chrono::steady_clock::time_point started;
+};
+
+//streams frames over UDP from its own thread on a fixed frame clock. frames are rendered in
+//place and sent straight from the frame buffer, and a late or blocked frame is skipped rather
+//than queued, so the strip always shows the newest state
+class LEDConnection {
+  LEDConfig config;
+  int sock;
+
+  std::unique_ptr<FrameRenderer> renderer;
+  std::vector<uint8_t> frame;
+  std::vector<std::array<uint8_t, DDP_HEADER_SIZE>> headers;
+  std::vector<iovec> iovecs;
+  std::vector<mmsghdr> messages;
+  uint8_t sequence;
+
+  std::atomic<bool> running;
+  std::atomic<bool> lightsOn;
+  //trace flow of the latest setLights, stored before lightsOn so the frame thread sees it with the change
+  std::atomic<uint64_t> lightsFlow;
+  std::mutex wakeMutex;
+  std::condition_variable wake;
+
+  std::atomic<uint64_t> frames;
+  std::atomic<uint64_t> packets;
+  std::atomic<uint64_t> sendFailures;
+  std::atomic<uint64_t> skippedFrames;
+  std::atomic<uint64_t> ticks;
+  std::atomic<uint64_t> totalJitterNs;
+  std::atomic<uint64_t> maxJitterNs;
+  std::atomic<uint64_t> renders;
+  std::atomic<uint64_t> renderNs;
+  std::chrono::steady_clock::time_point started;
+
+  std::thread thread;
+
+  bool open();
+  void buildPackets();
+  void render(float level);
+  bool sendFrame();
+  void recordJitter(std::chrono::nanoseconds jitter);
+  void run();
+
+public:
+  LEDConnection(LEDConfig config);
+  ~LEDConnection();
+
+  LEDConnection(const LEDConnection&) = delete;
+  LEDConnection& operator=(const LEDConnection&) = delete;
+
+  bool isOpen();
+  void setLights(bool on, uint64_t flow = 0);
+
+  FrameStats getStats();
+};
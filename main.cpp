@@ -1,32 +1,82 @@
 #include "bluelight.hpp"
+#include "iothread.hpp"
+#include "keys.hpp"
+#include "rpa.hpp"
+#include "led.hpp"
+#include "operations.hpp"
+#include "eventlog.hpp"
+#include "publisher.hpp"
+#include "sources.hpp"
+#include "neighbor.hpp"
+#include "simulation.hpp"
+#include "provision.hpp"
 
 #include <ncurses.h>
+#include <unistd.h>
+#include <signal.h>
+#include <strings.h>
+#include <errno.h>
 
-#include <fstream>
-#include <thread>
+#include <set>
 
 
 #define INPUT_SHOULD_EXIT 1
 #define INPUT_CONTINUE 0
 
-#define KEYS_FILE "/etc/bluelight/keys"
-constexpr auto PING_INTERVAL = std::chrono::seconds(10);
+constexpr auto EDITOR_REFRESH_INTERVAL = std::chrono::seconds(1);
+#define POLL_INTERVAL_MS 100
+//how long a finished pair or forget keeps its result on the device row
+constexpr auto OPERATION_LINGER = std::chrono::seconds(8);
+//a running daemon publishes every probe round, a table older than a few of them is left over
+constexpr auto STATUS_STALE_AFTER = 3 * PING_INTERVAL;
+
+//a short label for a device row, errors keep only the last part of their D-Bus name
+std::string formatOperation(const Operation & operation) {
+  bool pairing = operation.type == CommandType::Pair;
+
+  switch(operation.state) {
+    case OperationState::Queued: return "[queued]";
+    case OperationState::Running: {
+      auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(std::chrono::steady_clock::now() - operation.startedAt);
+      return std::string(pairing ? "[pairing " : "[forgetting ") + std::to_string(elapsed.count()) + "s]";
+    }
+    case OperationState::Done: return pairing ? "[paired]" : "[forgotten]";
+    case OperationState::Cancelled: return "[cancelled]";
+    case OperationState::Failed: {
+      std::string error = operation.error.substr(operation.error.rfind('.') + 1);
+      return "[failed: " + error + "]";
+    }
+  }
+  return "";
+}
 
 class Gui {
   static const unsigned int WINDOW_WIDTH = 50;
 
   std::vector<Device> devices;
-  std::vector<std::string> keys;
+  std::vector<Key> keys;
   std::vector<Device> pairedDevices;
 
+  BluetoothThread & bluetooth;
+  OperationQueue operations;
+  std::set<std::string> selected;
+  bool showingOperations;
+
   WINDOW * pairingWindow;
   WINDOW * keyingWindow;
   
   int cursorX, cursorDevices, cursorKeys;
 
+  bool hasKey(std::string address) {
+    return std::find_if(keys.begin(), keys.end(), [address](Key key){
+      return key.address == address;
+    }) != keys.end();
+  }
+
 public:
 
-  Gui() {
+  Gui(BluetoothThread & bluetooth) : bluetooth(bluetooth), operations(bluetooth) {
+    showingOperations = false;
     cursorX = 0;
     cursorDevices = 0;
     cursorKeys = 0;
@@ -43,7 +93,8 @@ public:
     curs_set(0);
     noecho();
     cbreak();
-    timeout(1000);
+    //the editor loop waits on stdin and the bluetooth thread together, getch never blocks
+    timeout(0);
 
     //init_pair(1, -1, COLOR_GREY);
 
@@ -72,6 +123,15 @@ public:
       return dev.getAddress().compare(0, 2, dev.getAlias(), 0, 2) == 0;
     }), devices.end());
 
+    for(auto path = selected.begin(); path != selected.end();) {
+      bool present = std::find_if(devices.begin(), devices.end(), [&](Device dev){
+        return dev.getPath() == *path;
+      }) != devices.end();
+
+      if(present) path++;
+      else path = selected.erase(path);
+    }
+
     pairedDevices.clear();
     std::copy_if(d.begin(), d.end(), std::back_inserter(pairedDevices), [](Device dev){return dev.isBonded();});
 
@@ -82,6 +142,7 @@ public:
 
 
       if(cursorDevices >= devices.size()) cursorDevices = devices.size() - 1;
+      if(cursorDevices < 0) cursorDevices = 0;
     }
 
     if(oldPairedSize != pairedDevices.size()) {
@@ -90,9 +151,11 @@ public:
       wresize(keyingWindow, pairedDevices.size() + 2, WINDOW_WIDTH);
     }
 
-    keys.erase(std::remove_if(keys.begin(), keys.end(), [this](std::string key) {
+    //keys with an IRK outlive the address they were registered under, so never prune them
+    keys.erase(std::remove_if(keys.begin(), keys.end(), [this](Key key) {
+      if(key.irk) return false;
       return std::find_if(pairedDevices.begin(), pairedDevices.end(), [key](Device dev){
-        return dev.getAddress() == key || dev.getAlias().length() == 0;
+        return dev.getAddress() == key.address || dev.getAlias().length() == 0;
       }) == pairedDevices.end();
     }), keys.end());
 
@@ -100,11 +163,11 @@ public:
     render();
   }
 
-  void setKeys(std::vector<std::string> k) {
+  void setKeys(std::vector<Key> k) {
     keys = k;
   }
 
-  std::vector<std::string> getKeys() {
+  std::vector<Key> getKeys() {
     return keys;
   }
 
@@ -122,6 +185,13 @@ public:
     }
 
     mvwaddstr(pairingWindow, 0, 2, "Devices");
+
+    size_t running = operations.runningCount();
+    size_t queued = operations.queuedCount();
+    if(running || queued) {
+      std::string title = " " + std::to_string(running) + " running, " + std::to_string(queued) + " queued ";
+      mvwaddstr(pairingWindow, 0, WINDOW_WIDTH - title.length() - 2, title.c_str());
+    }
     mvwaddstr(keyingWindow, 0, 2, "Keys");
 
     for(int i = 0; i < devices.size(); i++) {
@@ -130,24 +200,26 @@ public:
       Device d = devices[i];
 
      
+      std::string action = d.isBonded() ? "[Forget]" : "[Pair]";
+
+      const Operation * operation = operations.find(d.getPath());
+      if(operation) action = formatOperation(*operation);
+
+      //long aliases give way to the action so errors stay readable
+      int aliasWidth = std::max<int>(0, WINDOW_WIDTH - action.length() - 6);
+
+      if(selected.count(d.getPath())) mvwaddstr(pairingWindow, 1+i, 2, "*");
+
       if(highlighted) wattron(pairingWindow, A_BOLD);
       
-      mvwaddstr(pairingWindow, 1+i, 2, d.getAlias().c_str());
+      mvwaddnstr(pairingWindow, 1+i, 4, d.getAlias().c_str(), aliasWidth);
       
       if(highlighted) wattroff(pairingWindow, A_BOLD);
 
 
-      const char * textPair = "[Pair]";
-      const char * textUnpair = "[Forget]";
-
-
       if(highlighted) wattron(pairingWindow, A_REVERSE);
 
-      if(d.isBonded()) {
-        mvwaddstr(pairingWindow, 1+i, WINDOW_WIDTH - strlen(textUnpair) - 1, textUnpair);
-      } else {
-        mvwaddstr(pairingWindow, 1+i, WINDOW_WIDTH - strlen(textPair) - 1, textPair);
-      }
+      mvwaddnstr(pairingWindow, 1+i, std::max<int>(1, WINDOW_WIDTH - action.length() - 1), action.c_str(), WINDOW_WIDTH - 2);
 
       if(highlighted) wattroff(pairingWindow, A_REVERSE);
     }
@@ -173,7 +245,7 @@ public:
       const char * textKey = "[KEY]";
       const char * textNonKey = "[]";
 
-      if(std::find(keys.begin(), keys.end(), d.getAddress()) == keys.end()) {
+      if(!hasKey(d.getAddress())) {
         mvwaddstr(keyingWindow, 1+i, WINDOW_WIDTH - strlen(textNonKey) - 1, textNonKey);
       } else {
         mvwaddstr(keyingWindow, 1+i, WINDOW_WIDTH - strlen(textKey) - 1, textKey);
@@ -190,6 +262,31 @@ public:
     wrefresh(keyingWindow);
   }
 
+  //the selected devices, or just the one under the cursor when nothing is selected
+  std::vector<Device> targets() {
+    if(selected.empty()) return {devices[cursorDevices]};
+
+    std::vector<Device> retval;
+    std::copy_if(devices.begin(), devices.end(), std::back_inserter(retval), [this](Device dev){
+      return selected.count(dev.getPath()) > 0;
+    });
+    return retval;
+  }
+
+  void handleResult(const CommandResultEvent & result) {
+    if(operations.handleResult(result)) render();
+  }
+
+  //keeps queued operations moving and elapsed times ticking while no input arrives
+  void update() {
+    operations.update();
+    operations.expire(OPERATION_LINGER);
+
+    bool hasOperations = !operations.getOperations().empty();
+    if(hasOperations || showingOperations) render();
+    showingOperations = hasOperations;
+  }
+
   int doInput() {
     int key;
     key = getch();
@@ -213,13 +310,27 @@ public:
 
       if(cursorDevices > devices.size() - 1) cursorDevices = devices.size() - 1;
 
-      if(key == '\n') {
-        Device curDevice = devices[cursorDevices];
-        if(curDevice.isBonded()) {
-          curDevice.unPair();
-        } else if(!curDevice.pair()) {
-          setDevices(devices);
+      if(key == ' ' && !devices.empty()) {
+        std::string path = devices[cursorDevices].getPath();
+        if(!selected.erase(path)) selected.insert(path);
+      }
+
+      if(key == 'a') {
+        if(selected.size() == devices.size()) selected.clear();
+        else for(Device & d : devices) selected.insert(d.getPath());
+      }
+
+      if(key == '\n' && !devices.empty()) {
+        for(Device & d : targets()) {
+          if(d.isBonded()) operations.submit(CommandType::UnPair, d.getPath(), FORGET_TIMEOUT);
+          else operations.submit(CommandType::Pair, d.getPath(), PAIR_TIMEOUT);
         }
+        selected.clear();
+      }
+
+      if(key == 'c' && !devices.empty()) {
+        for(Device & d : targets()) operations.cancel(d.getPath());
+        selected.clear();
       }
     } else {
       if(key == KEY_UP && cursorKeys > 0) cursorKeys--;
@@ -229,9 +340,12 @@ public:
 
       if(key == '\n') {
         Device curDevice = pairedDevices[cursorKeys];
-        if(std::find(keys.begin(), keys.end(), curDevice.getAddress()) == keys.end()) {
-          keys.push_back(curDevice.getAddress());
-        } else keys.erase(std::remove(keys.begin(), keys.end(), curDevice.getAddress()), keys.end());
+        std::string address = curDevice.getAddress();
+        if(!hasKey(address)) {
+          keys.push_back(Key{address});
+        } else keys.erase(std::remove_if(keys.begin(), keys.end(), [address](Key key){
+          return key.address == address;
+        }), keys.end());
       }
     }
 
@@ -245,101 +359,393 @@ public:
   }
 };
 
-std::vector<std::string> loadKeys() {
-  std::vector<std::string> retval;
-  std::fstream file(KEYS_FILE, std::ios_base::in);
+void printHandoff(const char * name, HandoffStats stats) {
+  uint64_t average = stats.count ? stats.totalNs / stats.count : 0;
+  std::cout << name << " handoff: " << stats.count << " messages, avg " << average << "ns, max " <<
+    stats.maxNs << "ns, " << stats.dropped << " dropped\n";
+}
 
-  char readBuffer[64];
+void printFrameStats(FrameStats stats) {
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - stats.started).count();
+  uint64_t averageJitter = stats.ticks ? stats.totalJitterNs / stats.ticks : 0;
+  std::cout << "led: " << stats.frames << " frames, " << (uint64_t) (stats.packets / seconds) << " packets/s, " <<
+    stats.sendFailures << " send failures, " << stats.skippedFrames << " skipped, jitter avg " << averageJitter << "ns, max " << stats.maxJitterNs << "ns\n";
 
-  while(true) {
-    file.getline(readBuffer, 64);
-    if(file.eof() || file.fail()) break;
-    retval.push_back(std::string(readBuffer));
+  if(stats.renders && stats.pixels) {
+    std::cout << "led: rendering " << (double) stats.renderNs / stats.renders / stats.pixels << "ns/pixel with " <<
+      formatPixelIsa(stats.isa) << '\n';
   }
-
-  return retval;
 }
 
-void saveKeys(std::vector<std::string> keys) {
-  std::fstream file(KEYS_FILE, std::ios_base::out);
-
-  for(std::string key : keys) {
-    file << key << '\n';
-  }
+void printDiscovery(DiscoveryStats stats) {
+  double seconds = stats.elapsedMs / 1000.0;
+  std::cout << "discovery: radio on " << stats.radioMs / 1000 << "s of " << stats.elapsedMs / 1000 << "s, " <<
+    (uint64_t) (stats.busMessages / std::max(seconds, 1.0)) << " bus messages/s, duty " << stats.dutyCycle << " over " <<
+    stats.sessions << " sessions\n";
 }
 
 int editor() {
-  BluetoothController controller;
+  BluetoothThread bluetooth(EDITOR_REFRESH_INTERVAL);
 
-  controller.startDiscovery();
-  controller.updateDevices();
+  //the editor lists everything nearby, so it scans continuously over both transports
+  uint64_t discovery = bluetooth.startDiscovery(DiscoveryProfile{DiscoveryFilter{"auto"}, 1.0f});
+  bool saved = true;
 
+  {
+    Gui gui(bluetooth);
 
-  Gui gui;
+    gui.setKeys(loadKeys());
 
-  gui.setKeys(loadKeys());
+    gui.render();
 
-  gui.render();
+    while(true) {
+      pollfd fds[2] = {
+        {STDIN_FILENO, POLLIN, 0},
+        {bluetooth.getEventFd(), POLLIN, 0},
+      };
+      ::poll(fds, 2, POLL_INTERVAL_MS);
 
-  controller.setOnDevicesUpdated([&](){
-      gui.setDevices(
-        controller.getDevices()
-      );
-  });
+      Event event;
+      while(bluetooth.receive(event)) {
+        if(auto update = std::get_if<DevicesEvent>(&event.payload)) gui.setDevices(update->devices);
+        else if(auto result = std::get_if<CommandResultEvent>(&event.payload)) gui.handleResult(*result);
+      }
 
+      gui.update();
 
-  while(true) {
-    controller.poll();
-    if(gui.doInput() == INPUT_SHOULD_EXIT) {
-      saveKeys(gui.getKeys());
-      return 0;
+      if(gui.doInput() == INPUT_SHOULD_EXIT) {
+        saved = saveKeys(gui.getKeys());
+        break;
+      }
     }
-    controller.updateDevices();
   }
+
+  printHandoff("event", bluetooth.getEventHandoff());
+  printHandoff("command", bluetooth.getCommandHandoff());
+  printDiscovery(bluetooth.getDiscoveryStats());
+
+  bluetooth.stopDiscovery(discovery);
+
+  //said once the screen is back to normal, the edits are lost otherwise without a word
+  if(!saved) {
+    std::cerr << "could not save keys to " << KEYS_FILE << '\n';
+    return 1;
+  }
+
+  return 0;
+}
+
+
+static volatile sig_atomic_t stopRequested = 0;
+
+static void requestStop(int) {
+  stopRequested = 1;
 }
 
+#ifdef TRACE
+static volatile sig_atomic_t traceRequested = 0;
+
+static void requestTrace(int) {
+  traceRequested = 1;
+}
+#endif
+
 int daemon() {
-  std::vector<std::string> keys = loadKeys();
+  traceThreadName("main");
+
+  //SIGTERM and SIGINT end the loop so everything is torn down in order, the event log included.
+  //they, and with TRACE SIGUSR1, are blocked before any thread starts so they all inherit that,
+  //and only the main loop's ppoll lets them in, which wakes it with EINTR
+  struct sigaction action{};
+  action.sa_handler = requestStop;
+  sigaction(SIGTERM, &action, nullptr);
+  sigaction(SIGINT, &action, nullptr);
+
+  sigset_t handled, pollMask;
+  sigemptyset(&handled);
+  sigaddset(&handled, SIGTERM);
+  sigaddset(&handled, SIGINT);
+
+#ifdef TRACE
+  //kill -USR1 writes out whatever the trace buffers hold
+  action.sa_handler = requestTrace;
+  sigaction(SIGUSR1, &action, nullptr);
+  sigaddset(&handled, SIGUSR1);
+#endif
+
+  pthread_sigmask(SIG_BLOCK, &handled, &pollMask);
+  sigdelset(&pollMask, SIGTERM);
+  sigdelset(&pollMask, SIGINT);
+#ifdef TRACE
+  sigdelset(&pollMask, SIGUSR1);
+#endif
+
+  std::vector<Key> keys = loadKeys();
   if(keys.size() == 0) return 1;
 
-  BluetoothController controller;
-  controller.updateDevices();
+  //without a configured host the daemon only logs its decisions
+  std::unique_ptr<LEDConnection> led;
+  LEDConfig ledConfig = loadLEDConfig();
+  if(!ledConfig.host.empty()) led = std::make_unique<LEDConnection>(ledConfig);
+
+  //device refreshes line up with the pings so each probe round sees a fresh table
+  BluetoothThread bluetooth(std::chrono::duration_cast<std::chrono::milliseconds>(PING_INTERVAL));
+
+  EventLog eventLog;
+  eventLog.append(makeLogRecord(LogEventType::Start, 0, 0, 0, false));
+
+  //local readers get the table from shared memory instead of the log or the bus
+  PresencePublisher presencePublisher(keys);
+  if(!presencePublisher.isOpen()) std::cerr << "could not publish presence to " << PRESENCE_SHM_NAME << '\n';
+
+  SteadyClock clock;
+
+  std::vector<std::unique_ptr<PresenceSource>> sources;
+  sources.push_back(std::make_unique<BluezSource>(bluetooth, keys, clock));
+
+  if(std::any_of(keys.begin(), keys.end(), [](const Key & key){ return key.wifi.has_value(); })) {
+    auto neighbor = std::make_unique<NeighborSource>(keys);
+    if(neighbor->isOpen()) sources.push_back(std::move(neighbor));
+    else std::cerr << "could not watch the neighbor table, wifi= addresses are ignored\n";
+  }
 
-  std::vector<Device> devices = controller.getDevices();
+  std::vector<float> weights;
+  for(auto & source : sources) weights.push_back(source->getWeight());
+  PresenceEngine engine(weights, keys.size());
 
   bool lightsOn = false;
 
+  std::vector<pollfd> fds(sources.size());
+  //ms until each source wants to run again, -1 for only when its fd is readable
+  std::vector<int> timers(sources.size(), 0);
+  std::vector<Observation> observations;
+
   while(true) {
-    std::this_thread::sleep_for(PING_INTERVAL);
+    int timeout = -1;
+    for(int i = 0; i < sources.size(); i++) {
+      fds[i] = pollfd{sources[i]->getFd(), POLLIN, 0};
+      if(timers[i] >= 0 && (timeout < 0 || timers[i] < timeout)) timeout = timers[i];
+    }
+    timespec wait{timeout / 1000, (timeout % 1000) * 1000000L};
+    ppoll(fds.data(), fds.size(), timeout < 0 ? nullptr : &wait, &pollMask);
+    if(stopRequested) break;
+
+#ifdef TRACE
+    if(traceRequested) {
+      traceRequested = 0;
+      if(traceFlush()) std::cout << "trace written to " << TRACE_FILE << '\n';
+      else std::cerr << "could not write trace to " << TRACE_FILE << '\n';
+    }
+#endif
 
-    bool keyFound = false;
+    bool heard = false;
 
-    for(auto key : keys) {
-      auto foundDevice = std::find_if(devices.begin(), devices.end(), [key](Device d){
-        return d.getAddress() == key;
-      });
+    for(int i = 0; i < sources.size(); i++) {
+      observations.clear();
+      timers[i] = sources[i]->update(observations);
 
-      if(foundDevice == devices.end()) continue;
-      if((*foundDevice).verifyProximity()) {
-        keyFound = true;
-        break;
+      for(Observation & observation : observations) {
+        engine.observe(i, observation);
+        if(observation.level > 0) presencePublisher.seen(observation.key, observation.rssi);
       }
+      heard = heard || !observations.empty();
+    }
+
+    if(!heard) continue;
+
+    TraceSpan decision("decision");
+    //the lights follow whichever key changed last
+    uint64_t flow = 0;
+
+    for(PresenceTransition & change : engine.decide()) {
+      TraceSpan transition("transition", change.flow);
+      flow = change.flow;
+      decision.setFlow(flow);
+
+      presencePublisher.setPresent(change.key, change.present);
+
+      Key & key = keys[change.key];
+      LogEventType type = change.present ? LogEventType::Arrived : LogEventType::Departed;
+      eventLog.append(makeLogRecord(type, logKeyId(key.address), key.zone, change.present ? change.rssi : 0, lightsOn));
     }
 
+    bool keyFound = engine.anyPresent();
+
     if(keyFound && !lightsOn) {
-      std::cout << "key found, turning lights on" << std::endl;
+      std::cout << "key found, turning lights on\n";
       lightsOn = true;
+      eventLog.append(makeLogRecord(LogEventType::LightsOn, 0, 0, 0, true));
+      printDiscovery(bluetooth.getDiscoveryStats());
+      if(led) {
+        led->setLights(true, flow);
+        printFrameStats(led->getStats());
+      }
     } else if(!keyFound && lightsOn) {
-      std::cout << "no keys found, turning lights off" << std::endl;
+      std::cout << "no keys found, turning lights off\n";
       lightsOn = false;
+      eventLog.append(makeLogRecord(LogEventType::LightsOff, 0, 0, 0, false));
+      printDiscovery(bluetooth.getDiscoveryStats());
+      if(led) {
+        led->setLights(false, flow);
+        printFrameStats(led->getStats());
+      }
+    }
+
+    presencePublisher.setLightsOn(lightsOn);
+    presencePublisher.publish();
+    bluetooth.publishPresence(presencePublisher.getSnapshot());
+  }
+
+  std::cout << "stopping\n";
+  return 0;
+}
+
+void printLatency(const char * name, LatencySummary latency) {
+  std::cout << name << ": " << latency.count << " timed, p50 " << latency.p50 << "s, p90 " << latency.p90 << "s, p99 " <<
+    latency.p99 << "s, max " << latency.max << "s\n";
+}
+
+//the presence logic against a week of made up comings and goings, in virtual time
+int simulate(std::vector<std::string> & args) {
+  SimulationConfig config;
+
+  if(args.size() > 2) {
+    auto loaded = loadSimulationConfig(args[2]);
+    if(!loaded) {
+      std::cerr << "could not read " << args[2] << '\n';
+      return 1;
     }
+    config = *loaded;
+  }
+
+  SimulationReport report = simulate(config);
+  double total = 24.0 * 60 * 60 * report.days;
+
+  std::cout << "simulated " << report.days << " days with " << report.keys << " keys in " << report.wallSeconds << "s\n";
+  std::cout << "visits: " << report.visits << ", " << report.missed << " over before the lights came on\n";
+  std::cout << "lights on: " << report.lightsOn << " times, " << report.falseOn << " with nobody home\n";
+  std::cout << "lights off: " << report.lightsOff << " times, " << report.falseOff << " with someone home\n";
+  printLatency("arrival to lights on", report.onLatency);
+  printLatency("departure to lights off", report.offLatency);
+  std::cout << "dark while occupied " << 100 * report.darkOccupiedSeconds / std::max(report.occupiedSeconds, 1.0) << "%, lit while empty " <<
+    100 * report.litEmptySeconds / std::max(total - report.occupiedSeconds, 1.0) << "%\n";
+  std::cout << "cost: " << report.probes << " probes, " << (uint64_t) report.probeSeconds << "s paging, scanning " <<
+    100 * report.scanSeconds / total << "% of the time\n";
+
+  return 0;
+}
+
+//pairs, trusts and registers every device in the manifest without the editor, results go to
+//stdout as JSON so rollout scripts can check them
+int provision(std::vector<std::string> & args) {
+  if(args.size() < 3) {
+    std::cerr << "provision needs a manifest\n";
+    return 1;
+  }
+
+  auto entries = loadManifest(args[2]);
+  if(!entries || entries->empty()) {
+    std::cerr << "no devices in " << args[2] << '\n';
+    return 1;
   }
+
+  BluetoothThread bluetooth(PROVISION_REFRESH_INTERVAL);
+  uint64_t discovery = bluetooth.startDiscovery(DiscoveryProfile{DiscoveryFilter{"auto"}, 1.0f});
+
+  Provisioner provisioner(bluetooth, *entries);
+
+  while(!provisioner.update()) {
+    pollfd fd{bluetooth.getEventFd(), POLLIN, 0};
+    ::poll(&fd, 1, POLL_INTERVAL_MS);
+
+    Event event;
+    while(bluetooth.receive(event)) {
+      if(auto update = std::get_if<DevicesEvent>(&event.payload)) provisioner.setDevices(update->devices);
+      else if(auto result = std::get_if<CommandResultEvent>(&event.payload)) provisioner.handleResult(*result);
+    }
+  }
+
+  bluetooth.stopDiscovery(discovery);
+
+  //provisioned keys replace any stored ones with the same address, the rest are left alone
+  std::vector<Key> keys = loadKeys();
+  bool provisioned = false;
+
+  for(const ProvisionEntry & entry : provisioner.getEntries()) {
+    if(entry.stage != ProvisionStage::Done) continue;
+    provisioned = true;
+
+    auto existing = std::find_if(keys.begin(), keys.end(), [&](Key & key){
+      return strcasecmp(key.address.c_str(), entry.key.address.c_str()) == 0;
+    });
+
+    if(existing != keys.end()) *existing = entry.key;
+    else keys.push_back(entry.key);
+  }
+
+  bool keysWritten = provisioned && saveKeys(keys);
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - provisioner.getStartedAt()).count();
+
+  std::cout << formatProvisionReport(args[2], provisioner.getEntries(), seconds, keysWritten);
+
+  bool allProvisioned = std::all_of(provisioner.getEntries().begin(), provisioner.getEntries().end(), [](const ProvisionEntry & entry){
+    return entry.stage == ProvisionStage::Done;
+  });
+  return allProvisioned && keysWritten ? 0 : 1;
+}
+
+int occupancy() {
+  std::vector<OccupancyRow> rows = occupiedMinutes();
+
+  for(OccupancyRow & row : rows) {
+    std::cout << row.day << " zone " << row.zone << ": " << (uint64_t) (row.minutes + 0.5) << " min\n";
+  }
+
+  return 0;
+}
+
+//reads the table the way any other local process would
+int status() {
+  PresenceReader reader;
+  PresenceSnapshot snapshot;
+
+  if(!reader.isOpen() || !reader.read(snapshot)) {
+    std::cerr << "no presence published, is the daemon running?\n";
+    return 1;
+  }
+
+  int64_t nowMs = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+
+  //the segment outlives the daemon, so a table nobody is keeping fresh has to say so
+  bool writerGone = kill(snapshot.writerPid, 0) < 0 && errno == ESRCH;
+  bool stale = writerGone || nowMs - snapshot.updatedMs > std::chrono::duration_cast<std::chrono::milliseconds>(STATUS_STALE_AFTER).count();
+
+  std::cout << "generation " << snapshot.generation << ", updated " << (nowMs - snapshot.updatedMs) / 1000 << "s ago by pid " << snapshot.writerPid
+    << (writerGone ? " (not running)" : "") << ", lights " << (snapshot.lightsOn ? "on" : "off") << (stale ? ", STALE" : "") << '\n';
+
+  for(int i = 0; i < snapshot.zoneCount; i++) {
+    PresenceZoneState & zone = snapshot.zones[i];
+    std::cout << "zone " << zone.zone << ": " << (zone.present ? "occupied" : "empty") << " for " << (nowMs - zone.sinceMs) / 1000 << "s, "
+      << zone.present << " present\n";
+  }
+
+  for(int i = 0; i < snapshot.keyCount; i++) {
+    PresenceKeyState & key = snapshot.keys[i];
+    char id[16];
+    snprintf(id, sizeof(id), "%08x", key.keyId);
+
+    std::cout << "key " << id << " zone " << key.zone << ": " << (key.present ? "present" : "absent");
+    if(key.lastSeenMs) std::cout << ", seen " << (nowMs - key.lastSeenMs) / 1000 << "s ago at " << (int) key.rssi << "dBm";
+    std::cout << '\n';
+  }
+
+  return stale ? 2 : 0;
 }
 
 void printHelp(std::vector<std::string> args) {
   std::cout <<
     "---BLUELIGHT---\n" <<
-    "Usage: " << args[0] << " <daemon | editor>\n" << std::endl;
+    "Usage: " << args[0] << " <daemon | editor | occupancy | status | simulate [script] | provision <manifest>>\n\n";
 }
 
 int main(int argc, const char ** argv) {
@@ -351,5 +757,9 @@ int main(int argc, const char ** argv) {
   if(argc == 1) printHelp(args);
   else if(!args[1].compare("editor")) return editor();
   else if(!args[1].compare("daemon")) return daemon();
+  else if(!args[1].compare("occupancy")) return occupancy();
+  else if(!args[1].compare("status")) return status();
+  else if(!args[1].compare("simulate")) return simulate(args);
+  else if(!args[1].compare("provision")) return provision(args);
   else printHelp(args);
 }
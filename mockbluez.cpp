@@ -0,0 +1,86 @@
+#include "dbustypes.hpp"
+
+#include <iostream>
+#include <cstring>
+
+//a stand-in bluetoothd for whatever bus DBUS_SYSTEM_BUS_ADDRESS points at. it owns org.bluez,
+//lists MOCK_DEVICES bonded devices and answers every call with an empty reply, except Connect,
+//which it never answers, the way a phone that isn't around never pages back
+
+#define MOCK_DEVICES 8
+
+typedef std::variant<std::string, bool, int16_t> Property;
+typedef std::map<std::string, std::map<std::string, Property>> Interfaces;
+
+static bool operator<(const ObjectPath & a, const ObjectPath & b) {
+  return strcmp(a.path, b.path) < 0;
+}
+
+
+int main() {
+  DBusError err;
+  dbus_error_init(&err);
+
+  DBusConnection * connection = dbus_bus_get(DBUS_BUS_SYSTEM, &err);
+  if(!connection) {
+    std::cerr << "connecting to the bus: " << err.message << '\n';
+    return 1;
+  }
+
+  dbus_bus_request_name(connection, "org.bluez", DBUS_NAME_FLAG_DO_NOT_QUEUE, &err);
+  if(dbus_error_is_set(&err)) {
+    std::cerr << "claiming org.bluez: " << err.message << '\n';
+    return 1;
+  }
+
+  std::vector<std::string> paths;
+  std::vector<std::string> addresses;
+  for(int i = 0; i < MOCK_DEVICES; i++) {
+    char address[18];
+    snprintf(address, sizeof(address), "AA:BB:CC:DD:EE:%02X", i);
+    addresses.push_back(address);
+
+    std::string path = std::string("/org/bluez/hci0/dev_") + address;
+    for(char & c : path) if(c == ':') c = '_';
+    paths.push_back(path);
+  }
+
+  std::map<ObjectPath, Interfaces> objects;
+  for(int i = 0; i < MOCK_DEVICES; i++) {
+    objects[ObjectPath{paths[i].c_str()}]["org.bluez.Device1"] = {
+      {"Address", addresses[i]},
+      {"AddressType", std::string("public")},
+      {"Alias", "phone " + std::to_string(i)},
+      {"Bonded", true},
+      {"Connected", false},
+      {"RSSI", int16_t(-60 - i)},
+    };
+  }
+
+  //calls can already be queued from while the name was being claimed, so drain before blocking
+  do {
+    DBusMessage * message;
+
+    while((message = dbus_connection_pop_message(connection))) {
+      if(dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL || dbus_message_is_method_call(message, "org.bluez.Device1", "Connect")) {
+        dbus_message_unref(message);
+        continue;
+      }
+
+      DBusMessage * reply = dbus_message_new_method_return(message);
+
+      if(dbus_message_is_method_call(message, "org.freedesktop.DBus.ObjectManager", "GetManagedObjects")) {
+        appendArgs(reply, objects);
+      } else if(dbus_message_is_method_call(message, "org.freedesktop.DBus.Properties", "GetAll")) {
+        auto object = objects.find(ObjectPath{dbus_message_get_path(message)});
+        if(object != objects.end()) appendArgs(reply, object->second["org.bluez.Device1"]);
+      }
+
+      dbus_connection_send(connection, reply, nullptr);
+      dbus_message_unref(reply);
+      dbus_message_unref(message);
+    }
+  } while(dbus_connection_read_write(connection, -1));
+
+  return 0;
+}
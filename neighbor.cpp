@@ -0,0 +1,231 @@
+#include "neighbor.hpp"
+
+#include <linux/rtnetlink.h>
+#include <linux/neighbour.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include <iostream>
+#include <algorithm>
+#include <cstring>
+
+
+NeighborSource::NeighborSource(const std::vector<Key> & keys) {
+  for(int i = 0; i < keys.size(); i++) {
+    if(keys[i].wifi) watched.push_back(Watched{*keys[i].wifi, i});
+  }
+
+  sequence = 0;
+  dumping = false;
+  dumpInterrupted = false;
+  dumpRetry = false;
+  buffer.resize(NEIGHBOR_BUFFER_SIZE);
+
+  fd = socket(AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+  if(fd < 0) return;
+
+  sockaddr_nl local{};
+  local.nl_family = AF_NETLINK;
+  local.nl_groups = RTMGRP_NEIGH;
+
+  if(bind(fd, reinterpret_cast<sockaddr*>(&local), sizeof(local))) {
+    close(fd);
+    fd = -1;
+    return;
+  }
+
+  //entries that were already there before we subscribed only show up in a dump
+  requestDump();
+}
+
+NeighborSource::~NeighborSource() {
+  if(fd >= 0) close(fd);
+}
+
+bool NeighborSource::isOpen() {
+  return fd >= 0;
+}
+
+const char * NeighborSource::getName() {
+  return "neighbor";
+}
+
+float NeighborSource::getWeight() {
+  return NEIGHBOR_WEIGHT;
+}
+
+int NeighborSource::getFd() {
+  return fd;
+}
+
+
+void NeighborSource::requestDump() {
+  struct {
+    nlmsghdr header;
+    ndmsg message;
+  } request{};
+
+  request.header.nlmsg_len = sizeof(request);
+  request.header.nlmsg_type = RTM_GETNEIGH;
+  request.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+  request.header.nlmsg_seq = ++sequence;
+  request.message.ndm_family = AF_UNSPEC;
+
+  dumping = true;
+  dumpInterrupted = false;
+  dumpRetry = false;
+  dumped.clear();
+
+  sockaddr_nl kernel{};
+  kernel.nl_family = AF_NETLINK;
+
+  if(sendto(fd, &request, sizeof(request), 0, reinterpret_cast<sockaddr*>(&kernel), sizeof(kernel)) < 0) {
+    std::cerr << "requesting neighbor table: " << strerror(errno) << '\n';
+    dumping = false;
+    dumpRetry = true;
+  }
+}
+
+//swaps the dumped table in, every key whose level differs between the two is reported
+void NeighborSource::finishDump() {
+  dumping = false;
+
+  if(dumpInterrupted) {
+    requestDump();
+    return;
+  }
+
+  for(auto & table : {&entries, &dumped}) {
+    for(auto & [id, entry] : *table) {
+      if(keyLevel(entries, entry.key) != keyLevel(dumped, entry.key)) touch(entry.key);
+    }
+  }
+
+  entries.swap(dumped);
+  dumped.clear();
+}
+
+void NeighborSource::touch(int key) {
+  if(key >= 0 && std::find(touched.begin(), touched.end(), key) == touched.end()) touched.push_back(key);
+}
+
+int NeighborSource::handleNeighbor(const nlmsghdr * header, EntryTable & table) {
+  const ndmsg * neighbor = static_cast<const ndmsg*>(NLMSG_DATA(header));
+  int length = header->nlmsg_len - NLMSG_LENGTH(sizeof(ndmsg));
+  if(length < 0) return -1;
+
+  const BdAddr * address = nullptr;
+  std::string destination;
+
+  const rtattr * attribute = reinterpret_cast<const rtattr*>(reinterpret_cast<const uint8_t*>(neighbor) + NLMSG_ALIGN(sizeof(ndmsg)));
+  for(; RTA_OK(attribute, length); attribute = RTA_NEXT(attribute, length)) {
+    if(attribute->rta_type == NDA_LLADDR && RTA_PAYLOAD(attribute) == sizeof(BdAddr)) {
+      address = static_cast<const BdAddr*>(RTA_DATA(attribute));
+    } else if(attribute->rta_type == NDA_DST) {
+      destination.assign(static_cast<const char*>(RTA_DATA(attribute)), RTA_PAYLOAD(attribute));
+    }
+  }
+
+  //static entries say nothing about whether the phone is around
+  if(neighbor->ndm_state & (NUD_NOARP | NUD_PERMANENT)) return -1;
+
+  auto id = std::make_pair(neighbor->ndm_ifindex, destination);
+  auto known = table.find(id);
+
+  int key = -1;
+  if(address) {
+    for(Watched & entry : watched) {
+      if(entry.address == *address) key = entry.key;
+    }
+  }
+
+  if(key < 0) {
+    if(known == table.end()) return -1;
+
+    //gone, failed, or the address now belongs to some other machine
+    int previous = known->second.key;
+    table.erase(known);
+    return previous;
+  }
+
+  float level;
+  if(header->nlmsg_type == RTM_DELNEIGH) level = 0.0f;
+  else if(neighbor->ndm_state & NUD_REACHABLE) level = 1.0f;
+  else if(neighbor->ndm_state & (NUD_STALE | NUD_DELAY | NUD_PROBE)) level = NEIGHBOR_STALE_LEVEL;
+  else level = 0.0f;
+
+  if(level > 0) table[id] = Entry{key, level};
+  else if(known != table.end()) table.erase(known);
+
+  return key;
+}
+
+//a phone usually has a v4 and a v6 entry or more, whichever is freshest speaks for it
+float NeighborSource::keyLevel(const EntryTable & table, int key) {
+  float retval = 0.0f;
+  for(auto & [id, entry] : table) {
+    if(entry.key == key) retval = std::max(retval, entry.level);
+  }
+  return retval;
+}
+
+int NeighborSource::update(std::vector<Observation> & observations) {
+  if(fd < 0) return -1;
+
+  //the kernel's word is where a Wi-Fi sighting starts
+  uint64_t flow = traceNewFlow();
+  TraceSpan span("neighbor update", flow);
+
+  if(dumpRetry) requestDump();
+
+  while(true) {
+    ssize_t received = recv(fd, buffer.data(), buffer.size(), 0);
+
+    if(received < 0) {
+      //the kernel dropped events on us, only a fresh dump says where things stand now. one already
+      //underway keeps going under its own sequence number, asking again would orphan it, so it
+      //gets redone once it is done instead
+      if(errno == ENOBUFS) {
+        if(dumping) dumpInterrupted = true;
+        else requestDump();
+        continue;
+      }
+      break;
+    }
+
+    int length = received;
+    for(const nlmsghdr * header = reinterpret_cast<const nlmsghdr*>(buffer.data()); NLMSG_OK(header, length); header = NLMSG_NEXT(header, length)) {
+      //replies to the current dump carry its sequence number, multicast events carry 0
+      bool dumpReply = dumping && header->nlmsg_seq == sequence;
+
+      if(dumpReply && header->nlmsg_type == NLMSG_DONE) {
+        finishDump();
+        continue;
+      }
+
+      if(dumpReply && header->nlmsg_type == NLMSG_ERROR) {
+        dumping = false;
+        dumpRetry = true;
+        continue;
+      }
+
+      if(header->nlmsg_type != RTM_NEWNEIGH && header->nlmsg_type != RTM_DELNEIGH) continue;
+
+      if(dumpReply) {
+        if(header->nlmsg_flags & NLM_F_DUMP_INTR) dumpInterrupted = true;
+        handleNeighbor(header, dumped);
+        continue;
+      }
+
+      //events during a dump may be newer than what it already listed
+      if(dumping) handleNeighbor(header, dumped);
+      touch(handleNeighbor(header, entries));
+    }
+  }
+
+  for(int key : touched) observations.push_back(Observation{key, keyLevel(entries, key), 0, flow});
+  touched.clear();
+
+  return dumpRetry ? NEIGHBOR_DUMP_RETRY_MS : -1;
+}
@@ -0,0 +1,69 @@
+#pragma once
+
+#include "sources.hpp"
+
+#include <linux/netlink.h>
+
+#include <vector>
+#include <string>
+#include <map>
+
+//how much a neighbor entry that is no longer confirmed still counts for: a phone that went quiet
+//on Wi-Fi keeps a present key present, but can't bring one in on its own
+#define NEIGHBOR_STALE_LEVEL 0.5f
+#define NEIGHBOR_WEIGHT 0.9f
+#define NEIGHBOR_BUFFER_SIZE 32768
+//how soon a dump the kernel refused is asked for again
+#define NEIGHBOR_DUMP_RETRY_MS 1000
+
+//watches the kernel neighbor table for the keys' Wi-Fi addresses. subscribed to RTM_NEWNEIGH and
+//RTM_DELNEIGH, so it costs nothing until the kernel's own ARP/ND traffic changes an entry
+class NeighborSource : public PresenceSource {
+  struct Watched {
+    BdAddr address;
+    int key;
+  };
+
+  struct Entry {
+    int key;
+    float level;
+  };
+
+  std::vector<Watched> watched;
+  //by interface and destination address. entries that stop being valid, and deletions, arrive
+  //without a link layer address, so this is the only way to tell whose they were
+  typedef std::map<std::pair<int, std::string>, Entry> EntryTable;
+  EntryTable entries;
+  //a dump rebuilds the table from scratch, entries that vanished while events were lost aren't in it
+  EntryTable dumped;
+  bool dumping;
+  //the dump raced a change in the table, or was refused, and has to be asked for again
+  bool dumpInterrupted;
+  bool dumpRetry;
+  int fd;
+  uint32_t sequence;
+  std::vector<uint8_t> buffer;
+  //keys whose entries changed during the current update
+  std::vector<int> touched;
+
+  void requestDump();
+  void finishDump();
+  void touch(int key);
+  //returns the key the entry belongs to, or -1
+  int handleNeighbor(const nlmsghdr * header, EntryTable & table);
+  float keyLevel(const EntryTable & table, int key);
+
+public:
+  NeighborSource(const std::vector<Key> & keys);
+  ~NeighborSource();
+
+  NeighborSource(const NeighborSource&) = delete;
+  NeighborSource& operator=(const NeighborSource&) = delete;
+
+  bool isOpen();
+
+  const char * getName() override;
+  float getWeight() override;
+  int getFd() override;
+  int update(std::vector<Observation> & observations) override;
+};
@@ -0,0 +1,113 @@
+#include "neighbor.hpp"
+
+#include <linux/rtnetlink.h>
+#include <sys/socket.h>
+
+#include <iostream>
+#include <thread>
+#include <cstdio>
+#include <cstdlib>
+
+//drives NeighborSource against a real kernel neighbor table. meant to run as root in a network
+//namespace of its own (make neighbor does that with unshare), since it makes a veth pair and
+//fills its neighbor table with entries for made up phones
+
+#define NEIGHBOR_FLOOD 500
+constexpr auto NEIGHBOR_SETTLE = std::chrono::milliseconds(100);
+
+static int failures = 0;
+
+static void expect(bool ok, const char * what) {
+  std::cout << (ok ? "ok   " : "FAIL ") << what << '\n';
+  if(!ok) failures++;
+}
+
+//commands for ip -batch, one per line
+static bool ip(const std::string & commands) {
+  FILE * batch = popen("ip -batch -", "w");
+  if(!batch) return false;
+  fputs(commands.c_str(), batch);
+  return pclose(batch) == 0;
+}
+
+//what the source says about each key after it has caught up, -1 for keys it said nothing about
+static std::vector<float> settle(NeighborSource & source, size_t keys) {
+  std::vector<float> retval(keys, -1);
+  std::vector<Observation> observations;
+
+  //a dump on a small socket buffer takes a few reads to come through
+  for(int i = 0; i < 10; i++) {
+    std::this_thread::sleep_for(NEIGHBOR_SETTLE / 10);
+    source.update(observations);
+  }
+
+  for(Observation & observation : observations) retval[observation.key] = observation.level;
+  return retval;
+}
+
+
+int main() {
+  if(!ip("link add v0 type veth peer name v1\nlink set v0 up\nlink set v1 up\n")) {
+    std::cerr << "could not make a veth pair, run this as root in a network namespace of its own\n";
+    return 1;
+  }
+
+  std::vector<Key> keys = {
+    *parseKey("AA:BB:CC:DD:EE:01 wifi=02:00:00:00:00:01"),
+    *parseKey("AA:BB:CC:DD:EE:02 wifi=02:00:00:00:00:02"),
+  };
+
+  //already there when the source starts, only the dump it asks for on startup can report it
+  ip("neigh replace 10.9.0.1 lladdr 02:00:00:00:00:01 dev v0 nud reachable\n");
+
+  NeighborSource source(keys);
+  expect(source.isOpen(), "the source subscribes to the neighbor table");
+  if(!source.isOpen()) return 1;
+
+  std::vector<float> levels = settle(source, keys.size());
+  expect(levels[0] == 1.0f, "an entry from before startup comes in with the first dump");
+  expect(levels[1] == -1, "a key without an entry is not reported");
+
+  ip("neigh replace 10.9.0.2 lladdr 02:00:00:00:00:02 dev v0 nud stale\n");
+  levels = settle(source, keys.size());
+  expect(levels[1] == NEIGHBOR_STALE_LEVEL, "a stale entry counts for NEIGHBOR_STALE_LEVEL");
+
+  ip("neigh replace 10.9.0.2 lladdr 02:00:00:00:00:02 dev v0 nud reachable\n");
+  levels = settle(source, keys.size());
+  expect(levels[1] == 1.0f, "a reachable entry counts in full");
+
+  ip("neigh del 10.9.0.2 dev v0\n");
+  levels = settle(source, keys.size());
+  expect(levels[1] == 0.0f, "a deleted entry takes its key with it");
+
+  //shrink the socket buffer and flood it while the source isn't reading, so the kernel drops
+  //events, the deletion of the first key among them, and only a dump can tell it is gone
+  int size = 1;
+  setsockopt(source.getFd(), SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+  socklen_t length = sizeof(size);
+  getsockopt(source.getFd(), SOL_SOCKET, SO_RCVBUF, &size, &length);
+
+  std::string flood;
+  for(int i = 0; i < NEIGHBOR_FLOOD; i++) {
+    char line[96];
+    snprintf(line, sizeof(line), "neigh replace 10.9.%d.%d lladdr 02:00:00:01:%02x:%02x dev v0 nud reachable\n", 1 + i / 200, i % 200 + 1, i / 256, i % 256);
+    flood += line;
+  }
+  flood += "neigh del 10.9.0.1 dev v0\n";
+  ip(flood);
+
+  expect(size < NEIGHBOR_FLOOD * (int) NLMSG_SPACE(sizeof(ndmsg)), "the flood is bigger than the socket buffer");
+
+  levels = settle(source, keys.size());
+  expect(levels[0] == 0.0f, "after ENOBUFS the dump finds the entry whose deletion was dropped");
+
+  //and the source is back to following events
+  ip("neigh replace 10.9.0.2 lladdr 02:00:00:00:00:02 dev v0 nud reachable\n");
+  levels = settle(source, keys.size());
+  expect(levels[1] == 1.0f, "events are followed again after the dump");
+
+  ip("link del v0\n");
+
+  if(failures) std::cout << failures << " failed\n";
+  return failures ? 1 : 0;
+}
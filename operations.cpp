@@ -0,0 +1,146 @@
+#include "operations.hpp"
+
+#include <algorithm>
+
+
+OperationQueue::OperationQueue(BluetoothLink & bluetooth, size_t maxConcurrent, Clock & clock) : bluetooth(bluetooth), clock(clock) {
+  this->maxConcurrent = maxConcurrent;
+}
+
+
+Operation * OperationQueue::findActive(const std::string & path) {
+  for(Operation & operation : operations) {
+    if(operation.path != path) continue;
+    if(operation.state == OperationState::Queued || operation.state == OperationState::Running) return &operation;
+  }
+  return nullptr;
+}
+
+
+bool OperationQueue::submit(CommandType type, std::string path, std::chrono::milliseconds timeout, std::string alias) {
+  if(findActive(path)) return false;
+
+  //a new request replaces whatever result the device was still showing
+  operations.erase(std::remove_if(operations.begin(), operations.end(), [&](Operation & operation){
+    return operation.path == path;
+  }), operations.end());
+
+  operations.push_back(Operation{type, path, OperationState::Queued, 0, "", timeout, clock.now(), {}, {}, alias});
+
+  update();
+  return true;
+}
+
+void OperationQueue::cancel(const std::string & path) {
+  Operation * operation = findActive(path);
+  if(!operation) return;
+
+  if(operation->state == OperationState::Queued) {
+    operation->state = OperationState::Cancelled;
+    operation->finishedAt = clock.now();
+    return;
+  }
+
+  //the result still comes back, as a cancelled error
+  bluetooth.cancel(operation->id);
+}
+
+
+bool OperationQueue::handleResult(const CommandResultEvent & result) {
+  auto operation = std::find_if(operations.begin(), operations.end(), [&](Operation & operation){
+    return operation.state == OperationState::Running && operation.id == result.id;
+  });
+  if(operation == operations.end()) return false;
+
+  operation->finishedAt = clock.now();
+
+  if(result.ok) operation->state = OperationState::Done;
+  else if(result.error == ERROR_CANCELLED) operation->state = OperationState::Cancelled;
+  else {
+    operation->state = OperationState::Failed;
+    operation->error = result.error;
+  }
+
+  update();
+  return true;
+}
+
+
+void OperationQueue::update() {
+  auto now = clock.now();
+
+  for(Operation & operation : operations) {
+    if(operation.state != OperationState::Running) continue;
+    if(now - operation.startedAt < operation.timeout + OPERATION_RESULT_MARGIN) continue;
+
+    operation.state = OperationState::Failed;
+    operation.error = ERROR_NO_RESULT;
+    operation.finishedAt = now;
+    //in case it is somehow still going, its late result is ignored either way
+    bluetooth.cancel(operation.id);
+  }
+
+  size_t running = runningCount();
+
+  for(Operation & operation : operations) {
+    if(running >= maxConcurrent) break;
+    if(operation.state != OperationState::Queued) continue;
+
+    uint64_t id = operation.type == CommandType::Trust ?
+      bluetooth.trust(operation.path, operation.alias, operation.timeout) :
+      bluetooth.send(operation.type, operation.path, operation.timeout);
+    //the command ring is full, the next update tries again
+    if(!id) break;
+
+    operation.id = id;
+    operation.state = OperationState::Running;
+    operation.startedAt = clock.now();
+    running++;
+  }
+}
+
+void OperationQueue::expire(std::chrono::steady_clock::duration linger) {
+  auto now = clock.now();
+
+  operations.erase(std::remove_if(operations.begin(), operations.end(), [&](Operation & operation){
+    if(operation.state == OperationState::Queued || operation.state == OperationState::Running) return false;
+    return now - operation.finishedAt > linger;
+  }), operations.end());
+}
+
+
+const Operation * OperationQueue::find(const std::string & path) {
+  for(auto operation = operations.rbegin(); operation != operations.rend(); operation++) {
+    if(operation->path == path) return &*operation;
+  }
+  return nullptr;
+}
+
+const std::vector<Operation> & OperationQueue::getOperations() {
+  return operations;
+}
+
+
+size_t OperationQueue::queuedCount() {
+  return std::count_if(operations.begin(), operations.end(), [](Operation & operation){
+    return operation.state == OperationState::Queued;
+  });
+}
+
+size_t OperationQueue::runningCount() {
+  return std::count_if(operations.begin(), operations.end(), [](Operation & operation){
+    return operation.state == OperationState::Running;
+  });
+}
+
+
+const char * formatOperationState(OperationState state) {
+  switch(state) {
+    case OperationState::Queued: return "queued";
+    case OperationState::Running: return "running";
+    case OperationState::Done: return "done";
+    case OperationState::Failed: return "failed";
+    case OperationState::Cancelled: return "cancelled";
+  }
+  return "";
+}
@@ -0,0 +1,78 @@
+#pragma once
+
+#include "iothread.hpp"
+#include "clock.hpp"
+
+#include <vector>
+#include <string>
+#include <chrono>
+
+//bluez pairs several devices at once, a small cap keeps the controller from being swamped
+#define MAX_CONCURRENT_OPERATIONS 4
+
+constexpr auto PAIR_TIMEOUT = std::chrono::seconds(30);
+constexpr auto FORGET_TIMEOUT = std::chrono::seconds(5);
+//the bluetooth thread answers every command by its deadline, but its event ring drops results when
+//full, so an operation still running this long after its timeout gives up on hearing back
+constexpr auto OPERATION_RESULT_MARGIN = std::chrono::seconds(5);
+#define ERROR_NO_RESULT "no result"
+
+enum class OperationState {
+  Queued,
+  Running,
+  Done,
+  Failed,
+  Cancelled,
+};
+
+struct Operation {
+  CommandType type;
+  std::string path;
+  OperationState state;
+  //command id while running, 0 before then
+  uint64_t id;
+  std::string error;
+  //counted from when the command is sent, time spent queued doesn't eat into it
+  std::chrono::milliseconds timeout;
+  std::chrono::steady_clock::time_point queuedAt;
+  std::chrono::steady_clock::time_point startedAt;
+  std::chrono::steady_clock::time_point finishedAt;
+  //for a Trust, the alias it sets as well
+  std::string alias;
+};
+
+//pair and forget requests against the bluetooth thread, at most a few in flight and the rest
+//waiting their turn. nothing here blocks, results come back through handleResult
+class OperationQueue {
+  BluetoothLink & bluetooth;
+  Clock & clock;
+  std::vector<Operation> operations;
+  size_t maxConcurrent;
+
+  Operation * findActive(const std::string & path);
+
+public:
+  OperationQueue(BluetoothLink & bluetooth, size_t maxConcurrent = MAX_CONCURRENT_OPERATIONS, Clock & clock = steadyClock);
+
+  //false when the device already has an operation queued or running
+  bool submit(CommandType type, std::string path, std::chrono::milliseconds timeout, std::string alias = "");
+  void cancel(const std::string & path);
+
+  //false when the result belongs to a command this queue didn't send
+  bool handleResult(const CommandResultEvent & result);
+
+  //fails operations whose result never came, starts queued ones as slots free up, and retries
+  //any the command ring turned away
+  void update();
+  //drops finished operations that have been on display for longer than linger
+  void expire(std::chrono::steady_clock::duration linger);
+
+  //the latest operation for a device, nullptr when there is none
+  const Operation * find(const std::string & path);
+  const std::vector<Operation> & getOperations();
+
+  size_t queuedCount();
+  size_t runningCount();
+};
+
+const char * formatOperationState(OperationState state);
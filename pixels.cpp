@@ -0,0 +1,375 @@
+#include "pixels.hpp"
+
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(__i386__)
+#define PIXELS_X86
+#include <immintrin.h>
+#endif
+
+
+PixelArena::PixelArena(size_t capacity) {
+  this->capacity = (capacity + PIXEL_ALIGN - 1) / PIXEL_ALIGN * PIXEL_ALIGN;
+  used = 0;
+
+  memory = static_cast<uint8_t*>(std::aligned_alloc(PIXEL_ALIGN, std::max<size_t>(this->capacity, PIXEL_ALIGN)));
+  if(memory) memset(memory, 0, this->capacity);
+  else this->capacity = 0;
+}
+
+PixelArena::~PixelArena() {
+  free(memory);
+}
+
+uint8_t * PixelArena::allocate(size_t bytes) {
+  bytes = (bytes + PIXEL_ALIGN - 1) / PIXEL_ALIGN * PIXEL_ALIGN;
+  if(used + bytes > capacity) return nullptr;
+
+  uint8_t * retval = memory + used;
+  used += bytes;
+  return retval;
+}
+
+size_t PixelArena::getUsed() {
+  return used;
+}
+
+
+static size_t paddedCount(size_t count) {
+  return (count + PIXEL_BLOCK - 1) / PIXEL_BLOCK * PIXEL_BLOCK;
+}
+
+size_t planesSize(size_t count) {
+  return 3 * ((paddedCount(count) + PIXEL_ALIGN - 1) / PIXEL_ALIGN * PIXEL_ALIGN);
+}
+
+PixelPlanes allocatePlanes(PixelArena & arena, size_t count) {
+  PixelPlanes retval{{nullptr, nullptr, nullptr}, count, paddedCount(count)};
+  for(auto & channel : retval.channels) channel = arena.allocate(retval.padded);
+  return retval;
+}
+
+
+static void lerpScalar(uint8_t * out, const uint8_t * from, const uint8_t * to, uint16_t t, size_t count) {
+  for(size_t i = 0; i < count; i++) out[i] = (from[i] * (256 - t) + to[i] * t) >> 8;
+}
+
+static void lookupScalar(uint8_t * data, const uint8_t * table, size_t count) {
+  for(size_t i = 0; i < count; i++) data[i] = table[data[i]];
+}
+
+static uint64_t sumScalar(const uint8_t * data, size_t count) {
+  uint64_t retval = 0;
+  for(size_t i = 0; i < count; i++) retval += data[i];
+  return retval;
+}
+
+static void scaleScalar(uint8_t * data, uint16_t factor, size_t count) {
+  for(size_t i = 0; i < count; i++) data[i] = (data[i] * factor) >> 8;
+}
+
+static void interleaveScalar(uint8_t * out, const uint8_t * first, const uint8_t * second, const uint8_t * third, size_t count) {
+  for(size_t i = 0; i < count; i++) {
+    out[i * 3] = first[i];
+    out[i * 3 + 1] = second[i];
+    out[i * 3 + 2] = third[i];
+  }
+}
+
+
+#ifdef PIXELS_X86
+
+//8.8 weights keep every product within 16 bits, so both weighted terms are summed before the shift
+static void lerpSse2(uint8_t * out, const uint8_t * from, const uint8_t * to, uint16_t t, size_t count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i weightFrom = _mm_set1_epi16(256 - t);
+  const __m128i weightTo = _mm_set1_epi16(t);
+
+  size_t i = 0;
+  for(; i + 16 <= count; i += 16) {
+    __m128i a = _mm_loadu_si128((const __m128i*) (from + i));
+    __m128i b = _mm_loadu_si128((const __m128i*) (to + i));
+
+    __m128i low = _mm_add_epi16(
+      _mm_mullo_epi16(_mm_unpacklo_epi8(a, zero), weightFrom),
+      _mm_mullo_epi16(_mm_unpacklo_epi8(b, zero), weightTo));
+    __m128i high = _mm_add_epi16(
+      _mm_mullo_epi16(_mm_unpackhi_epi8(a, zero), weightFrom),
+      _mm_mullo_epi16(_mm_unpackhi_epi8(b, zero), weightTo));
+
+    _mm_storeu_si128((__m128i*) (out + i), _mm_packus_epi16(_mm_srli_epi16(low, 8), _mm_srli_epi16(high, 8)));
+  }
+
+  lerpScalar(out + i, from + i, to + i, t, count - i);
+}
+
+static uint64_t sumSse2(const uint8_t * data, size_t count) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i total = zero;
+
+  size_t i = 0;
+  for(; i + 16 <= count; i += 16) {
+    total = _mm_add_epi64(total, _mm_sad_epu8(_mm_loadu_si128((const __m128i*) (data + i)), zero));
+  }
+
+  uint64_t lanes[2];
+  _mm_storeu_si128((__m128i*) lanes, total);
+  return lanes[0] + lanes[1] + sumScalar(data + i, count - i);
+}
+
+static void scaleSse2(uint8_t * data, uint16_t factor, size_t count) {
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i weight = _mm_set1_epi16(factor);
+
+  size_t i = 0;
+  for(; i + 16 <= count; i += 16) {
+    __m128i v = _mm_loadu_si128((const __m128i*) (data + i));
+    __m128i low = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(v, zero), weight), 8);
+    __m128i high = _mm_srli_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(v, zero), weight), 8);
+    _mm_storeu_si128((__m128i*) (data + i), _mm_packus_epi16(low, high));
+  }
+
+  scaleScalar(data + i, factor, count - i);
+}
+
+
+//unpack and pack both work within 128 bit lanes, so the lane split cancels out
+__attribute__((target("avx2")))
+static void lerpAvx2(uint8_t * out, const uint8_t * from, const uint8_t * to, uint16_t t, size_t count) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i weightFrom = _mm256_set1_epi16(256 - t);
+  const __m256i weightTo = _mm256_set1_epi16(t);
+
+  size_t i = 0;
+  for(; i + 32 <= count; i += 32) {
+    __m256i a = _mm256_loadu_si256((const __m256i*) (from + i));
+    __m256i b = _mm256_loadu_si256((const __m256i*) (to + i));
+
+    __m256i low = _mm256_add_epi16(
+      _mm256_mullo_epi16(_mm256_unpacklo_epi8(a, zero), weightFrom),
+      _mm256_mullo_epi16(_mm256_unpacklo_epi8(b, zero), weightTo));
+    __m256i high = _mm256_add_epi16(
+      _mm256_mullo_epi16(_mm256_unpackhi_epi8(a, zero), weightFrom),
+      _mm256_mullo_epi16(_mm256_unpackhi_epi8(b, zero), weightTo));
+
+    _mm256_storeu_si256((__m256i*) (out + i), _mm256_packus_epi16(_mm256_srli_epi16(low, 8), _mm256_srli_epi16(high, 8)));
+  }
+
+  lerpScalar(out + i, from + i, to + i, t, count - i);
+}
+
+__attribute__((target("avx2")))
+static uint64_t sumAvx2(const uint8_t * data, size_t count) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i total = zero;
+
+  size_t i = 0;
+  for(; i + 32 <= count; i += 32) {
+    total = _mm256_add_epi64(total, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*) (data + i)), zero));
+  }
+
+  uint64_t lanes[4];
+  _mm256_storeu_si256((__m256i*) lanes, total);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + sumScalar(data + i, count - i);
+}
+
+__attribute__((target("avx2")))
+static void scaleAvx2(uint8_t * data, uint16_t factor, size_t count) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256i weight = _mm256_set1_epi16(factor);
+
+  size_t i = 0;
+  for(; i + 32 <= count; i += 32) {
+    __m256i v = _mm256_loadu_si256((const __m256i*) (data + i));
+    __m256i low = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpacklo_epi8(v, zero), weight), 8);
+    __m256i high = _mm256_srli_epi16(_mm256_mullo_epi16(_mm256_unpackhi_epi8(v, zero), weight), 8);
+    _mm256_storeu_si256((__m256i*) (data + i), _mm256_packus_epi16(low, high));
+  }
+
+  scaleScalar(data + i, factor, count - i);
+}
+
+//shuffle masks that spread 16 bytes of one plane across the 48 output bytes of 16 pixels
+static std::array<std::array<std::array<uint8_t, 16>, 3>, 3> interleaveMasks() {
+  std::array<std::array<std::array<uint8_t, 16>, 3>, 3> retval;
+
+  for(int block = 0; block < 3; block++) {
+    for(int channel = 0; channel < 3; channel++) {
+      for(int j = 0; j < 16; j++) {
+        int byte = block * 16 + j;
+        retval[block][channel][j] = byte % 3 == channel ? byte / 3 : 0x80;
+      }
+    }
+  }
+
+  return retval;
+}
+
+__attribute__((target("avx2")))
+static void interleaveAvx2(uint8_t * out, const uint8_t * first, const uint8_t * second, const uint8_t * third, size_t count) {
+  static const auto masks = interleaveMasks();
+
+  __m128i shuffles[3][3];
+  for(int block = 0; block < 3; block++) {
+    for(int channel = 0; channel < 3; channel++) {
+      shuffles[block][channel] = _mm_loadu_si128((const __m128i*) masks[block][channel].data());
+    }
+  }
+
+  size_t i = 0;
+  for(; i + 16 <= count; i += 16) {
+    __m128i planes[3] = {
+      _mm_loadu_si128((const __m128i*) (first + i)),
+      _mm_loadu_si128((const __m128i*) (second + i)),
+      _mm_loadu_si128((const __m128i*) (third + i)),
+    };
+
+    for(int block = 0; block < 3; block++) {
+      __m128i bytes = _mm_or_si128(
+        _mm_or_si128(_mm_shuffle_epi8(planes[0], shuffles[block][0]), _mm_shuffle_epi8(planes[1], shuffles[block][1])),
+        _mm_shuffle_epi8(planes[2], shuffles[block][2]));
+      _mm_storeu_si128((__m128i*) (out + i * 3 + block * 16), bytes);
+    }
+  }
+
+  interleaveScalar(out + i * 3, first + i, second + i, third + i, count - i);
+}
+
+#endif
+
+
+const char * formatPixelIsa(PixelIsa isa) {
+  switch(isa) {
+    case PixelIsa::Avx2: return "avx2";
+    case PixelIsa::Sse2: return "sse2";
+    default: return "scalar";
+  }
+}
+
+PixelIsa detectPixelIsa() {
+#ifdef PIXELS_X86
+  if(__builtin_cpu_supports("avx2")) return PixelIsa::Avx2;
+  if(__builtin_cpu_supports("sse2")) return PixelIsa::Sse2;
+#endif
+  return PixelIsa::Scalar;
+}
+
+const PixelKernels & pixelKernels(PixelIsa isa) {
+  static const PixelKernels scalar{PixelIsa::Scalar, lerpScalar, lookupScalar, sumScalar, scaleScalar, interleaveScalar};
+
+#ifdef PIXELS_X86
+  //there's no byte gather, and a 16 row vpshufb table measured slower than scalar loads, so the
+  //gamma lookup stays scalar everywhere. sse2 lacks a byte shuffle, so it interleaves in scalar too
+  static const PixelKernels sse2{PixelIsa::Sse2, lerpSse2, lookupScalar, sumSse2, scaleSse2, interleaveScalar};
+  static const PixelKernels avx2{PixelIsa::Avx2, lerpAvx2, lookupScalar, sumAvx2, scaleAvx2, interleaveAvx2};
+
+  if(isa == PixelIsa::Avx2) return avx2;
+  if(isa == PixelIsa::Sse2) return sse2;
+#endif
+
+  return scalar;
+}
+
+const PixelKernels & pixelKernels() {
+  static const PixelKernels & best = pixelKernels(detectPixelIsa());
+  return best;
+}
+
+
+std::optional<ColorOrder> parseColorOrder(const std::string & order) {
+  std::string name = order;
+  std::transform(name.begin(), name.end(), name.begin(), ::toupper);
+
+  if(name == "RGB") return ColorOrder::RGB;
+  if(name == "RBG") return ColorOrder::RBG;
+  if(name == "GRB") return ColorOrder::GRB;
+  if(name == "GBR") return ColorOrder::GBR;
+  if(name == "BRG") return ColorOrder::BRG;
+  if(name == "BGR") return ColorOrder::BGR;
+  return std::nullopt;
+}
+
+//which plane lands in each wire position
+static std::array<int, 3> planeOrder(ColorOrder order) {
+  switch(order) {
+    case ColorOrder::RBG: return {0, 2, 1};
+    case ColorOrder::GRB: return {1, 0, 2};
+    case ColorOrder::GBR: return {1, 2, 0};
+    case ColorOrder::BRG: return {2, 0, 1};
+    case ColorOrder::BGR: return {2, 1, 0};
+    default: return {0, 1, 2};
+  }
+}
+
+
+//zones are clipped to the strip so rendering never writes past the frame
+static std::vector<PixelZone> clipZones(size_t pixels, std::vector<PixelZone> zones) {
+  std::vector<PixelZone> retval;
+
+  for(PixelZone zone : zones) {
+    if(zone.start >= pixels || zone.count == 0) continue;
+    zone.count = std::min(zone.count, pixels - zone.start);
+    retval.push_back(zone);
+  }
+
+  return retval;
+}
+
+static size_t arenaSize(const std::vector<PixelZone> & zones) {
+  size_t retval = 0;
+  for(const PixelZone & zone : zones) retval += 3 * planesSize(zone.count);
+  return retval;
+}
+
+FrameRenderer::FrameRenderer(size_t pixels, std::vector<PixelZone> zones, float gamma, float maxBrightness, ColorOrder order) :
+  arena(arenaSize(clipZones(pixels, zones))), kernels(pixelKernels()) {
+
+  for(const PixelZone & zone : clipZones(pixels, zones)) {
+    ZoneBuffers buffers{zone.start, allocatePlanes(arena, zone.count), allocatePlanes(arena, zone.count), allocatePlanes(arena, zone.count)};
+    if(!buffers.out.channels[2]) break;
+
+    //the off scene stays black as allocated
+    for(int c = 0; c < 3; c++) memset(buffers.on.channels[c], zone.color[c], zone.count);
+
+    this->zones.push_back(buffers);
+  }
+
+  for(int i = 0; i < 256; i++) this->gamma[i] = std::lround(std::pow(i / 255.0f, gamma) * 255);
+
+  brightnessLimit = std::clamp(maxBrightness, 0.0f, 1.0f) * pixels * 3 * 255;
+  this->order = planeOrder(order);
+}
+
+void FrameRenderer::render(float level, uint8_t * frame) {
+  uint16_t t = std::lround(std::clamp(level, 0.0f, 1.0f) * 256);
+  uint64_t total = 0;
+
+  //padding is zero in every scene and the gamma curve keeps it there, so whole blocks are safe
+  for(ZoneBuffers & zone : zones) {
+    for(int c = 0; c < 3; c++) {
+      kernels.lerp(zone.out.channels[c], zone.off.channels[c], zone.on.channels[c], t, zone.out.padded);
+      kernels.lookup(zone.out.channels[c], gamma.data(), zone.out.padded);
+      total += kernels.sum(zone.out.channels[c], zone.out.padded);
+    }
+  }
+
+  //the limit is for the supply feeding the whole strip, so every zone dims by the same factor
+  if(total > brightnessLimit) {
+    uint16_t factor = (brightnessLimit << 8) / total;
+    for(ZoneBuffers & zone : zones) {
+      for(int c = 0; c < 3; c++) kernels.scale(zone.out.channels[c], factor, zone.out.padded);
+    }
+  }
+
+  for(ZoneBuffers & zone : zones) {
+    kernels.interleave(frame + zone.start * 3,
+      zone.out.channels[order[0]], zone.out.channels[order[1]], zone.out.channels[order[2]], zone.out.count);
+  }
+}
+
+PixelIsa FrameRenderer::getIsa() {
+  return kernels.isa;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <array>
+#include <optional>
+#include <cstdint>
+#include <cstddef>
+
+#define PIXEL_ALIGN 64
+//planes are padded to whole blocks so the vector loops rarely fall through to their scalar tails
+#define PIXEL_BLOCK 32
+
+//one allocation up front for every plane a renderer needs, nothing is freed until the arena goes
+class PixelArena {
+  uint8_t * memory;
+  size_t capacity;
+  size_t used;
+
+public:
+  PixelArena(size_t capacity);
+  ~PixelArena();
+
+  PixelArena(const PixelArena&) = delete;
+  PixelArena& operator=(const PixelArena&) = delete;
+
+  //zeroed and PIXEL_ALIGN aligned, nullptr once the arena is exhausted
+  uint8_t * allocate(size_t bytes);
+
+  size_t getUsed();
+};
+
+//structure of arrays, one byte plane per channel
+struct PixelPlanes {
+  std::array<uint8_t*, 3> channels;
+  size_t count;
+  size_t padded;
+};
+
+PixelPlanes allocatePlanes(PixelArena & arena, size_t count);
+size_t planesSize(size_t count);
+
+
+enum class PixelIsa {
+  Scalar,
+  Sse2,
+  Avx2,
+};
+
+const char * formatPixelIsa(PixelIsa isa);
+
+//any length and alignment is accepted, t and factor are 8.8 fixed point weights from 0 to 256
+struct PixelKernels {
+  PixelIsa isa;
+  void (*lerp)(uint8_t * out, const uint8_t * from, const uint8_t * to, uint16_t t, size_t count);
+  void (*lookup)(uint8_t * data, const uint8_t * table, size_t count);
+  uint64_t (*sum)(const uint8_t * data, size_t count);
+  void (*scale)(uint8_t * data, uint16_t factor, size_t count);
+  void (*interleave)(uint8_t * out, const uint8_t * first, const uint8_t * second, const uint8_t * third, size_t count);
+};
+
+PixelIsa detectPixelIsa();
+const PixelKernels & pixelKernels(PixelIsa isa);
+//the best set this CPU supports, picked once
+const PixelKernels & pixelKernels();
+
+
+//channel order on the wire, named the way strip datasheets name it
+enum class ColorOrder {
+  RGB,
+  RBG,
+  GRB,
+  GBR,
+  BRG,
+  BGR,
+};
+
+std::optional<ColorOrder> parseColorOrder(const std::string & order);
+
+struct PixelZone {
+  size_t start;
+  size_t count;
+  std::array<uint8_t, 3> color;
+};
+
+//renders every zone as a fade between its off and on scene: interpolation, gamma, a strip wide
+//brightness limit and finally interleaving into wire order
+class FrameRenderer {
+  struct ZoneBuffers {
+    size_t start;
+    PixelPlanes off;
+    PixelPlanes on;
+    PixelPlanes out;
+  };
+
+  PixelArena arena;
+  std::vector<ZoneBuffers> zones;
+  std::array<uint8_t, 256> gamma;
+  uint64_t brightnessLimit;
+  std::array<int, 3> order;
+  const PixelKernels & kernels;
+
+public:
+  FrameRenderer(size_t pixels, std::vector<PixelZone> zones, float gamma, float maxBrightness, ColorOrder order);
+
+  FrameRenderer(const FrameRenderer&) = delete;
+  FrameRenderer& operator=(const FrameRenderer&) = delete;
+
+  //frame holds three bytes for every pixel of the strip, pixels outside any zone are left alone
+  void render(float level, uint8_t * frame);
+
+  PixelIsa getIsa();
+};
@@ -0,0 +1,141 @@
+#pragma once
+
+//the daemon's presence table as it appears in shared memory, plus a reader for other processes.
+//header only and free of the rest of bluelight, so a status bar or a thermostat script can copy
+//this one file and link nothing
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+
+#define PRESENCE_SHM_NAME "/bluelight-presence"
+#define PRESENCE_MAGIC "BLPRES01"
+#define PRESENCE_VERSION 1
+#define PRESENCE_MAX_KEYS 64
+#define PRESENCE_MAX_ZONES 16
+//a writer that died halfway through a publish leaves the sequence odd forever, this gives up after a few tens of ms
+#define PRESENCE_READ_ATTEMPTS 100000
+//past this many tries a reader yields instead of spinning, a writer preempted midway can't finish on a core it is spun on
+#define PRESENCE_READ_SPINS 1000
+
+struct PresenceKeyState {
+  //wall clock milliseconds of the last advertisement or probe answer, 0 if never seen
+  int64_t lastSeenMs;
+  //same id the event log uses
+  uint32_t keyId;
+  //exponentially smoothed over Bluetooth sightings, 0 until there has been one
+  float rssi;
+  uint16_t zone;
+  uint8_t present;
+  uint8_t reserved[5];
+};
+
+static_assert(sizeof(PresenceKeyState) == 24);
+
+struct PresenceZoneState {
+  //wall clock milliseconds since the zone was last entered or left
+  int64_t sinceMs;
+  uint16_t zone;
+  //keys currently present in the zone
+  uint16_t present;
+  uint8_t reserved[4];
+};
+
+static_assert(sizeof(PresenceZoneState) == 16);
+
+struct PresenceSnapshot {
+  //bumped whenever a key or zone comes or goes, not on plain last seen updates
+  uint64_t generation;
+  int64_t updatedMs;
+  uint32_t writerPid;
+  uint16_t keyCount;
+  uint16_t zoneCount;
+  uint8_t lightsOn;
+  uint8_t reserved[7];
+  PresenceZoneState zones[PRESENCE_MAX_ZONES];
+  PresenceKeyState keys[PRESENCE_MAX_KEYS];
+};
+
+//one writer, any number of readers. the writer makes the sequence odd, copies in the new
+//snapshot and makes it even again. readers retry if it was odd or moved while they copied.
+//readers map the segment read only, so nothing they do can make the writer wait
+struct PresenceShared {
+  char magic[8];
+  uint32_t version;
+  uint32_t size;
+  alignas(64) std::atomic<uint64_t> sequence;
+  alignas(64) PresenceSnapshot snapshot;
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "the sequence is shared between processes");
+
+
+class PresenceReader {
+  const PresenceShared * shared = nullptr;
+
+public:
+  PresenceReader(const char * name = PRESENCE_SHM_NAME) {
+    int fd = shm_open(name, O_RDONLY | O_CLOEXEC, 0);
+    if(fd < 0) return;
+
+    struct stat info;
+    if(fstat(fd, &info) || info.st_size < (off_t) sizeof(PresenceShared)) {
+      close(fd);
+      return;
+    }
+
+    void * memory = mmap(nullptr, sizeof(PresenceShared), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if(memory == MAP_FAILED) return;
+
+    shared = static_cast<const PresenceShared*>(memory);
+
+    //a daemon still setting the segment up, or one built against another layout
+    if(memcmp(shared->magic, PRESENCE_MAGIC, 8) || shared->version != PRESENCE_VERSION || shared->size != sizeof(PresenceShared)) {
+      munmap(memory, sizeof(PresenceShared));
+      shared = nullptr;
+    }
+  }
+
+  ~PresenceReader() {
+    if(shared) munmap(const_cast<PresenceShared*>(shared), sizeof(PresenceShared));
+  }
+
+  PresenceReader(const PresenceReader&) = delete;
+  PresenceReader& operator=(const PresenceReader&) = delete;
+
+  bool isOpen() const {
+    return shared != nullptr;
+  }
+
+  //a consistent copy of the table, no syscalls unless a writer is stuck midway. false if not open or the writer never
+  //finishes a publish
+  bool read(PresenceSnapshot & snapshot) const {
+    if(!shared) return false;
+
+    for(int attempt = 0; attempt < PRESENCE_READ_ATTEMPTS; attempt++) {
+      uint64_t before = shared->sequence.load(std::memory_order_acquire);
+      if(before & 1) {
+        if(attempt >= PRESENCE_READ_SPINS) sched_yield();
+#if defined(__x86_64__) || defined(__i386__)
+        else __builtin_ia32_pause();
+#endif
+        continue;
+      }
+
+      memcpy(&snapshot, &shared->snapshot, sizeof(PresenceSnapshot));
+
+      //keeps the copy from being reordered past the second look at the sequence
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if(shared->sequence.load(std::memory_order_relaxed) == before) return true;
+    }
+
+    return false;
+  }
+};
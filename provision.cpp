@@ -0,0 +1,205 @@
+#include "provision.hpp"
+#include "sources.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+
+
+std::optional<std::vector<ProvisionEntry>> loadManifest(const std::string & path) {
+  std::fstream file(path, std::ios_base::in);
+  if(!file.is_open()) return std::nullopt;
+
+  std::vector<ProvisionEntry> retval;
+  std::string line;
+
+  while(std::getline(file, line)) {
+    if(line.empty() || line[0] == '#') continue;
+
+    auto key = parseKey(line);
+    if(!key) continue;
+
+    //BlueZ spells addresses in upper case, and matching is by string
+    std::transform(key->address.begin(), key->address.end(), key->address.begin(), ::toupper);
+
+    ProvisionEntry entry{*key, "", ProvisionStage::Discovery, "", false, false, ""};
+
+    std::istringstream stream(line);
+    std::string token;
+    while(stream >> token) {
+      if(!token.compare(0, 6, "alias=")) entry.alias = token.substr(6);
+    }
+
+    retval.push_back(entry);
+  }
+
+  return retval;
+}
+
+
+Provisioner::Provisioner(BluetoothThread & bluetooth, std::vector<ProvisionEntry> entries) : operations(bluetooth) {
+  this->entries = entries;
+  startedAt = std::chrono::steady_clock::now();
+
+  std::vector<Irk> irks;
+  for(ProvisionEntry & entry : this->entries) {
+    keys.push_back(entry.key);
+    if(entry.key.irk) irks.push_back(*entry.key.irk);
+  }
+  resolver.setIrks(irks);
+}
+
+void Provisioner::fail(ProvisionEntry & entry, std::string error) {
+  entry.failed = true;
+  entry.error = error;
+  entry.finishedAt = std::chrono::steady_clock::now();
+}
+
+
+void Provisioner::setDevices(std::vector<Device> & devices) {
+  for(KeyMatch & match : matchKeys(devices, keys, resolver)) {
+    ProvisionEntry & entry = entries[match.key];
+    //a second device for the same key is most likely the same phone behind a new private address
+    if(entry.stage != ProvisionStage::Discovery || entry.failed) continue;
+
+    CommandType type = match.device.isBonded() ? CommandType::Trust : CommandType::Pair;
+    auto timeout = type == CommandType::Pair ? std::chrono::milliseconds(PAIR_TIMEOUT) : std::chrono::milliseconds(TRUST_TIMEOUT);
+    if(!operations.submit(type, match.device.getPath(), timeout, entry.alias)) continue;
+
+    entry.path = match.device.getPath();
+    entry.alreadyPaired = match.device.isBonded();
+    entry.stage = type == CommandType::Pair ? ProvisionStage::Pairing : ProvisionStage::Trusting;
+    entry.foundAt = std::chrono::steady_clock::now();
+  }
+}
+
+void Provisioner::handleResult(const CommandResultEvent & result) {
+  if(!operations.handleResult(result)) return;
+
+  auto entry = std::find_if(entries.begin(), entries.end(), [&](ProvisionEntry & entry){
+    return !entry.failed && entry.path == result.path;
+  });
+  if(entry == entries.end()) return;
+
+  advance(*entry, *operations.find(result.path));
+}
+
+void Provisioner::advance(ProvisionEntry & entry, const Operation & operation) {
+  bool ok = operation.state == OperationState::Done;
+
+  //a bond made since the table was fetched is as good as one made here
+  if(entry.stage == ProvisionStage::Pairing && (ok || operation.error == "org.bluez.Error.AlreadyExists")) {
+    entry.stage = ProvisionStage::Trusting;
+    operations.submit(CommandType::Trust, entry.path, TRUST_TIMEOUT, entry.alias);
+  } else if(entry.stage == ProvisionStage::Trusting && ok) {
+    entry.stage = ProvisionStage::Done;
+    entry.finishedAt = std::chrono::steady_clock::now();
+  } else {
+    fail(entry, operation.state == OperationState::Cancelled ? "cancelled" : operation.error);
+  }
+}
+
+bool Provisioner::update() {
+  operations.update();
+
+  bool finished = true;
+  auto now = std::chrono::steady_clock::now();
+
+  for(ProvisionEntry & entry : entries) {
+    if(entry.failed || entry.stage == ProvisionStage::Done) continue;
+
+    if(entry.stage == ProvisionStage::Discovery && now - startedAt >= PROVISION_APPEAR_TIMEOUT) {
+      fail(entry, "not found");
+      continue;
+    }
+
+    //the queue gives up on a result OPERATION_RESULT_MARGIN past the stage's timeout, the failure
+    //then lands on whichever stage was waiting
+    if(entry.stage == ProvisionStage::Pairing || entry.stage == ProvisionStage::Trusting) {
+      CommandType type = entry.stage == ProvisionStage::Pairing ? CommandType::Pair : CommandType::Trust;
+      const Operation * operation = operations.find(entry.path);
+      if(operation && operation->type == type && operation->state != OperationState::Queued && operation->state != OperationState::Running) {
+        advance(entry, *operation);
+        if(entry.failed || entry.stage == ProvisionStage::Done) continue;
+      }
+    }
+
+    finished = false;
+  }
+
+  return finished;
+}
+
+const std::vector<ProvisionEntry> & Provisioner::getEntries() {
+  return entries;
+}
+
+std::chrono::steady_clock::time_point Provisioner::getStartedAt() {
+  return startedAt;
+}
+
+
+const char * formatProvisionStage(ProvisionStage stage) {
+  switch(stage) {
+    case ProvisionStage::Discovery: return "discovery";
+    case ProvisionStage::Pairing: return "pair";
+    case ProvisionStage::Trusting: return "trust";
+    case ProvisionStage::Done: return "done";
+  }
+  return "";
+}
+
+static std::string quote(const std::string & text) {
+  std::string retval = "\"";
+
+  for(char c : text) {
+    if(c == '"' || c == '\\') {
+      retval += '\\';
+      retval += c;
+    } else if((unsigned char) c < 0x20) {
+      char escaped[8];
+      snprintf(escaped, sizeof(escaped), "\\u%04x", c);
+      retval += escaped;
+    } else {
+      retval += c;
+    }
+  }
+
+  return retval + "\"";
+}
+
+std::string formatProvisionReport(const std::string & manifest, const std::vector<ProvisionEntry> & entries, double seconds, bool keysWritten) {
+  size_t provisioned = std::count_if(entries.begin(), entries.end(), [](const ProvisionEntry & entry){
+    return entry.stage == ProvisionStage::Done;
+  });
+
+  char numbers[160];
+  snprintf(numbers, sizeof(numbers), "\"seconds\": %.3f, \"provisioned\": %zu, \"failed\": %zu, \"devicesPerMinute\": %.2f",
+    seconds, provisioned, entries.size() - provisioned, seconds > 0 ? provisioned * 60 / seconds : 0.0);
+
+  std::string retval = "{\"manifest\": " + quote(manifest) + ", " + numbers + ", \"keysWritten\": " + (keysWritten ? "true" : "false") + ", \"devices\": [";
+
+  for(size_t i = 0; i < entries.size(); i++) {
+    const ProvisionEntry & entry = entries[i];
+    bool done = entry.stage == ProvisionStage::Done;
+
+    retval += i ? ",\n  " : "\n  ";
+    retval += "{\"address\": " + quote(entry.key.address) + ", \"alias\": " + quote(entry.alias) + ", \"zone\": " + std::to_string(entry.key.zone);
+    retval += std::string(", \"status\": ") + (done ? "\"provisioned\"" : "\"failed\"");
+
+    if(!entry.path.empty()) {
+      double took = std::chrono::duration<double>(entry.finishedAt - entry.foundAt).count();
+      retval += ", \"path\": " + quote(entry.path) + ", \"alreadyPaired\": " + (entry.alreadyPaired ? "true" : "false");
+
+      snprintf(numbers, sizeof(numbers), ", \"seconds\": %.3f", took);
+      retval += numbers;
+    }
+
+    if(!done) retval += ", \"stage\": " + quote(formatProvisionStage(entry.stage)) + ", \"error\": " + quote(entry.error);
+    retval += "}";
+  }
+
+  return retval + "\n]}\n";
+}
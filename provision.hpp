@@ -0,0 +1,71 @@
+#pragma once
+
+#include "operations.hpp"
+#include "keys.hpp"
+#include "rpa.hpp"
+
+#include <vector>
+#include <string>
+#include <optional>
+#include <chrono>
+
+//tables refresh faster than the daemon's, devices in the manifest should be picked up quickly
+constexpr auto PROVISION_REFRESH_INTERVAL = std::chrono::seconds(2);
+//how long a manifest device gets to turn up before it is reported missing
+constexpr auto PROVISION_APPEAR_TIMEOUT = std::chrono::seconds(60);
+constexpr auto TRUST_TIMEOUT = std::chrono::seconds(5);
+
+enum class ProvisionStage {
+  Discovery,
+  Pairing,
+  Trusting,
+  Done,
+};
+
+struct ProvisionEntry {
+  Key key;
+  std::string alias;
+  //the stage it is in, or the one it failed in when error is set
+  ProvisionStage stage;
+  std::string error;
+  bool failed;
+  //the device already had a bond, so pairing was skipped
+  bool alreadyPaired;
+  std::string path;
+  std::chrono::steady_clock::time_point foundAt;
+  std::chrono::steady_clock::time_point finishedAt;
+};
+
+//the keys file format with an alias on top: "<address> [alias=<name>] [irk=<32 hex digits>] [zone=<n>] [wifi=<mac>]".
+//empty when the file can't be read
+std::optional<std::vector<ProvisionEntry>> loadManifest(const std::string & path);
+
+//pairs and then trusts every manifest device as it turns up, a few at a time through an
+//OperationQueue. devices with an IRK are also found behind their private addresses
+class Provisioner {
+  OperationQueue operations;
+  std::vector<ProvisionEntry> entries;
+  std::vector<Key> keys;
+  RpaResolver resolver;
+  std::chrono::steady_clock::time_point startedAt;
+
+  void fail(ProvisionEntry & entry, std::string error);
+  //moves an entry on once its pair or trust operation has finished
+  void advance(ProvisionEntry & entry, const Operation & operation);
+
+public:
+  Provisioner(BluetoothThread & bluetooth, std::vector<ProvisionEntry> entries);
+
+  void setDevices(std::vector<Device> & devices);
+  void handleResult(const CommandResultEvent & result);
+  //gives up on devices that never showed and on operations whose result never came, true once
+  //every entry is done or failed
+  bool update();
+
+  const std::vector<ProvisionEntry> & getEntries();
+  std::chrono::steady_clock::time_point getStartedAt();
+};
+
+const char * formatProvisionStage(ProvisionStage stage);
+//the whole run as one JSON object, with throughput and each device's result
+std::string formatProvisionReport(const std::string & manifest, const std::vector<ProvisionEntry> & entries, double seconds, bool keysWritten);
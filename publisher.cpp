@@ -0,0 +1,139 @@
+#include "publisher.hpp"
+#include "eventlog.hpp"
+
+#include <chrono>
+#include <algorithm>
+#include <new>
+
+
+static int64_t wallClockMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+PresencePublisher::PresencePublisher(const std::vector<Key> & keys, std::string name) {
+  this->name = name;
+  shared = nullptr;
+
+  memset(&state, 0, sizeof(state));
+  state.writerPid = getpid();
+  state.updatedMs = wallClockMs();
+
+  state.keyCount = std::min<size_t>(keys.size(), PRESENCE_MAX_KEYS);
+  for(int i = 0; i < state.keyCount; i++) {
+    state.keys[i].keyId = logKeyId(keys[i].address);
+    state.keys[i].zone = keys[i].zone;
+  }
+
+  for(int i = 0; i < state.keyCount; i++) {
+    uint16_t zone = state.keys[i].zone;
+
+    bool known = false;
+    for(int j = 0; j < state.zoneCount; j++) known = known || state.zones[j].zone == zone;
+    if(known || state.zoneCount == PRESENCE_MAX_ZONES) continue;
+
+    state.zones[state.zoneCount].zone = zone;
+    state.zones[state.zoneCount].sinceMs = state.updatedMs;
+    state.zoneCount++;
+  }
+
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+  if(fd < 0) return;
+
+  if(ftruncate(fd, sizeof(PresenceShared))) {
+    close(fd);
+    return;
+  }
+
+  void * memory = mmap(nullptr, sizeof(PresenceShared), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if(memory == MAP_FAILED) return;
+
+  //a segment left by an earlier run keeps its sequence, readers still mapping it stay consistent
+  shared = static_cast<PresenceShared*>(memory);
+  if(memcmp(shared->magic, PRESENCE_MAGIC, 8) || shared->version != PRESENCE_VERSION || shared->size != sizeof(PresenceShared)) {
+    shared = new (memory) PresenceShared();
+    shared->version = PRESENCE_VERSION;
+    shared->size = sizeof(PresenceShared);
+    publish();
+    //readers check the magic before anything else, so it goes in last
+    memcpy(shared->magic, PRESENCE_MAGIC, 8);
+  } else {
+    publish();
+  }
+}
+
+PresencePublisher::~PresencePublisher() {
+  if(!shared) return;
+
+  //the segment stays behind with a pid that no longer runs, readers can tell it is stale
+  munmap(shared, sizeof(PresenceShared));
+}
+
+bool PresencePublisher::isOpen() {
+  return shared != nullptr;
+}
+
+
+void PresencePublisher::seen(int key, int16_t rssi) {
+  if(key >= state.keyCount) return;
+  PresenceKeyState & entry = state.keys[key];
+
+  //sources without a signal strength only move the last seen time
+  if(rssi != 0) {
+    if(entry.rssi == 0) entry.rssi = rssi;
+    else entry.rssi += PRESENCE_RSSI_ALPHA * (rssi - entry.rssi);
+  }
+
+  entry.lastSeenMs = wallClockMs();
+}
+
+void PresencePublisher::setPresent(int key, bool present) {
+  if(key >= state.keyCount || state.keys[key].present == present) return;
+
+  state.keys[key].present = present;
+  state.generation++;
+}
+
+void PresencePublisher::setLightsOn(bool lightsOn) {
+  if(state.lightsOn == lightsOn) return;
+
+  state.lightsOn = lightsOn;
+  state.generation++;
+}
+
+void PresencePublisher::updateZones(int64_t nowMs) {
+  for(int i = 0; i < state.zoneCount; i++) {
+    PresenceZoneState & zone = state.zones[i];
+
+    uint16_t present = 0;
+    for(int j = 0; j < state.keyCount; j++) {
+      if(state.keys[j].zone == zone.zone && state.keys[j].present) present++;
+    }
+
+    //only entering or emptying the zone restarts its clock
+    if((present == 0) != (zone.present == 0)) zone.sinceMs = nowMs;
+    zone.present = present;
+  }
+}
+
+
+void PresencePublisher::publish() {
+  state.updatedMs = wallClockMs();
+  updateZones(state.updatedMs);
+
+  if(!shared) return;
+
+  //rounded up to even in case an earlier writer died midway through
+  uint64_t sequence = (shared->sequence.load(std::memory_order_relaxed) + 1) & ~1ull;
+  shared->sequence.store(sequence + 1, std::memory_order_relaxed);
+  //the odd sequence has to be visible before any of the new snapshot is
+  std::atomic_thread_fence(std::memory_order_release);
+
+  memcpy(&shared->snapshot, &state, sizeof(PresenceSnapshot));
+
+  shared->sequence.store(sequence + 2, std::memory_order_release);
+}
+
+const PresenceSnapshot & PresencePublisher::getSnapshot() {
+  return state;
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "presence.hpp"
+#include "keys.hpp"
+
+#include <vector>
+#include <string>
+
+//weight of a new reading in the smoothed RSSI
+#define PRESENCE_RSSI_ALPHA 0.3f
+
+//keeps the presence table in private memory and copies it into the shared segment on publish,
+//so readers only ever see whole rounds. keys past PRESENCE_MAX_KEYS are tracked but not published
+class PresencePublisher {
+  std::string name;
+  PresenceShared * shared;
+  PresenceSnapshot state;
+
+  void updateZones(int64_t nowMs);
+
+public:
+  PresencePublisher(const std::vector<Key> & keys, std::string name = PRESENCE_SHM_NAME);
+  ~PresencePublisher();
+
+  PresencePublisher(const PresencePublisher&) = delete;
+  PresencePublisher& operator=(const PresencePublisher&) = delete;
+
+  bool isOpen();
+
+  //any sighting of the key, rssi 0 when the source has none
+  void seen(int key, int16_t rssi);
+  void setPresent(int key, bool present);
+  void setLightsOn(bool lightsOn);
+
+  //never waits on readers, a reader that catches it midway just copies again
+  void publish();
+
+  //the table as of the last publish
+  const PresenceSnapshot & getSnapshot();
+};
@@ -0,0 +1,165 @@
+#include "iothread.hpp"
+
+#include <sys/wait.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <iostream>
+#include <fstream>
+#include <algorithm>
+#include <thread>
+#include <cstdlib>
+
+//times how long the bluetooth thread takes to hand out a fresh device table after bluetoothd
+//restarts and after the whole system bus goes away and comes back. it runs its own dbus-daemon
+//with ./mockbluez standing in for bluetoothd, so no adapter or real bus is touched
+
+#define RECOVERY_ROUNDS 10
+//how long each outage lasts before things come back, stretched a little every round so the
+//return lands at a different point of the reconnect interval
+constexpr auto OUTAGE = std::chrono::milliseconds(500);
+constexpr auto OUTAGE_STEP = std::chrono::milliseconds(37);
+constexpr auto RECOVERY_TARGET = std::chrono::milliseconds(1000);
+constexpr auto RECOVERY_GIVE_UP = std::chrono::seconds(10);
+
+static std::string directory;
+
+//output, when given, becomes the child's stdout
+static pid_t spawn(std::vector<std::string> command, int output = -1) {
+  pid_t pid = fork();
+  if(pid) return pid;
+
+  if(output >= 0) dup2(output, STDOUT_FILENO);
+
+  std::vector<char*> argv;
+  for(std::string & arg : command) argv.push_back(arg.data());
+  argv.push_back(nullptr);
+
+  execvp(argv[0], argv.data());
+  _exit(127);
+}
+
+static void stop(pid_t & pid) {
+  if(pid <= 0) return;
+  kill(pid, SIGTERM);
+  waitpid(pid, nullptr, 0);
+  pid = 0;
+}
+
+//returns once the bus takes connections, which is when it prints its address
+static pid_t startBus() {
+  int ready[2];
+  if(pipe(ready)) return 0;
+
+  pid_t pid = spawn({"dbus-daemon", "--nofork", "--print-address", "--config-file=" + directory + "/bus.conf"}, ready[1]);
+  close(ready[1]);
+
+  char c;
+  while(read(ready[0], &c, 1) == 1 && c != '\n');
+  close(ready[0]);
+
+  return pid;
+}
+
+static pid_t startBluez() {
+  return spawn({"./mockbluez"});
+}
+
+//ms until the thread publishes a table that has the mock's devices in it, -1 if it never does
+static long waitForDevices(BluetoothThread & bluetooth, std::chrono::steady_clock::time_point since) {
+  auto giveUp = since + RECOVERY_GIVE_UP;
+
+  while(std::chrono::steady_clock::now() < giveUp) {
+    pollfd wake{bluetooth.getEventFd(), POLLIN, 0};
+    ::poll(&wake, 1, 100);
+
+    Event event;
+    while(bluetooth.receive(event)) {
+      auto devices = std::get_if<DevicesEvent>(&event.payload);
+      if(!devices || devices->devices.empty()) continue;
+      return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - since).count();
+    }
+  }
+
+  return -1;
+}
+
+//whatever was still queued from before the outage says nothing about the recovery
+static void drain(BluetoothThread & bluetooth) {
+  Event event;
+  while(bluetooth.receive(event));
+}
+
+static bool report(const char * scenario, std::vector<long> & times) {
+  bool ok = std::none_of(times.begin(), times.end(), [](long ms){ return ms < 0 || ms >= RECOVERY_TARGET.count(); });
+
+  std::cout << scenario << ":";
+  for(long ms : times) std::cout << ' ' << ms << "ms";
+
+  std::sort(times.begin(), times.end());
+  std::cout << " (median " << times[times.size() / 2] << "ms, max " << times.back() << "ms) " << (ok ? "ok" : "FAIL") << '\n';
+
+  return ok;
+}
+
+
+int main() {
+  char name[] = "/tmp/bluelight-recovery.XXXXXX";
+  if(!mkdtemp(name)) {
+    std::cerr << "could not make a directory for the bus\n";
+    return 1;
+  }
+  directory = name;
+
+  std::ofstream(directory + "/bus.conf") <<
+    "<busconfig><type>custom</type><listen>unix:path=" << directory << "/bus</listen><auth>EXTERNAL</auth>"
+    "<policy context=\"default\"><allow send_destination=\"*\"/><allow receive_sender=\"*\"/><allow own=\"*\"/></policy></busconfig>\n";
+  setenv("DBUS_SYSTEM_BUS_ADDRESS", ("unix:path=" + directory + "/bus").c_str(), 1);
+
+  pid_t bus = startBus();
+  pid_t bluez = startBluez();
+
+  bool ok = true;
+
+  {
+    //refreshes far apart, so only a resync hands out a table during a round
+    BluetoothThread bluetooth(std::chrono::milliseconds(60000));
+    if(waitForDevices(bluetooth, std::chrono::steady_clock::now()) < 0) {
+      std::cerr << "the bluetooth thread never saw the mock's devices\n";
+      ok = false;
+    }
+
+    std::vector<long> restarts;
+    for(int i = 0; ok && i < RECOVERY_ROUNDS; i++) {
+      stop(bluez);
+      std::this_thread::sleep_for(OUTAGE + i * OUTAGE_STEP);
+      drain(bluetooth);
+
+      auto since = std::chrono::steady_clock::now();
+      bluez = startBluez();
+      restarts.push_back(waitForDevices(bluetooth, since));
+    }
+    if(ok) ok = report("bluetoothd restarted", restarts);
+
+    std::vector<long> drops;
+    for(int i = 0; ok && i < RECOVERY_ROUNDS; i++) {
+      stop(bluez);
+      stop(bus);
+      std::this_thread::sleep_for(OUTAGE + i * OUTAGE_STEP);
+      drain(bluetooth);
+
+      auto since = std::chrono::steady_clock::now();
+      bus = startBus();
+      bluez = startBluez();
+      drops.push_back(waitForDevices(bluetooth, since));
+    }
+    if(!drops.empty()) ok = report("system bus dropped", drops) && ok;
+  }
+
+  stop(bluez);
+  stop(bus);
+  unlink((directory + "/bus.conf").c_str());
+  rmdir(directory.c_str());
+
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <atomic>
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+
+#define CACHE_LINE_SIZE 64
+
+//single producer, single consumer. N must be a power of two
+template<typename T, size_t N>
+class SpscRing {
+  static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+  std::array<T, N> slots;
+
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> head{0};
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail{0};
+
+  //each side's last look at the other index, so the common case touches no shared line
+  alignas(CACHE_LINE_SIZE) size_t producerHead = 0;
+  alignas(CACHE_LINE_SIZE) size_t consumerTail = 0;
+
+public:
+  bool push(T && value) {
+    size_t position = tail.load(std::memory_order_relaxed);
+
+    if(position - producerHead == N) {
+      producerHead = head.load(std::memory_order_acquire);
+      if(position - producerHead == N) return false;
+    }
+
+    slots[position & (N - 1)] = std::move(value);
+    tail.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T & value) {
+    size_t position = head.load(std::memory_order_relaxed);
+
+    if(position == consumerTail) {
+      consumerTail = tail.load(std::memory_order_acquire);
+      if(position == consumerTail) return false;
+    }
+
+    value = std::move(slots[position & (N - 1)]);
+    head.store(position + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+
+//many producers, single consumer, bounded. each slot carries a sequence number so
+//producers only contend on the tail index and never on the consumer's side
+template<typename T, size_t N>
+class MpscRing {
+  static_assert((N & (N - 1)) == 0, "ring size must be a power of two");
+
+  struct Slot {
+    std::atomic<size_t> sequence;
+    T value;
+  };
+
+  std::array<Slot, N> slots;
+
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail{0};
+  alignas(CACHE_LINE_SIZE) size_t head = 0;
+
+public:
+  MpscRing() {
+    for(size_t i = 0; i < N; i++) slots[i].sequence.store(i, std::memory_order_relaxed);
+  }
+
+  bool push(T && value) {
+    size_t position = tail.load(std::memory_order_relaxed);
+    Slot * slot;
+
+    while(true) {
+      slot = &slots[position & (N - 1)];
+      size_t sequence = slot->sequence.load(std::memory_order_acquire);
+      intptr_t difference = (intptr_t) sequence - (intptr_t) position;
+
+      if(difference == 0) {
+        if(tail.compare_exchange_weak(position, position + 1, std::memory_order_relaxed)) break;
+      } else if(difference < 0) {
+        return false;
+      } else {
+        position = tail.load(std::memory_order_relaxed);
+      }
+    }
+
+    slot->value = std::move(value);
+    slot->sequence.store(position + 1, std::memory_order_release);
+    return true;
+  }
+
+  bool pop(T & value) {
+    Slot & slot = slots[head & (N - 1)];
+
+    if(slot.sequence.load(std::memory_order_acquire) != head + 1) return false;
+
+    value = std::move(slot.value);
+    slot.sequence.store(head + N, std::memory_order_release);
+    head++;
+    return true;
+  }
+};
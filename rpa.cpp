@@ -0,0 +1,200 @@
+#include "rpa.hpp"
+
+#include <cstring>
+
+
+static int hexValue(char c) {
+  if(c >= '0' && c <= '9') return c - '0';
+  if(c >= 'a' && c <= 'f') return c - 'a' + 10;
+  if(c >= 'A' && c <= 'F') return c - 'A' + 10;
+  return -1;
+}
+
+static uint64_t addressKey(const BdAddr & address) {
+  uint64_t key = 0;
+  for(uint8_t octet : address) key = (key << 8) | octet;
+  return key;
+}
+
+
+std::optional<BdAddr> parseAddress(const std::string & address) {
+  if(address.length() != 17) return std::nullopt;
+
+  BdAddr retval;
+
+  for(int i = 0; i < 6; i++) {
+    int high = hexValue(address[i*3]);
+    int low = hexValue(address[i*3 + 1]);
+    if(high < 0 || low < 0) return std::nullopt;
+    if(i < 5 && address[i*3 + 2] != ':') return std::nullopt;
+    retval[i] = (high << 4) | low;
+  }
+
+  return retval;
+}
+
+std::string formatAddress(const BdAddr & address) {
+  char buffer[18];
+  snprintf(buffer, sizeof(buffer), "%02X:%02X:%02X:%02X:%02X:%02X",
+      address[0], address[1], address[2], address[3], address[4], address[5]);
+  return std::string(buffer);
+}
+
+
+std::optional<Irk> parseIrk(const std::string & hex) {
+  if(hex.length() != 32) return std::nullopt;
+
+  Irk retval;
+
+  for(int i = 0; i < 16; i++) {
+    int high = hexValue(hex[i*2]);
+    int low = hexValue(hex[i*2 + 1]);
+    if(high < 0 || low < 0) return std::nullopt;
+    retval[i] = (high << 4) | low;
+  }
+
+  return retval;
+}
+
+std::string formatIrk(const Irk & irk) {
+  char buffer[33];
+  for(int i = 0; i < 16; i++) snprintf(buffer + i*2, 3, "%02x", irk[i]);
+  return std::string(buffer);
+}
+
+
+bool isResolvableAddress(const BdAddr & address) {
+  return (address[0] >> 6) == 0b01;
+}
+
+
+uint32_t ah(const Irk & irk, uint32_t prand) {
+  uint8_t block[16] = {0};
+  uint8_t out[32];
+  int outLength = 0;
+
+  block[13] = prand >> 16;
+  block[14] = prand >> 8;
+  block[15] = prand;
+
+  EVP_CIPHER_CTX * ctx = EVP_CIPHER_CTX_new();
+  EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), nullptr, irk.data(), nullptr);
+  EVP_CIPHER_CTX_set_padding(ctx, 0);
+  EVP_EncryptUpdate(ctx, out, &outLength, block, 16);
+  EVP_CIPHER_CTX_free(ctx);
+
+  return (out[13] << 16) | (out[14] << 8) | out[15];
+}
+
+
+RpaResolver::RpaResolver() {}
+
+RpaResolver::~RpaResolver() {
+  freeContexts();
+}
+
+
+void RpaResolver::freeContexts() {
+  for(EVP_CIPHER_CTX * ctx : contexts) EVP_CIPHER_CTX_free(ctx);
+  contexts.clear();
+}
+
+
+void RpaResolver::setIrks(std::vector<Irk> newIrks) {
+  freeContexts();
+  clearCache();
+
+  irks = newIrks;
+
+  //expand every key schedule once up front, EVP picks AES-NI when the cpu has it
+  for(const Irk & irk : irks) {
+    EVP_CIPHER_CTX * ctx = EVP_CIPHER_CTX_new();
+    EVP_EncryptInit_ex(ctx, EVP_aes_128_ecb(), nullptr, irk.data(), nullptr);
+    EVP_CIPHER_CTX_set_padding(ctx, 0);
+    contexts.push_back(ctx);
+  }
+}
+
+size_t RpaResolver::size() {
+  return irks.size();
+}
+
+
+void RpaResolver::clearCache() {
+  cache.clear();
+}
+
+void RpaResolver::pruneCache(std::chrono::steady_clock::time_point now) {
+  for(auto it = cache.begin(); it != cache.end();) {
+    if(now - it->second.resolvedAt > RPA_CACHE_TTL) it = cache.erase(it);
+    else it++;
+  }
+
+  if(cache.size() >= RPA_CACHE_SIZE) cache.clear();
+}
+
+
+int RpaResolver::resolve(const BdAddr & address) {
+  return resolveBatch({address})[0];
+}
+
+
+std::vector<int> RpaResolver::resolveBatch(const std::vector<BdAddr> & addresses) {
+  auto now = std::chrono::steady_clock::now();
+
+  std::vector<int> retval(addresses.size(), -1);
+  std::vector<size_t> pending;
+
+  for(size_t i = 0; i < addresses.size(); i++) {
+    if(!isResolvableAddress(addresses[i])) continue;
+
+    auto cached = cache.find(addressKey(addresses[i]));
+    if(cached != cache.end() && now - cached->second.resolvedAt <= RPA_CACHE_TTL) {
+      retval[i] = cached->second.irk;
+      continue;
+    }
+
+    pending.push_back(i);
+  }
+
+  if(pending.empty()) return retval;
+
+  //prand only depends on the address, so the plaintext blocks are shared by every IRK
+  plaintext.assign(pending.size() * 16, 0);
+  ciphertext.resize(pending.size() * 16 + 16);
+
+  for(size_t j = 0; j < pending.size(); j++) {
+    const BdAddr & address = addresses[pending[j]];
+    memcpy(&plaintext[j*16 + 13], address.data(), 3);
+  }
+
+  std::vector<bool> matched(pending.size(), false);
+  size_t remaining = pending.size();
+
+  for(size_t k = 0; k < contexts.size() && remaining > 0; k++) {
+    int outLength = 0;
+    //one call per IRK encrypts the whole batch, letting the cipher pipeline blocks
+    EVP_EncryptUpdate(contexts[k], ciphertext.data(), &outLength, plaintext.data(), plaintext.size());
+
+    for(size_t j = 0; j < pending.size(); j++) {
+      if(matched[j]) continue;
+
+      const BdAddr & address = addresses[pending[j]];
+      const uint8_t * block = &ciphertext[j*16];
+
+      if(block[13] == address[3] && block[14] == address[4] && block[15] == address[5]) {
+        matched[j] = true;
+        retval[pending[j]] = k;
+        remaining--;
+      }
+    }
+  }
+
+  if(cache.size() + pending.size() > RPA_CACHE_SIZE) pruneCache(now);
+
+  for(size_t j = 0; j < pending.size(); j++) {
+    cache[addressKey(addresses[pending[j]])] = CacheEntry{retval[pending[j]], now};
+  }
+
+  return retval;
+}
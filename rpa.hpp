@@ -0,0 +1,63 @@
+#pragma once
+
+#include <openssl/evp.h>
+
+#include <array>
+#include <vector>
+#include <string>
+#include <optional>
+#include <unordered_map>
+#include <chrono>
+#include <cstdint>
+
+#define RPA_CACHE_SIZE 4096
+constexpr auto RPA_CACHE_TTL = std::chrono::minutes(15);
+
+//both stored most significant octet first, the way the Core spec and BlueZ print them
+typedef std::array<uint8_t, 16> Irk;
+typedef std::array<uint8_t, 6> BdAddr;
+
+std::optional<BdAddr> parseAddress(const std::string & address);
+std::string formatAddress(const BdAddr & address);
+
+std::optional<Irk> parseIrk(const std::string & hex);
+std::string formatIrk(const Irk & irk);
+
+bool isResolvableAddress(const BdAddr & address);
+
+//random address hash function ah(k, r) from Core spec Vol 3, Part H, 2.2.2
+uint32_t ah(const Irk & irk, uint32_t prand);
+
+class RpaResolver {
+  struct CacheEntry {
+    int irk;
+    std::chrono::steady_clock::time_point resolvedAt;
+  };
+
+  std::vector<Irk> irks;
+  std::vector<EVP_CIPHER_CTX*> contexts;
+
+  std::unordered_map<uint64_t, CacheEntry> cache;
+
+  std::vector<uint8_t> plaintext;
+  std::vector<uint8_t> ciphertext;
+
+  void freeContexts();
+  void pruneCache(std::chrono::steady_clock::time_point now);
+
+public:
+  RpaResolver();
+  ~RpaResolver();
+
+  RpaResolver(const RpaResolver&) = delete;
+  RpaResolver& operator=(const RpaResolver&) = delete;
+
+  void setIrks(std::vector<Irk> newIrks);
+  size_t size();
+
+  //returns index into the IRK list, or -1 when no IRK matches
+  int resolve(const BdAddr & address);
+  std::vector<int> resolveBatch(const std::vector<BdAddr> & addresses);
+
+  void clearCache();
+};
@@ -0,0 +1,272 @@
+#include "service.hpp"
+
+#include <cmath>
+#include <cstdio>
+
+
+static std::string zonePath(uint16_t zone) {
+  char path[64];
+  snprintf(path, sizeof(path), PRESENCE_PATH "/zone_%u", zone);
+  return path;
+}
+
+static std::string keyPath(uint32_t keyId) {
+  char path[64];
+  snprintf(path, sizeof(path), PRESENCE_PATH "/key_%08x", keyId);
+  return path;
+}
+
+//these move every round, they can be read but never trigger a signal
+static bool isQuiet(const std::string & name) {
+  return name == "LastSeen" || name == "RSSI";
+}
+
+static std::map<std::string, ExportedObject> buildObjects(const PresenceSnapshot & snapshot) {
+  std::map<std::string, ExportedObject> retval;
+  bool occupied = false;
+
+  for(int i = 0; i < snapshot.zoneCount; i++) {
+    const PresenceZoneState & zone = snapshot.zones[i];
+    occupied = occupied || zone.present > 0;
+
+    retval[zonePath(zone.zone)] = ExportedObject{ZONE_INTERFACE, {
+      {"Zone", zone.zone},
+      {"Occupied", zone.present > 0},
+      {"Occupants", zone.present},
+      {"Since", zone.sinceMs},
+    }};
+  }
+
+  for(int i = 0; i < snapshot.keyCount; i++) {
+    const PresenceKeyState & key = snapshot.keys[i];
+
+    retval[keyPath(key.keyId)] = ExportedObject{KEY_INTERFACE, {
+      {"KeyId", key.keyId},
+      {"Zone", key.zone},
+      {"Present", (bool) key.present},
+      {"LastSeen", key.lastSeenMs},
+      {"RSSI", (int16_t) std::lround(key.rssi)},
+    }};
+  }
+
+  retval[PRESENCE_PATH] = ExportedObject{PRESENCE_INTERFACE, {
+    {"Occupied", occupied},
+    {"LightsOn", (bool) snapshot.lightsOn},
+    {"Generation", snapshot.generation},
+  }};
+
+  return retval;
+}
+
+
+PresenceService::PresenceService(BluetoothController & controller, std::function<void()> onReprobe) : controller(controller) {
+  this->onReprobe = onReprobe;
+  nextReprobe = std::chrono::steady_clock::time_point();
+  signalsSent = 0;
+
+  controller.exportPath(PRESENCE_PATH, PresenceService::messageHandler, this);
+  controller.requestName(PRESENCE_SERVICE);
+}
+
+PresenceService::~PresenceService() {
+  controller.unexportPath(PRESENCE_PATH);
+}
+
+
+void PresenceService::emit(DBusMessage * signal) {
+  if(controller.send(signal)) signalsSent++;
+}
+
+void PresenceService::update(const PresenceSnapshot & snapshot) {
+  std::map<std::string, ExportedObject> next = buildObjects(snapshot);
+
+  for(auto & [path, object] : next) {
+    auto existing = objects.find(path);
+
+    if(existing == objects.end()) {
+      if(path == PRESENCE_PATH) continue;
+
+      DBusMessage * signal = dbus_message_new_signal(PRESENCE_PATH, OBJECT_MANAGER_INTERFACE, "InterfacesAdded");
+      appendArgs(signal, ObjectPath{path.c_str()}, std::map<std::string, PropertyMap>{{object.interface, object.properties}});
+      emit(signal);
+      continue;
+    }
+
+    PropertyMap changed;
+    for(auto & [name, value] : object.properties) {
+      if(!isQuiet(name) && existing->second.properties[name] != value) changed[name] = value;
+    }
+    if(changed.empty()) continue;
+
+    DBusMessage * signal = dbus_message_new_signal(path.c_str(), DBUS_INTERFACE_PROPERTIES, "PropertiesChanged");
+    appendArgs(signal, object.interface, changed, std::vector<std::string>());
+    emit(signal);
+  }
+
+  for(auto & [path, object] : objects) {
+    if(next.count(path)) continue;
+
+    DBusMessage * signal = dbus_message_new_signal(PRESENCE_PATH, OBJECT_MANAGER_INTERFACE, "InterfacesRemoved");
+    appendArgs(signal, ObjectPath{path.c_str()}, std::vector<std::string>{object.interface});
+    emit(signal);
+  }
+
+  objects = std::move(next);
+}
+
+uint64_t PresenceService::getSignalsSent() {
+  return signalsSent;
+}
+
+
+DBusHandlerResult PresenceService::messageHandler(DBusConnection * connection, DBusMessage * message, void * userData) {
+  PresenceService * service = static_cast<PresenceService*>(userData);
+
+  if(dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_METHOD_CALL) return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  DBusMessage * reply = service->handle(message);
+  if(!reply) return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+  if(!dbus_message_get_no_reply(message)) dbus_connection_send(connection, reply, nullptr);
+  dbus_message_unref(reply);
+  return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+DBusMessage * PresenceService::handle(DBusMessage * message) {
+  std::string path = dbus_message_get_path(message);
+
+  if(dbus_message_is_method_call(message, DBUS_INTERFACE_INTROSPECTABLE, "Introspect")) {
+    std::string xml = introspect(path);
+    DBusMessage * reply = dbus_message_new_method_return(message);
+    appendArgs(reply, xml);
+    return reply;
+  }
+
+  auto object = objects.find(path);
+  if(object == objects.end()) {
+    return dbus_message_new_error(message, DBUS_ERROR_UNKNOWN_OBJECT, "no such presence object");
+  }
+
+  if(path == PRESENCE_PATH && dbus_message_is_method_call(message, OBJECT_MANAGER_INTERFACE, "GetManagedObjects")) {
+    return getManagedObjects(message);
+  }
+
+  //answered straight away, the outcome arrives as PropertiesChanged like any other transition
+  if(path == PRESENCE_PATH && dbus_message_is_method_call(message, PRESENCE_INTERFACE, "Reprobe")) {
+    auto now = std::chrono::steady_clock::now();
+    if(now < nextReprobe) return dbus_message_new_error(message, DBUS_ERROR_LIMITS_EXCEEDED, "reprobed too recently, try again shortly");
+
+    nextReprobe = now + REPROBE_MIN_INTERVAL;
+    onReprobe();
+    return dbus_message_new_method_return(message);
+  }
+
+  if(dbus_message_is_method_call(message, DBUS_INTERFACE_PROPERTIES, "Get")) {
+    return getProperties(message, object->second, false);
+  }
+  if(dbus_message_is_method_call(message, DBUS_INTERFACE_PROPERTIES, "GetAll")) {
+    return getProperties(message, object->second, true);
+  }
+  if(dbus_message_is_method_call(message, DBUS_INTERFACE_PROPERTIES, "Set")) {
+    return dbus_message_new_error(message, DBUS_ERROR_PROPERTY_READ_ONLY, "presence is read only");
+  }
+
+  return dbus_message_new_error(message, DBUS_ERROR_UNKNOWN_METHOD, dbus_message_get_member(message));
+}
+
+DBusMessage * PresenceService::getManagedObjects(DBusMessage * message) {
+  DBusMessage * reply = dbus_message_new_method_return(message);
+
+  //a{oa{sa{sv}}}, children only, the manager itself is not one of its objects
+  DBusMessageIter iter, entries;
+  dbus_message_iter_init_append(reply, &iter);
+  dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, "{oa{sa{sv}}}", &entries);
+
+  for(auto & [path, object] : objects) {
+    if(path == PRESENCE_PATH) continue;
+
+    DBusMessageIter entry;
+    dbus_message_iter_open_container(&entries, DBUS_TYPE_DICT_ENTRY, nullptr, &entry);
+    appendValue(&entry, ObjectPath{path.c_str()});
+    appendValue(&entry, std::map<std::string, PropertyMap>{{object.interface, object.properties}});
+    dbus_message_iter_close_container(&entries, &entry);
+  }
+
+  dbus_message_iter_close_container(&iter, &entries);
+  return reply;
+}
+
+DBusMessage * PresenceService::getProperties(DBusMessage * message, const ExportedObject & object, bool all) {
+  std::string interface;
+  std::string name;
+
+  bool ok = all ? readArgs(message, interface) : readArgs(message, interface, name);
+  if(!ok) return dbus_message_new_error(message, DBUS_ERROR_INVALID_ARGS, "expected an interface and property name");
+
+  if(interface != object.interface) {
+    return dbus_message_new_error(message, DBUS_ERROR_UNKNOWN_INTERFACE, interface.c_str());
+  }
+
+  DBusMessage * reply = dbus_message_new_method_return(message);
+
+  if(all) {
+    appendArgs(reply, object.properties);
+    return reply;
+  }
+
+  auto property = object.properties.find(name);
+  if(property == object.properties.end()) {
+    dbus_message_unref(reply);
+    return dbus_message_new_error(message, DBUS_ERROR_UNKNOWN_PROPERTY, name.c_str());
+  }
+
+  appendArgs(reply, property->second);
+  return reply;
+}
+
+std::string PresenceService::introspect(const std::string & path) {
+  std::string xml = DBUS_INTROSPECT_1_0_XML_DOCTYPE_DECL_NODE "<node>\n"
+    "  <interface name=\"" DBUS_INTERFACE_INTROSPECTABLE "\">\n"
+    "    <method name=\"Introspect\"><arg name=\"xml\" type=\"s\" direction=\"out\"/></method>\n"
+    "  </interface>\n";
+
+  auto object = objects.find(path);
+
+  if(object != objects.end()) {
+    xml +=
+      "  <interface name=\"" DBUS_INTERFACE_PROPERTIES "\">\n"
+      "    <method name=\"Get\"><arg type=\"s\" direction=\"in\"/><arg type=\"s\" direction=\"in\"/><arg type=\"v\" direction=\"out\"/></method>\n"
+      "    <method name=\"GetAll\"><arg type=\"s\" direction=\"in\"/><arg type=\"a{sv}\" direction=\"out\"/></method>\n"
+      "    <signal name=\"PropertiesChanged\"><arg type=\"s\"/><arg type=\"a{sv}\"/><arg type=\"as\"/></signal>\n"
+      "  </interface>\n";
+
+    xml += "  <interface name=\"" + object->second.interface + "\">\n";
+    if(path == PRESENCE_PATH) xml += "    <method name=\"Reprobe\"/>\n";
+
+    for(auto & [name, value] : object->second.properties) {
+      std::string signature = std::visit([](const auto & alternative){
+        return std::string(signatureOf<std::decay_t<decltype(alternative)>>().c_str());
+      }, value);
+
+      xml += "    <property name=\"" + name + "\" type=\"" + signature + "\" access=\"read\"";
+      if(isQuiet(name)) xml += "><annotation name=\"org.freedesktop.DBus.Property.EmitsChangedSignal\" value=\"false\"/></property>\n";
+      else xml += "/>\n";
+    }
+    xml += "  </interface>\n";
+  }
+
+  if(path == PRESENCE_PATH) {
+    xml +=
+      "  <interface name=\"" OBJECT_MANAGER_INTERFACE "\">\n"
+      "    <method name=\"GetManagedObjects\"><arg type=\"a{oa{sa{sv}}}\" direction=\"out\"/></method>\n"
+      "    <signal name=\"InterfacesAdded\"><arg type=\"o\"/><arg type=\"a{sa{sv}}\"/></signal>\n"
+      "    <signal name=\"InterfacesRemoved\"><arg type=\"o\"/><arg type=\"as\"/></signal>\n"
+      "  </interface>\n";
+
+    for(auto & [child, object] : objects) {
+      if(child != PRESENCE_PATH) xml += "  <node name=\"" + child.substr(strlen(PRESENCE_PATH) + 1) + "\"/>\n";
+    }
+  }
+
+  return xml + "</node>\n";
+}
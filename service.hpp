@@ -0,0 +1,62 @@
+#pragma once
+
+#include "bluelight.hpp"
+#include "presence.hpp"
+
+#include <map>
+#include <variant>
+#include <functional>
+#include <chrono>
+
+#define PRESENCE_SERVICE "org.bluelight"
+#define PRESENCE_PATH "/org/bluelight"
+#define PRESENCE_INTERFACE "org.bluelight.Presence"
+#define ZONE_INTERFACE "org.bluelight.Zone"
+#define KEY_INTERFACE "org.bluelight.Key"
+//older libdbus headers have no name for it
+#define OBJECT_MANAGER_INTERFACE "org.freedesktop.DBus.ObjectManager"
+
+//any local user may call Reprobe, and every round pages the phones, so callers get at most one
+//round this often and an error in between
+constexpr auto REPROBE_MIN_INTERVAL = std::chrono::seconds(5);
+
+typedef std::variant<bool, int16_t, uint16_t, uint32_t, int64_t, uint64_t> PropertyValue;
+typedef std::map<std::string, PropertyValue> PropertyMap;
+
+struct ExportedObject {
+  std::string interface;
+  PropertyMap properties;
+};
+
+//serves the presence table on the bus: PRESENCE_PATH carries the overall state, the Reprobe method
+//and an ObjectManager, with one child per zone and per key. subscribers get a PropertiesChanged
+//when something comes or goes and nothing in between. lives on the bluetooth thread
+class PresenceService {
+  BluetoothController & controller;
+  std::function<void()> onReprobe;
+  std::chrono::steady_clock::time_point nextReprobe;
+
+  //by path, as of the last update
+  std::map<std::string, ExportedObject> objects;
+  uint64_t signalsSent;
+
+  static DBusHandlerResult messageHandler(DBusConnection * connection, DBusMessage * message, void * service);
+  DBusMessage * handle(DBusMessage * message);
+
+  DBusMessage * getManagedObjects(DBusMessage * message);
+  DBusMessage * getProperties(DBusMessage * message, const ExportedObject & object, bool all);
+  std::string introspect(const std::string & path);
+
+  void emit(DBusMessage * signal);
+
+public:
+  PresenceService(BluetoothController & controller, std::function<void()> onReprobe);
+  ~PresenceService();
+
+  PresenceService(const PresenceService&) = delete;
+  PresenceService& operator=(const PresenceService&) = delete;
+
+  void update(const PresenceSnapshot & snapshot);
+
+  uint64_t getSignalsSent();
+};
@@ -0,0 +1,382 @@
+#include "simulation.hpp"
+
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+#include <cstdio>
+
+
+std::optional<SimulationConfig> loadSimulationConfig(const std::string & path) {
+  std::fstream file(path, std::ios_base::in);
+  if(!file.is_open()) return {};
+
+  SimulationConfig retval;
+  int highestKey = -1;
+
+  std::string line;
+
+  while(std::getline(file, line)) {
+    std::istringstream stream(line);
+    std::string name;
+
+    if(!(stream >> name) || name[0] == '#') continue;
+
+    if(name == "days") stream >> retval.days;
+    else if(name == "keys") stream >> retval.keys;
+    else if(name == "seed") stream >> retval.seed;
+    else if(name == "probe_hit") stream >> retval.probeHit;
+    else if(name == "false_sighting") stream >> retval.falseSighting;
+    else if(name == "probe_latency") {
+      int ms;
+      if(stream >> ms) retval.probeLatency = std::chrono::milliseconds(ms);
+    } else if(name == "at") {
+      int day, hours, minutes, key;
+      char colon;
+      std::string change;
+      if(!(stream >> day >> hours >> colon >> minutes >> key >> change) || colon != ':' || key < 0) continue;
+      if(change != "arrive" && change != "depart") continue;
+
+      auto at = std::chrono::hours(24 * day + hours) + std::chrono::minutes(minutes);
+      retval.script.push_back(ScriptedChange{at, key, change == "arrive"});
+      highestKey = std::max(highestKey, key);
+    }
+  }
+
+  retval.days = std::max(retval.days, 1);
+  //a script brings its own keys
+  if(!retval.script.empty()) retval.keys = highestKey + 1;
+  retval.keys = std::max(retval.keys, 1);
+  retval.probeHit = std::clamp(retval.probeHit, 0.0f, 1.0f);
+  retval.falseSighting = std::clamp(retval.falseSighting, 0.0f, 1.0f);
+
+  std::stable_sort(retval.script.begin(), retval.script.end(), [](const ScriptedChange & a, const ScriptedChange & b){
+    return a.at < b.at;
+  });
+
+  return retval;
+}
+
+
+static std::chrono::seconds minutesAt(double minutes) {
+  return std::chrono::seconds((int64_t) (minutes * 60));
+}
+
+std::vector<ScriptedChange> generateRoutine(const SimulationConfig & config, std::mt19937 & random) {
+  std::vector<ScriptedChange> retval;
+
+  std::normal_distribution<double> leave(8 * 60, 40);
+  std::normal_distribution<double> back(17.75 * 60, 75);
+  std::uniform_real_distribution<double> uniform(0, 1);
+
+  for(int key = 0; key < config.keys; key++) {
+    retval.push_back(ScriptedChange{std::chrono::seconds(0), key, true});
+
+    for(int day = 0; day < config.days; day++) {
+      auto midnight = std::chrono::hours(24 * day);
+      //spells away from home that day, in minutes after midnight
+      std::vector<std::pair<double, double>> away;
+
+      if(day % 7 < 5) {
+        double left = std::clamp(leave(random), 5.0 * 60, 11.0 * 60);
+        double returned = std::clamp(back(random), left + 60, 22.0 * 60);
+        away.push_back({left, returned});
+
+        if(uniform(random) < 0.4) {
+          double errand = 19 * 60 + uniform(random) * 90;
+          if(errand > returned + 15) away.push_back({errand, errand + 20 + uniform(random) * 100});
+        }
+      } else {
+        int outings = random() % 4;
+        double free = 9 * 60;
+
+        for(int i = 0; i < outings; i++) {
+          double start = free + uniform(random) * 180;
+          double end = start + 30 + uniform(random) * 210;
+          if(end > 23 * 60) break;
+          away.push_back({start, end});
+          free = end + 10;
+        }
+      }
+
+      for(auto & [left, returned] : away) {
+        retval.push_back(ScriptedChange{midnight + minutesAt(left), key, false});
+        retval.push_back(ScriptedChange{midnight + minutesAt(returned), key, true});
+      }
+    }
+  }
+
+  std::stable_sort(retval.begin(), retval.end(), [](const ScriptedChange & a, const ScriptedChange & b){
+    return a.at < b.at;
+  });
+
+  return retval;
+}
+
+
+SimulatedBluetooth::SimulatedBluetooth(VirtualClock & clock, const std::vector<Key> & keys, const SimulationConfig & config, std::mt19937 & random)
+  : clock(clock), config(config), random(random) {
+  this->keys = keys;
+  present.assign(keys.size(), false);
+
+  nextRefresh = clock.now();
+  nextId = 1;
+
+  dutyCycle = 0;
+  dutySince = clock.now();
+
+  probes = 0;
+  probeTime = std::chrono::nanoseconds(0);
+  scanTime = std::chrono::nanoseconds(0);
+}
+
+std::string SimulatedBluetooth::pathOf(int key) {
+  std::string address = keys[key].address;
+  std::replace(address.begin(), address.end(), ':', '_');
+  return "/org/bluez/hci0/dev_" + address;
+}
+
+void SimulatedBluetooth::setDutyCycle() {
+  auto now = clock.now();
+  scanTime += std::chrono::duration_cast<std::chrono::nanoseconds>((now - dutySince) * dutyCycle);
+  dutySince = now;
+
+  dutyCycle = 0;
+  for(auto & [id, session] : sessions) dutyCycle = std::max(dutyCycle, session);
+}
+
+
+uint64_t SimulatedBluetooth::send(CommandType type, std::string path, std::chrono::milliseconds timeout, uint64_t flow) {
+  uint64_t id = nextId++;
+  if(type != CommandType::Verify) return id;
+
+  int key = -1;
+  for(int i = 0; i < keys.size(); i++) {
+    if(pathOf(i) == path) key = i;
+  }
+  if(key < 0) return id;
+
+  std::uniform_real_distribution<double> uniform(0, 1);
+  std::exponential_distribution<double> latency(1.0 / std::chrono::duration<double>(config.probeLatency).count());
+
+  //decided against where the key is when the probe goes out
+  bool answered = uniform(random) < (present[key] ? config.probeHit : config.falseSighting);
+
+  std::chrono::nanoseconds took = std::min<std::chrono::nanoseconds>(SIMULATED_PAGE_TIMEOUT, timeout);
+  if(answered) {
+    took = std::min<std::chrono::nanoseconds>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::duration<double>(latency(random))), timeout);
+  }
+
+  probes++;
+  probeTime += took;
+
+  auto at = clock.now() + took;
+  PresenceEvent result{id, path, keys[key].address, answered, (short) (answered ? SIMULATED_RSSI : 0)};
+  pending.emplace(at, Event{result, at, flow});
+
+  return id;
+}
+
+//the simulation only ever probes
+uint64_t SimulatedBluetooth::trust(std::string path, std::string alias, std::chrono::milliseconds timeout) {
+  return send(CommandType::Trust, path, timeout);
+}
+
+void SimulatedBluetooth::cancel(uint64_t id) {}
+
+bool SimulatedBluetooth::receive(Event & event) {
+  auto now = clock.now();
+
+  //device objects stay around after a phone leaves, only probes tell present from gone
+  if(now >= nextRefresh) {
+    std::vector<Device> devices;
+    for(int i = 0; i < keys.size(); i++) devices.push_back(Device(pathOf(i), keys[i].address, "public", 0));
+
+    event = Event{DevicesEvent{devices}, now, traceNewFlow()};
+    nextRefresh = now + PING_INTERVAL;
+    return true;
+  }
+
+  if(pending.empty() || pending.begin()->first > now) return false;
+
+  event = pending.begin()->second;
+  pending.erase(pending.begin());
+  return true;
+}
+
+uint64_t SimulatedBluetooth::startDiscovery(DiscoveryProfile profile) {
+  uint64_t session = nextId++;
+  sessions[session] = profile.dutyCycle;
+  setDutyCycle();
+  return session;
+}
+
+void SimulatedBluetooth::updateDiscovery(uint64_t session, DiscoveryProfile profile) {
+  auto existing = sessions.find(session);
+  if(existing == sessions.end()) return;
+
+  existing->second = profile.dutyCycle;
+  setDutyCycle();
+}
+
+void SimulatedBluetooth::stopDiscovery(uint64_t session) {
+  sessions.erase(session);
+  setDutyCycle();
+}
+
+int SimulatedBluetooth::getEventFd() {
+  return -1;
+}
+
+
+void SimulatedBluetooth::setPresent(int key, bool present) {
+  this->present[key] = present;
+}
+
+std::chrono::steady_clock::time_point SimulatedBluetooth::nextEventAt() {
+  if(pending.empty()) return nextRefresh;
+  return std::min(nextRefresh, pending.begin()->first);
+}
+
+uint64_t SimulatedBluetooth::getProbes() {
+  return probes;
+}
+
+std::chrono::nanoseconds SimulatedBluetooth::getProbeTime() {
+  return probeTime;
+}
+
+std::chrono::nanoseconds SimulatedBluetooth::getScanTime() {
+  setDutyCycle();
+  return scanTime;
+}
+
+
+static LatencySummary summarize(std::vector<double> & samples) {
+  if(samples.empty()) return LatencySummary{0, 0, 0, 0, 0};
+
+  std::sort(samples.begin(), samples.end());
+  auto at = [&](double fraction){ return samples[std::min<size_t>(samples.size() * fraction, samples.size() - 1)]; };
+
+  return LatencySummary{samples.size(), at(0.5), at(0.9), at(0.99), samples.back()};
+}
+
+SimulationReport simulate(const SimulationConfig & config) {
+  auto wallStart = std::chrono::steady_clock::now();
+
+  SimulationReport report{};
+  report.days = config.days;
+  report.keys = config.keys;
+
+  std::mt19937 random(config.seed);
+  std::vector<ScriptedChange> changes = config.script.empty() ? generateRoutine(config, random) : config.script;
+
+  std::vector<Key> keys;
+  for(int i = 0; i < config.keys; i++) {
+    char address[18];
+    snprintf(address, sizeof(address), "00:00:00:00:%02X:%02X", (i >> 8) & 0xFF, i & 0xFF);
+    keys.push_back(Key{address});
+  }
+
+  VirtualClock clock;
+  auto start = clock.now();
+  auto end = start + std::chrono::hours(24 * config.days);
+
+  SimulatedBluetooth bluetooth(clock, keys, config, random);
+  std::vector<double> onLatency;
+  std::vector<double> offLatency;
+
+  {
+    BluezSource source(bluetooth, keys, clock);
+    PresenceEngine engine({source.getWeight()}, keys.size());
+
+    std::vector<bool> truth(keys.size(), false);
+    int home = 0;
+    size_t nextChange = 0;
+
+    bool occupied = false;
+    bool lightsOn = false;
+    //set while an arrival is waiting on the lights, or a departure on them going off
+    bool awaitingOn = false;
+    bool awaitingOff = false;
+    std::chrono::steady_clock::time_point changedAt;
+    auto lastStep = start;
+
+    std::vector<Observation> observations;
+
+    while(true) {
+      auto now = clock.now();
+
+      double elapsed = std::chrono::duration<double>(now - lastStep).count();
+      if(occupied) report.occupiedSeconds += elapsed;
+      if(occupied && !lightsOn) report.darkOccupiedSeconds += elapsed;
+      if(!occupied && lightsOn) report.litEmptySeconds += elapsed;
+      lastStep = now;
+
+      if(now >= end) break;
+
+      for(; nextChange < changes.size() && start + changes[nextChange].at <= now; nextChange++) {
+        ScriptedChange & change = changes[nextChange];
+        if(change.key >= keys.size() || truth[change.key] == change.present) continue;
+
+        truth[change.key] = change.present;
+        bluetooth.setPresent(change.key, change.present);
+        home += change.present ? 1 : -1;
+      }
+
+      if((home > 0) != occupied) {
+        occupied = home > 0;
+        changedAt = now;
+
+        if(occupied) {
+          report.visits++;
+          awaitingOn = !lightsOn;
+          awaitingOff = false;
+        } else {
+          if(awaitingOn) report.missed++;
+          awaitingOn = false;
+          awaitingOff = lightsOn;
+        }
+      }
+
+      observations.clear();
+      int timer = source.update(observations);
+
+      for(Observation & observation : observations) engine.observe(0, observation);
+      engine.decide();
+
+      //same rule as the daemon, any key present keeps the lights on
+      if(engine.anyPresent() != lightsOn) {
+        lightsOn = !lightsOn;
+        double latency = std::chrono::duration<double>(now - changedAt).count();
+
+        if(lightsOn) {
+          report.lightsOn++;
+          if(!occupied) report.falseOn++;
+          else if(awaitingOn) onLatency.push_back(latency);
+          awaitingOn = false;
+        } else {
+          report.lightsOff++;
+          if(occupied) report.falseOff++;
+          else if(awaitingOff) offLatency.push_back(latency);
+          awaitingOff = false;
+        }
+      }
+
+      //jump straight to whatever happens next
+      auto next = std::min(end, bluetooth.nextEventAt());
+      if(timer >= 0) next = std::min(next, now + std::chrono::milliseconds(timer));
+      if(nextChange < changes.size()) next = std::min(next, start + changes[nextChange].at);
+
+      clock.advanceTo(next);
+    }
+  }
+
+  report.onLatency = summarize(onLatency);
+  report.offLatency = summarize(offLatency);
+  report.probes = bluetooth.getProbes();
+  report.probeSeconds = std::chrono::duration<double>(bluetooth.getProbeTime()).count();
+  report.scanSeconds = std::chrono::duration<double>(bluetooth.getScanTime()).count();
+  report.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+  return report;
+}
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "sources.hpp"
+
+#include <random>
+#include <map>
+#include <optional>
+
+//an absent phone never answers the page, BlueZ gives up on the connect after about this long
+constexpr auto SIMULATED_PAGE_TIMEOUT = std::chrono::milliseconds(5120);
+#define SIMULATED_RSSI -65
+
+struct ScriptedChange {
+  //from the start of the run
+  std::chrono::seconds at;
+  int key;
+  bool present;
+};
+
+//one line per setting, like the led file: "days 7", "keys 2", "seed 1", "probe_hit 0.95",
+//"false_sighting 0.002", "probe_latency <ms>", and "at <day> <HH:MM> <key> arrive|depart" for a
+//scripted scenario, which then has as many keys as it names. without any at lines every key gets
+//a randomly generated routine
+struct SimulationConfig {
+  int days = 7;
+  int keys = 2;
+  uint32_t seed = 1;
+  //chance a probe to a key that is home gets answered
+  float probeHit = 0.95f;
+  //chance a probe to a key that is away gets answered anyway
+  float falseSighting = 0.002f;
+  //mean time a phone that is home takes to answer
+  std::chrono::milliseconds probeLatency = std::chrono::milliseconds(1500);
+  std::vector<ScriptedChange> script;
+};
+
+std::optional<SimulationConfig> loadSimulationConfig(const std::string & path);
+
+//every key starts the run at home: weekday commutes with the odd evening errand, weekend outings
+std::vector<ScriptedChange> generateRoutine(const SimulationConfig & config, std::mt19937 & random);
+
+
+//stands in for the bluetooth thread on a virtual clock: publishes a device table every
+//PING_INTERVAL and answers probes from the scenario instead of a radio
+class SimulatedBluetooth : public BluetoothLink {
+  VirtualClock & clock;
+  const SimulationConfig & config;
+  std::mt19937 & random;
+
+  std::vector<Key> keys;
+  std::vector<bool> present;
+
+  std::multimap<std::chrono::steady_clock::time_point, Event> pending;
+  std::chrono::steady_clock::time_point nextRefresh;
+  uint64_t nextId;
+
+  std::map<uint64_t, float> sessions;
+  //merged the way DiscoveryManager does, the busiest session sets the duty cycle
+  float dutyCycle;
+  std::chrono::steady_clock::time_point dutySince;
+
+  uint64_t probes;
+  std::chrono::nanoseconds probeTime;
+  std::chrono::nanoseconds scanTime;
+
+  std::string pathOf(int key);
+  void setDutyCycle();
+
+public:
+  SimulatedBluetooth(VirtualClock & clock, const std::vector<Key> & keys, const SimulationConfig & config, std::mt19937 & random);
+
+  uint64_t send(CommandType type, std::string path = "", std::chrono::milliseconds timeout = DEFAULT_COMMAND_TIMEOUT, uint64_t flow = 0) override;
+  uint64_t trust(std::string path, std::string alias, std::chrono::milliseconds timeout) override;
+  void cancel(uint64_t id) override;
+  bool receive(Event & event) override;
+
+  uint64_t startDiscovery(DiscoveryProfile profile) override;
+  void updateDiscovery(uint64_t session, DiscoveryProfile profile) override;
+  void stopDiscovery(uint64_t session) override;
+
+  int getEventFd() override;
+
+  void setPresent(int key, bool present);
+  //when receive next has something, the run never has to look in between
+  std::chrono::steady_clock::time_point nextEventAt();
+
+  uint64_t getProbes();
+  std::chrono::nanoseconds getProbeTime();
+  std::chrono::nanoseconds getScanTime();
+};
+
+
+struct LatencySummary {
+  size_t count;
+  double p50;
+  double p90;
+  double p99;
+  double max;
+};
+
+struct SimulationReport {
+  int days;
+  int keys;
+  //spells of the house being occupied, and those that ended before the lights came on
+  int visits;
+  int missed;
+  int lightsOn;
+  //lights turned on with nobody home
+  int falseOn;
+  int lightsOff;
+  //lights turned off with someone home
+  int falseOff;
+  //seconds from the first arrival to lights on, and from the last departure to lights off
+  LatencySummary onLatency;
+  LatencySummary offLatency;
+  double occupiedSeconds;
+  double darkOccupiedSeconds;
+  double litEmptySeconds;
+  uint64_t probes;
+  double probeSeconds;
+  double scanSeconds;
+  double wallSeconds;
+};
+
+//runs the real BluezSource and PresenceEngine over the scenario in virtual time
+SimulationReport simulate(const SimulationConfig & config);
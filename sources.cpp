@@ -0,0 +1,253 @@
+#include "sources.hpp"
+
+#include <cmath>
+
+
+PresenceFusion::PresenceFusion(std::vector<float> weights, size_t keys) {
+  this->weights = weights;
+  levels.assign(weights.size(), std::vector<float>(keys, 0.0f));
+}
+
+void PresenceFusion::observe(int source, const Observation & observation) {
+  if(observation.key < 0 || observation.key >= levels[source].size()) return;
+  levels[source][observation.key] = std::clamp(observation.level, 0.0f, 1.0f);
+}
+
+float PresenceFusion::confidence(int key) {
+  float absent = 1.0f;
+  for(int i = 0; i < weights.size(); i++) absent *= 1.0f - weights[i] * levels[i][key];
+  return 1.0f - absent;
+}
+
+
+PresenceEngine::PresenceEngine(std::vector<float> weights, size_t keys) : fusion(weights, keys) {
+  keyPresent.assign(keys, false);
+  keyRssi.assign(keys, 0);
+  keyFlow.assign(keys, 0);
+}
+
+void PresenceEngine::observe(int source, const Observation & observation) {
+  fusion.observe(source, observation);
+  if(observation.key < 0 || observation.key >= keyPresent.size()) return;
+
+  if(observation.rssi) keyRssi[observation.key] = observation.rssi;
+  if(observation.flow) keyFlow[observation.key] = observation.flow;
+}
+
+std::vector<PresenceTransition> PresenceEngine::decide() {
+  std::vector<PresenceTransition> retval;
+
+  for(int i = 0; i < keyPresent.size(); i++) {
+    float confidence = fusion.confidence(i);
+    bool present = keyPresent[i] ? confidence >= PRESENCE_DEPART : confidence >= PRESENCE_ARRIVE;
+    if(present == keyPresent[i]) continue;
+
+    keyPresent[i] = present;
+    retval.push_back(PresenceTransition{i, present, keyRssi[i], keyFlow[i]});
+  }
+
+  return retval;
+}
+
+bool PresenceEngine::isPresent(int key) {
+  return keyPresent[key];
+}
+
+bool PresenceEngine::anyPresent() {
+  return std::find(keyPresent.begin(), keyPresent.end(), true) != keyPresent.end();
+}
+
+
+std::vector<KeyMatch> matchKeys(std::vector<Device> & devices, std::vector<Key> & keys, RpaResolver & resolver) {
+  std::vector<KeyMatch> retval;
+
+  //the resolver holds the IRKs in key order, so its indices map back through this
+  std::vector<int> irkOwners;
+
+  for(int i = 0; i < keys.size(); i++) {
+    if(keys[i].irk) irkOwners.push_back(i);
+
+    std::string address = keys[i].address;
+    auto foundDevice = std::find_if(devices.begin(), devices.end(), [address](Device d){
+      return d.getAddress() == address;
+    });
+
+    if(foundDevice != devices.end()) retval.push_back(KeyMatch{*foundDevice, i, false});
+  }
+
+  if(resolver.size() == 0) return retval;
+
+  std::vector<BdAddr> randomAddresses;
+  std::vector<Device*> randomDevices;
+
+  for(Device & device : devices) {
+    if(!device.isRandomAddress()) continue;
+    auto address = parseAddress(device.getAddress());
+    if(!address) continue;
+    randomAddresses.push_back(*address);
+    randomDevices.push_back(&device);
+  }
+
+  std::vector<int> resolved = resolver.resolveBatch(randomAddresses);
+
+  for(int i = 0; i < resolved.size(); i++) {
+    if(resolved[i] >= 0) retval.push_back(KeyMatch{*randomDevices[i], irkOwners[resolved[i]], true});
+  }
+
+  return retval;
+}
+
+
+BluezSource::BluezSource(BluetoothLink & bluetooth, const std::vector<Key> & keys, Clock & clock) : bluetooth(bluetooth), clock(clock) {
+  this->keys = keys;
+
+  std::vector<Irk> irks;
+  for(const Key & key : keys) {
+    if(key.irk) irks.push_back(*key.irk);
+  }
+  resolver.setIrks(irks);
+
+  roundPresence.assign(keys.size(), 0);
+  roundRssi.assign(keys.size(), 0);
+  reported.assign(keys.size(), 0);
+  missedRounds.assign(keys.size(), BLUEZ_DEPART_ROUNDS);
+
+  devicesFlow = 0;
+  roundFlow = 0;
+  probing = false;
+  nextPing = clock.now() + PING_INTERVAL;
+
+  //presence keys only advertise over LE, and repeated reports of unchanged data are just bus noise
+  discovery = DiscoveryProfile{DiscoveryFilter{"le", DISCOVERY_RSSI_FLOOR, {}, false}, 1.0f};
+  discoverySession = bluetooth.startDiscovery(discovery);
+  stableRounds = 0;
+}
+
+BluezSource::~BluezSource() {
+  bluetooth.stopDiscovery(discoverySession);
+}
+
+const char * BluezSource::getName() {
+  return "bluez";
+}
+
+float BluezSource::getWeight() {
+  return BLUEZ_WEIGHT;
+}
+
+int BluezSource::getFd() {
+  return bluetooth.getEventFd();
+}
+
+
+void BluezSource::startRound() {
+  roundFlow = devicesFlow;
+  TraceSpan span("round started", roundFlow);
+
+  nextPing = clock.now() + PING_INTERVAL;
+  roundDeadline = clock.now() + PROBE_TIMEOUT + PROBE_RESULT_MARGIN;
+
+  probing = true;
+  pendingProbes.clear();
+
+  std::vector<KeyMatch> matches = matchKeys(devices, keys, resolver);
+
+  //keys without a device in the table are gone, matched ones stay unknown until shown otherwise
+  std::fill(roundPresence.begin(), roundPresence.end(), 0);
+  for(KeyMatch & match : matches) roundPresence[match.key] = -1;
+
+  //an RSSI on a resolved private address means BlueZ saw an advertisement recently
+  for(KeyMatch & match : matches) {
+    if(match.resolved && match.device.getRSSI() != 0) {
+      roundPresence[match.key] = 1;
+      roundRssi[match.key] = match.device.getRSSI();
+    }
+  }
+
+  //presence is tracked per key, so every key its private address didn't already vouch for gets probed
+  for(KeyMatch & match : matches) {
+    if(roundPresence[match.key] == 1) continue;
+
+    uint64_t id = bluetooth.send(CommandType::Verify, match.device.getPath(), PROBE_TIMEOUT, roundFlow);
+    if(id) pendingProbes[id] = match.key;
+  }
+}
+
+void BluezSource::finishRound(std::vector<Observation> & observations) {
+  TraceSpan span("round finished", roundFlow);
+  probing = false;
+
+  bool changed = false;
+  bool settled = true;
+
+  //keys skipped this round keep whatever this source last said about them
+  for(int i = 0; i < keys.size(); i++) {
+    if(roundPresence[i] < 0) {
+      settled = false;
+      continue;
+    }
+
+    if(roundPresence[i] != reported[i]) changed = true;
+    reported[i] = roundPresence[i];
+
+    missedRounds[i] = roundPresence[i] ? 0 : std::min(missedRounds[i] + 1, BLUEZ_DEPART_ROUNDS);
+    float level = 1.0f - (float) missedRounds[i] / BLUEZ_DEPART_ROUNDS;
+
+    observations.push_back(Observation{i, level, roundPresence[i] ? roundRssi[i] : (int16_t) 0, roundFlow});
+  }
+
+  //a round that skipped some keys says nothing new either way
+  if(changed) stableRounds = 0;
+  else if(settled) stableRounds++;
+
+  float dutyCycle = DISCOVERY_MIN_DUTY + (1.0f - DISCOVERY_MIN_DUTY) / (1 + stableRounds);
+  if(std::abs(dutyCycle - discovery.dutyCycle) > 0.01f) {
+    discovery.dutyCycle = dutyCycle;
+    bluetooth.updateDiscovery(discoverySession, discovery);
+  }
+}
+
+int BluezSource::update(std::vector<Observation> & observations) {
+  Event event;
+  while(bluetooth.receive(event)) {
+    if(auto update = std::get_if<DevicesEvent>(&event.payload)) {
+      TraceSpan span("devices received", event.flow);
+      devices = update->devices;
+      devicesFlow = event.flow;
+    } else if(std::get_if<ReprobeEvent>(&event.payload)) {
+      //a round already underway answers it just as well
+      if(!probing) nextPing = clock.now();
+    } else if(auto presence = std::get_if<PresenceEvent>(&event.payload)) {
+      auto probe = pendingProbes.find(presence->id);
+      if(probe == pendingProbes.end()) continue;
+      int key = probe->second;
+      pendingProbes.erase(probe);
+
+      TraceSpan span("probe result", event.flow);
+
+      if(presence->present) {
+        roundPresence[key] = 1;
+        roundRssi[key] = presence->rssi;
+      } else if(roundPresence[key] != 1) {
+        roundPresence[key] = 0;
+      }
+    }
+  }
+
+  auto now = clock.now();
+  if(!probing && now >= nextPing) startRound();
+
+  //a result lost to a full event ring must not hold the round open forever
+  if(probing && now >= roundDeadline) {
+    for(auto & probe : pendingProbes) {
+      if(roundPresence[probe.second] != 1) roundPresence[probe.second] = 0;
+    }
+    pendingProbes.clear();
+  }
+
+  if(probing && pendingProbes.empty()) finishRound(observations);
+
+  //probe answers come in over the fd, the timer only covers the ones that never do
+  if(probing) return std::max<long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(roundDeadline - now).count() + 1);
+  return std::max<long>(0, std::chrono::duration_cast<std::chrono::milliseconds>(nextPing - now).count() + 1);
+}
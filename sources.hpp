@@ -0,0 +1,163 @@
+#pragma once
+
+#include "iothread.hpp"
+#include "keys.hpp"
+#include "rpa.hpp"
+#include "clock.hpp"
+#include "trace.hpp"
+
+#include <vector>
+#include <unordered_map>
+#include <chrono>
+
+constexpr auto PING_INTERVAL = std::chrono::seconds(10);
+constexpr auto PROBE_TIMEOUT = std::chrono::seconds(8);
+//the bluetooth thread answers every probe by its deadline, but its event ring drops results when
+//full, so a round still waiting this long after PROBE_TIMEOUT counts the missing ones as missed
+constexpr auto PROBE_RESULT_MARGIN = std::chrono::seconds(1);
+//the BlueZ source never scans less than this share of the time, however settled presence looks
+#define DISCOVERY_MIN_DUTY 0.1f
+//weaker than this is another room at best
+#define DISCOVERY_RSSI_FLOOR -90
+
+//a resolved advertisement or an answered probe is about as sure as presence gets
+#define BLUEZ_WEIGHT 0.95f
+//a phone that is home still misses the odd probe, so a missed key fades out over this many rounds
+//instead of leaving at once. on its own it departs once BLUEZ_WEIGHT times its level falls under
+//PRESENCE_DEPART
+#define BLUEZ_DEPART_ROUNDS 6
+
+//fused confidence a key has to reach to arrive, and fall below to leave. the gap keeps a key
+//that only one weak source still vouches for from flapping
+#define PRESENCE_ARRIVE 0.6f
+#define PRESENCE_DEPART 0.4f
+
+//what one source currently believes about one key
+struct Observation {
+  int key;
+  //0 when the source thinks the key is gone, 1 for the strongest sighting it can make
+  float level;
+  //0 when the source has no signal strength
+  int16_t rssi;
+  //trace flow that led here
+  uint64_t flow = 0;
+};
+
+//something that can tell whether a key's owner is around. the daemon polls every source's fd,
+//calls update when it is readable or its timer runs out, and fuses what comes back
+class PresenceSource {
+public:
+  virtual ~PresenceSource() = default;
+
+  virtual const char * getName() = 0;
+  //how far a full strength sighting from this source is trusted, 0 to 1
+  virtual float getWeight() = 0;
+  //readable whenever update has something to handle
+  virtual int getFd() = 0;
+  //handles whatever is ready and appends what it learned, returns ms until it has to run
+  //again even if its fd stays quiet, -1 if only the fd matters
+  virtual int update(std::vector<Observation> & observations) = 0;
+};
+
+
+//noisy-OR over the sources: each one's latest word stands until it says otherwise, and sources
+//are taken as independent, so two middling sightings add up to more than either
+class PresenceFusion {
+  std::vector<float> weights;
+  //[source][key]
+  std::vector<std::vector<float>> levels;
+
+public:
+  PresenceFusion(std::vector<float> weights, size_t keys);
+
+  void observe(int source, const Observation & observation);
+  float confidence(int key);
+};
+
+
+struct PresenceTransition {
+  int key;
+  bool present;
+  //the last signal strength any source reported for the key
+  short rssi;
+  //trace flow of the observation that tipped it
+  uint64_t flow;
+};
+
+//fusion plus the arrive/depart hysteresis, with no I/O of its own: the daemon and the simulation
+//both feed it observations and act on the transitions it hands back
+class PresenceEngine {
+  PresenceFusion fusion;
+  std::vector<bool> keyPresent;
+  std::vector<short> keyRssi;
+  //the flow behind each key's latest observation, so a transition can be traced back to it
+  std::vector<uint64_t> keyFlow;
+
+public:
+  PresenceEngine(std::vector<float> weights, size_t keys);
+
+  void observe(int source, const Observation & observation);
+  //keys that crossed a threshold since the last call
+  std::vector<PresenceTransition> decide();
+
+  bool isPresent(int key);
+  bool anyPresent();
+};
+
+
+struct KeyMatch {
+  Device device;
+  //index into the keys the match was made against
+  int key;
+  bool resolved;
+};
+
+//devices belonging to a key, either by their stored address or by resolving a private address against the IRKs
+std::vector<KeyMatch> matchKeys(std::vector<Device> & devices, std::vector<Key> & keys, RpaResolver & resolver);
+
+
+//rounds every PING_INTERVAL: keys whose resolved private address shows a fresh RSSI are present,
+//otherwise the matched devices are probed. scanning winds down while rounds keep agreeing
+class BluezSource : public PresenceSource {
+  BluetoothLink & bluetooth;
+  Clock & clock;
+  std::vector<Key> keys;
+  RpaResolver resolver;
+
+  std::vector<Device> devices;
+  uint64_t devicesFlow;
+  //the flow of the table the current round started from, probes and results carry it on
+  uint64_t roundFlow;
+  //probe id to the key it is checking
+  std::unordered_map<uint64_t, int> pendingProbes;
+
+  //per key for the current round: -1 unknown, 0 absent, 1 present
+  std::vector<int> roundPresence;
+  std::vector<short> roundRssi;
+  //what the last finished round said about each key
+  std::vector<int> reported;
+  //rounds in a row each key has been missed, up to BLUEZ_DEPART_ROUNDS
+  std::vector<int> missedRounds;
+
+  bool probing;
+  std::chrono::steady_clock::time_point nextPing;
+  //when the current round stops waiting for probe results
+  std::chrono::steady_clock::time_point roundDeadline;
+
+  DiscoveryProfile discovery;
+  uint64_t discoverySession;
+  //rounds in a row without a key coming or going, the longer presence holds still the less we scan
+  int stableRounds;
+
+  void startRound();
+  void finishRound(std::vector<Observation> & observations);
+
+public:
+  BluezSource(BluetoothLink & bluetooth, const std::vector<Key> & keys, Clock & clock);
+  ~BluezSource();
+
+  const char * getName() override;
+  float getWeight() override;
+  int getFd() override;
+  int update(std::vector<Observation> & observations) override;
+};
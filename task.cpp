@@ -0,0 +1,259 @@
+#include "task.hpp"
+
+
+TaskStats & taskStats() {
+  static thread_local TaskStats stats{0, 0, 0};
+  return stats;
+}
+
+
+CancelToken CancelToken::create() {
+  CancelToken retval;
+  retval.state = std::make_shared<State>();
+  return retval;
+}
+
+void CancelToken::cancel() {
+  if(!state || state->cancelled) return;
+  state->cancelled = true;
+
+  if(state->onCancel) {
+    auto callback = std::move(state->onCancel);
+    state->onCancel = nullptr;
+    callback();
+  }
+}
+
+bool CancelToken::isCancelled() {
+  return state && state->cancelled;
+}
+
+void CancelToken::setCallback(std::function<void()> callback) {
+  if(state) state->onCancel = callback;
+}
+
+void CancelToken::clearCallback() {
+  if(state) state->onCancel = nullptr;
+}
+
+
+static thread_local Scheduler * currentScheduler = nullptr;
+
+Scheduler::Scheduler() {
+  nextTimerId = 1;
+}
+
+Scheduler::~Scheduler() {
+  ready.clear();
+
+  //destroying a frame unwinds its awaiters, which cancel their pending calls and timers
+  std::unordered_set<void*> remaining;
+  std::swap(remaining, spawned);
+  for(void * frame : remaining) std::coroutine_handle<>::from_address(frame).destroy();
+
+  if(currentScheduler == this) currentScheduler = nullptr;
+}
+
+
+Scheduler * Scheduler::current() {
+  return currentScheduler;
+}
+
+void Scheduler::makeCurrent() {
+  currentScheduler = this;
+}
+
+
+void Scheduler::schedule(std::coroutine_handle<> handle) {
+  ready.push_back(handle);
+}
+
+void Scheduler::spawn(Task<void> task) {
+  auto handle = task.release();
+  handle.promise().scheduler = this;
+  spawned.insert(handle.address());
+  schedule(handle);
+}
+
+void Scheduler::forget(void * frame) {
+  spawned.erase(frame);
+}
+
+size_t Scheduler::spawnedCount() {
+  return spawned.size();
+}
+
+
+uint64_t Scheduler::addTimer(Deadline at, std::function<void()> callback) {
+  uint64_t id = nextTimerId++;
+  timers.push(Timer{at, id, callback});
+  return id;
+}
+
+void Scheduler::cancelTimer(uint64_t id) {
+  cancelledTimers.insert(id);
+}
+
+
+void Scheduler::run() {
+  auto now = std::chrono::steady_clock::now();
+
+  while(!timers.empty() && timers.top().at <= now) {
+    Timer timer = timers.top();
+    timers.pop();
+
+    if(cancelledTimers.erase(timer.id)) continue;
+    timer.callback();
+  }
+
+  //handles scheduled while running wait for the next call, so one busy task can't starve the bus
+  size_t count = ready.size();
+  for(size_t i = 0; i < count; i++) {
+    auto handle = ready.front();
+    ready.pop_front();
+    handle.resume();
+  }
+
+  //cancelled timers at the top are dead weight, drop them so nextTimeoutMs sees a live one
+  while(!timers.empty() && cancelledTimers.count(timers.top().id)) {
+    cancelledTimers.erase(timers.top().id);
+    timers.pop();
+  }
+}
+
+int Scheduler::nextTimeoutMs(int maxMs) {
+  if(!ready.empty()) return 0;
+  if(timers.empty()) return maxMs;
+
+  auto until = std::chrono::duration_cast<std::chrono::milliseconds>(timers.top().at - std::chrono::steady_clock::now()).count();
+  if(until < 0) return 0;
+  //round up so a timer is never polled for a moment too early
+  return std::min<long>(until + 1, maxMs);
+}
+
+
+void Scheduler::SleepAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  Scheduler * owner = scheduler;
+  scheduler->addTimer(at, [owner, handle](){ owner->schedule(handle); });
+}
+
+Scheduler::SleepAwaiter Scheduler::sleepUntil(Deadline at) {
+  return SleepAwaiter{this, at};
+}
+
+
+Reply::Reply(Reply && other) {
+  message = other.message;
+  error = std::move(other.error);
+  other.message = nullptr;
+}
+
+Reply& Reply::operator=(Reply && other) {
+  if(this != &other) {
+    if(message) dbus_message_unref(message);
+    message = other.message;
+    error = std::move(other.error);
+    other.message = nullptr;
+  }
+  return *this;
+}
+
+Reply::~Reply() {
+  if(message) dbus_message_unref(message);
+}
+
+bool Reply::ok() {
+  return message && error.empty();
+}
+
+
+CallAwaiter::CallAwaiter(DBusConnection * connection, DBusMessage * message, Deadline deadline, CancelToken cancel) {
+  this->connection = connection;
+  this->message = message;
+  this->deadline = deadline;
+  this->cancel = cancel;
+
+  pending = nullptr;
+  timer = 0;
+  done = false;
+}
+
+CallAwaiter::~CallAwaiter() {
+  //only reached unfinished when the owning frame is destroyed mid-call
+  if(pending) {
+    dbus_pending_call_cancel(pending);
+    dbus_pending_call_unref(pending);
+  }
+  if(timer && Scheduler::current()) Scheduler::current()->cancelTimer(timer);
+  if(!done) cancel.clearCallback();
+  if(message) dbus_message_unref(message);
+}
+
+
+bool CallAwaiter::await_ready() {
+  if(cancel.isCancelled()) reply.error = ERROR_CANCELLED;
+  else if(!connection) reply.error = ERROR_DISCONNECTED;
+  else return false;
+
+  done = true;
+  return true;
+}
+
+void CallAwaiter::await_suspend(std::coroutine_handle<> handle) {
+  this->handle = handle;
+
+  if(!dbus_connection_send_with_reply(connection, message, &pending, DBUS_TIMEOUT_INFINITE) || !pending) {
+    pending = nullptr;
+    finish(ERROR_DISCONNECTED);
+    return;
+  }
+
+  dbus_pending_call_set_notify(pending, notify, this, nullptr);
+
+  timer = Scheduler::current()->addTimer(deadline, [this](){
+    timer = 0;
+    finish(ERROR_TIMEOUT);
+  });
+  cancel.setCallback([this](){ finish(ERROR_CANCELLED); });
+}
+
+Reply CallAwaiter::await_resume() {
+  return std::move(reply);
+}
+
+
+void CallAwaiter::notify(DBusPendingCall * pending, void * data) {
+  CallAwaiter * awaiter = static_cast<CallAwaiter*>(data);
+
+  DBusMessage * message = dbus_pending_call_steal_reply(pending);
+  awaiter->reply.message = message;
+
+  if(message && dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_ERROR) {
+    awaiter->reply.error = dbus_message_get_error_name(message);
+  }
+
+  awaiter->finish(message ? nullptr : ERROR_DISCONNECTED);
+}
+
+void CallAwaiter::finish(const char * error) {
+  if(done) return;
+  done = true;
+
+  if(error) reply.error = error;
+
+  if(pending) {
+    //a no-op when the reply already arrived, otherwise stops notify from firing later
+    dbus_pending_call_cancel(pending);
+    dbus_pending_call_unref(pending);
+    pending = nullptr;
+  }
+
+  if(timer) {
+    Scheduler::current()->cancelTimer(timer);
+    timer = 0;
+  }
+
+  cancel.clearCallback();
+
+  Scheduler::current()->schedule(handle);
+}
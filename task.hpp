@@ -0,0 +1,258 @@
+#pragma once
+
+#include <dbus/dbus.h>
+
+#include <coroutine>
+#include <optional>
+#include <functional>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <queue>
+#include <unordered_set>
+#include <string>
+#include <chrono>
+#include <cstdlib>
+
+#define ERROR_TIMEOUT "org.bluelight.Error.Timeout"
+#define ERROR_CANCELLED "org.bluelight.Error.Cancelled"
+#define ERROR_DISCONNECTED "org.freedesktop.DBus.Error.Disconnected"
+
+typedef std::chrono::steady_clock::time_point Deadline;
+
+
+//frame accounting, every task frame is allocated on the thread running the scheduler
+struct TaskStats {
+  size_t live;
+  size_t bytes;
+  size_t peakBytes;
+};
+
+TaskStats & taskStats();
+
+
+template<typename T> class Task;
+class Scheduler;
+
+struct TaskPromiseBase {
+  std::coroutine_handle<> continuation;
+  //set for spawned tasks, which have nobody to await them and clean up after themselves
+  Scheduler * scheduler = nullptr;
+
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    template<typename Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+      if(handle.promise().continuation) return handle.promise().continuation;
+      if(handle.promise().scheduler) {
+        handle.promise().scheduler->forget(handle.address());
+        handle.destroy();
+      }
+      return std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  std::suspend_always initial_suspend() noexcept { return {}; }
+  FinalAwaiter final_suspend() noexcept { return {}; }
+  void unhandled_exception() { std::abort(); }
+
+  static void * operator new(size_t size) {
+    TaskStats & stats = taskStats();
+    stats.live++;
+    stats.bytes += size;
+    if(stats.bytes > stats.peakBytes) stats.peakBytes = stats.bytes;
+    return ::operator new(size);
+  }
+
+  static void operator delete(void * memory, size_t size) {
+    TaskStats & stats = taskStats();
+    stats.live--;
+    stats.bytes -= size;
+    ::operator delete(memory);
+  }
+};
+
+template<typename T>
+struct TaskPromise : TaskPromiseBase {
+  std::optional<T> value;
+
+  Task<T> get_return_object();
+  void return_value(T result) { value = std::move(result); }
+};
+
+template<>
+struct TaskPromise<void> : TaskPromiseBase {
+  Task<void> get_return_object();
+  void return_void() {}
+};
+
+
+//lazily started coroutine. awaiting it runs it to completion and resumes the awaiter by symmetric transfer
+template<typename T = void>
+class Task {
+public:
+  typedef TaskPromise<T> promise_type;
+
+private:
+  std::coroutine_handle<promise_type> handle;
+
+public:
+  explicit Task(std::coroutine_handle<promise_type> handle) : handle(handle) {}
+  Task(Task && other) : handle(other.handle) { other.handle = nullptr; }
+  Task(const Task&) = delete;
+  Task& operator=(const Task&) = delete;
+
+  ~Task() {
+    if(handle) handle.destroy();
+  }
+
+  bool await_ready() { return false; }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) {
+    handle.promise().continuation = awaiting;
+    return handle;
+  }
+
+  T await_resume() {
+    if constexpr(!std::is_void_v<T>) return std::move(*handle.promise().value);
+  }
+
+  std::coroutine_handle<promise_type> release() {
+    auto retval = handle;
+    handle = nullptr;
+    return retval;
+  }
+};
+
+template<typename T>
+Task<T> TaskPromise<T>::get_return_object() {
+  return Task<T>(std::coroutine_handle<TaskPromise<T>>::from_promise(*this));
+}
+
+inline Task<void> TaskPromise<void>::get_return_object() {
+  return Task<void>(std::coroutine_handle<TaskPromise<void>>::from_promise(*this));
+}
+
+
+//a default constructed token can never be cancelled and costs no allocation
+class CancelToken {
+  struct State {
+    bool cancelled = false;
+    std::function<void()> onCancel;
+  };
+
+  std::shared_ptr<State> state;
+
+public:
+  static CancelToken create();
+
+  void cancel();
+  bool isCancelled();
+
+  //the awaiter currently suspended on behalf of the token's task
+  void setCallback(std::function<void()> callback);
+  void clearCallback();
+};
+
+
+//single threaded run loop for tasks. the owning thread drives it between bus polls, so
+//every resume happens on that thread and never from inside libdbus dispatch
+class Scheduler {
+  struct Timer {
+    Deadline at;
+    uint64_t id;
+    std::function<void()> callback;
+
+    bool operator>(const Timer & other) const { return at > other.at; }
+  };
+
+  std::deque<std::coroutine_handle<>> ready;
+  std::priority_queue<Timer, std::vector<Timer>, std::greater<Timer>> timers;
+  std::unordered_set<uint64_t> cancelledTimers;
+  std::unordered_set<void*> spawned;
+
+  uint64_t nextTimerId;
+
+public:
+  Scheduler();
+  ~Scheduler();
+
+  Scheduler(const Scheduler&) = delete;
+  Scheduler& operator=(const Scheduler&) = delete;
+
+  static Scheduler * current();
+  void makeCurrent();
+
+  void schedule(std::coroutine_handle<> handle);
+  void spawn(Task<void> task);
+  void forget(void * frame);
+  size_t spawnedCount();
+
+  uint64_t addTimer(Deadline at, std::function<void()> callback);
+  void cancelTimer(uint64_t id);
+
+  //runs everything that is ready or due, then returns
+  void run();
+  //how long the owner may block before run() has work, capped at maxMs
+  int nextTimeoutMs(int maxMs);
+
+  struct SleepAwaiter {
+    Scheduler * scheduler;
+    Deadline at;
+
+    bool await_ready() { return std::chrono::steady_clock::now() >= at; }
+    void await_suspend(std::coroutine_handle<> handle);
+    void await_resume() {}
+  };
+
+  SleepAwaiter sleepUntil(Deadline at);
+};
+
+
+//owns a reply message. error holds the D-Bus error name, or a local one for timeouts and cancellation
+struct Reply {
+  DBusMessage * message = nullptr;
+  std::string error;
+
+  Reply() {}
+  Reply(Reply && other);
+  Reply& operator=(Reply && other);
+  Reply(const Reply&) = delete;
+  ~Reply();
+
+  bool ok();
+};
+
+
+//sends a method call and suspends until the reply, the deadline or a cancellation.
+//timeouts are enforced by the scheduler, libdbus only ever sees an infinite timeout
+class CallAwaiter {
+  DBusConnection * connection;
+  DBusMessage * message;
+  Deadline deadline;
+  CancelToken cancel;
+
+  DBusPendingCall * pending;
+  std::coroutine_handle<> handle;
+  uint64_t timer;
+  bool done;
+
+  Reply reply;
+
+  static void notify(DBusPendingCall * pending, void * data);
+  void finish(const char * error);
+
+public:
+  //takes ownership of message
+  CallAwaiter(DBusConnection * connection, DBusMessage * message, Deadline deadline, CancelToken cancel);
+  ~CallAwaiter();
+
+  CallAwaiter(const CallAwaiter&) = delete;
+
+  bool await_ready();
+  void await_suspend(std::coroutine_handle<> handle);
+  Reply await_resume();
+};
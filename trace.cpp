@@ -0,0 +1,209 @@
+#include "trace.hpp"
+
+#ifdef TRACE
+
+#include <sys/syscall.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <array>
+#include <vector>
+#include <map>
+#include <mutex>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+
+
+struct TraceRecord {
+  int64_t startNs;
+  int64_t endNs;
+  const char * name;
+  uint64_t flow;
+  bool async;
+};
+
+//written only by its own thread. the head is published after the record, so every slot below
+//it is complete, and a reader only has to worry about the writer lapping it
+struct TraceBuffer {
+  std::atomic<uint64_t> head{0};
+  std::array<TraceRecord, TRACE_BUFFER_SIZE> records;
+  std::atomic<const char *> threadName{nullptr};
+  int tid;
+};
+
+static_assert((TRACE_BUFFER_SIZE & (TRACE_BUFFER_SIZE - 1)) == 0, "trace buffer size must be a power of two");
+
+//buffers outlive their threads so a flush still sees what finished threads recorded
+static std::mutex registryMutex;
+static std::vector<TraceBuffer*> registry;
+
+static std::atomic<uint64_t> nextFlow{1};
+
+static thread_local TraceBuffer * threadBuffer = nullptr;
+
+static TraceBuffer * currentBuffer() {
+  if(threadBuffer) return threadBuffer;
+
+  //once per thread, never on the recording path after that
+  threadBuffer = new TraceBuffer();
+  threadBuffer->tid = syscall(SYS_gettid);
+
+  std::lock_guard<std::mutex> lock(registryMutex);
+  registry.push_back(threadBuffer);
+  return threadBuffer;
+}
+
+
+int64_t traceNowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void traceRecord(const char * name, int64_t startNs, int64_t endNs, uint64_t flow, bool async) {
+  TraceBuffer * buffer = currentBuffer();
+
+  uint64_t head = buffer->head.load(std::memory_order_relaxed);
+  buffer->records[head & (TRACE_BUFFER_SIZE - 1)] = TraceRecord{startNs, endNs, name, flow, async};
+  buffer->head.store(head + 1, std::memory_order_release);
+}
+
+uint64_t traceNewFlow() {
+  return nextFlow.fetch_add(1, std::memory_order_relaxed);
+}
+
+void traceThreadName(const char * name) {
+  currentBuffer()->threadName.store(name, std::memory_order_relaxed);
+}
+
+
+struct FlushedRecord {
+  TraceRecord record;
+  int tid;
+};
+
+static std::vector<FlushedRecord> collect(std::vector<std::pair<int, const char *>> & threads) {
+  std::vector<FlushedRecord> retval;
+
+  std::lock_guard<std::mutex> lock(registryMutex);
+
+  for(TraceBuffer * buffer : registry) {
+    threads.push_back({buffer->tid, buffer->threadName.load(std::memory_order_relaxed)});
+
+    uint64_t head = buffer->head.load(std::memory_order_acquire);
+    uint64_t first = head > TRACE_BUFFER_SIZE ? head - TRACE_BUFFER_SIZE : 0;
+
+    size_t start = retval.size();
+    for(uint64_t i = first; i < head; i++) {
+      retval.push_back(FlushedRecord{buffer->records[i & (TRACE_BUFFER_SIZE - 1)], buffer->tid});
+    }
+
+    //whatever the writer got to while we copied can't be trusted, including the slot it may be
+    //filling right now for record after, which is where record after - TRACE_BUFFER_SIZE was
+    uint64_t after = buffer->head.load(std::memory_order_acquire);
+    uint64_t lapped = after + 1 > TRACE_BUFFER_SIZE ? after + 1 - TRACE_BUFFER_SIZE : 0;
+    if(lapped > first) {
+      size_t drop = std::min<uint64_t>(lapped - first, head - first);
+      retval.erase(retval.begin() + start, retval.begin() + start + drop);
+    }
+  }
+
+  return retval;
+}
+
+bool traceFlush(const std::string & path) {
+  std::vector<std::pair<int, const char *>> threads;
+  std::vector<FlushedRecord> records = collect(threads);
+
+  std::sort(records.begin(), records.end(), [](const FlushedRecord & a, const FlushedRecord & b){
+    return a.record.startNs < b.record.startNs;
+  });
+
+  //the first span of a flow starts its arrow and the last ends it, everything between is a step
+  std::map<uint64_t, std::pair<size_t, size_t>> flows;
+  for(size_t i = 0; i < records.size(); i++) {
+    uint64_t flow = records[i].record.flow;
+    if(!flow || records[i].record.async) continue;
+
+    auto existing = flows.find(flow);
+    if(existing == flows.end()) flows[flow] = {i, i};
+    else existing->second.second = i;
+  }
+
+  //the daemon runs as root and the trace goes to /tmp, a fixed temporary name there could be a symlink someone planted.
+  //mkstemp only ever creates a new file, and the rename replaces a link at path rather than following it
+  std::string temporary = path + ".XXXXXX";
+  int fd = mkstemp(temporary.data());
+  if(fd < 0) return false;
+
+  //mkstemp makes it 0600, a trace holds nothing private and is usually opened as someone else
+  fchmod(fd, 0644);
+
+  FILE * file = fdopen(fd, "w");
+  if(!file) {
+    close(fd);
+    unlink(temporary.c_str());
+    return false;
+  }
+
+  int pid = getpid();
+  bool first = true;
+
+  auto separator = [&](){
+    if(!first) fputs(",\n", file);
+    first = false;
+  };
+
+  fputs("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n", file);
+
+  for(auto & [tid, name] : threads) {
+    if(!name) continue;
+    separator();
+    fprintf(file, "{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", pid, tid, name);
+  }
+
+  uint64_t asyncId = 0;
+
+  for(size_t i = 0; i < records.size(); i++) {
+    TraceRecord & record = records[i].record;
+    int tid = records[i].tid;
+    double startUs = record.startNs / 1000.0;
+    double endUs = record.endNs / 1000.0;
+
+    separator();
+    if(record.async) {
+      asyncId++;
+      fprintf(file, "{\"name\":\"%s\",\"cat\":\"async\",\"ph\":\"b\",\"id\":%llu,\"ts\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"flow\":%llu}},\n",
+        record.name, (unsigned long long) asyncId, startUs, pid, tid, (unsigned long long) record.flow);
+      fprintf(file, "{\"name\":\"%s\",\"cat\":\"async\",\"ph\":\"e\",\"id\":%llu,\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+        record.name, (unsigned long long) asyncId, endUs, pid, tid);
+    } else {
+      fprintf(file, "{\"name\":\"%s\",\"cat\":\"span\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,\"tid\":%d,\"args\":{\"flow\":%llu}}",
+        record.name, startUs, endUs - startUs, pid, tid, (unsigned long long) record.flow);
+    }
+
+    //arrows bind to the slice around their timestamp, async spans have no slice to hold them
+    if(!record.flow || record.async) continue;
+
+    auto & [flowFirst, flowLast] = flows[record.flow];
+    if(flowFirst == flowLast) continue;
+
+    const char * phase = i == flowFirst ? "s" : i == flowLast ? "f" : "t";
+    separator();
+    fprintf(file, "{\"name\":\"presence\",\"cat\":\"flow\",\"ph\":\"%s\",\"id\":%llu,\"ts\":%.3f,\"pid\":%d,\"tid\":%d,\"bp\":\"e\"}",
+      phase, (unsigned long long) record.flow, startUs, pid, tid);
+  }
+
+  fputs("\n]}\n", file);
+
+  bool ok = !ferror(file);
+  ok = fclose(file) == 0 && ok;
+
+  //readers never see a half written trace
+  ok = ok && rename(temporary.c_str(), path.c_str()) == 0;
+
+  if(!ok) unlink(temporary.c_str());
+  return ok;
+}
+
+#endif
@@ -0,0 +1,78 @@
+#pragma once
+
+//spans for following a presence change from the radio to the strip. built with -D TRACE (make
+//trace) they land in per-thread rings and traceFlush writes them out as Chrome trace event JSON,
+//which chrome://tracing and ui.perfetto.dev both open. without it every call here compiles away.
+//
+//spans that share a flow id are drawn as one chain of arrows across threads, so each stamp a
+//flow on whatever it hands to the next stage: events, commands, observations
+
+#include <cstdint>
+#include <string>
+
+#define TRACE_FILE "/tmp/bluelight-trace.json"
+//per thread, the oldest spans are overwritten once it fills
+#define TRACE_BUFFER_SIZE 16384
+
+#ifdef TRACE
+
+#include <chrono>
+
+int64_t traceNowNs();
+void traceRecord(const char * name, int64_t startNs, int64_t endNs, uint64_t flow, bool async);
+
+//from construction to destruction on one thread, names must be string literals
+class TraceSpan {
+  const char * name;
+  uint64_t flow;
+  int64_t startNs;
+
+public:
+  TraceSpan(const char * name, uint64_t flow = 0) : name(name), flow(flow), startNs(traceNowNs()) {}
+  ~TraceSpan() { traceRecord(name, startNs, traceNowNs(), flow, false); }
+
+  TraceSpan(const TraceSpan&) = delete;
+  TraceSpan& operator=(const TraceSpan&) = delete;
+
+  //for when which flow the work belongs to only turns out partway through
+  void setFlow(uint64_t flow) { this->flow = flow; }
+};
+
+//for coroutines, which overlap on their thread and would break the nesting of plain spans
+class TraceAsyncSpan {
+  const char * name;
+  uint64_t flow;
+  int64_t startNs;
+
+public:
+  TraceAsyncSpan(const char * name, uint64_t flow = 0) : name(name), flow(flow), startNs(traceNowNs()) {}
+  ~TraceAsyncSpan() { traceRecord(name, startNs, traceNowNs(), flow, true); }
+
+  TraceAsyncSpan(const TraceAsyncSpan&) = delete;
+  TraceAsyncSpan& operator=(const TraceAsyncSpan&) = delete;
+};
+
+uint64_t traceNewFlow();
+//shows up as the thread's track name, call before the thread records anything
+void traceThreadName(const char * name);
+//safe while other threads keep recording, a span overwritten midway is left out
+bool traceFlush(const std::string & path = TRACE_FILE);
+
+#else
+
+class TraceSpan {
+public:
+  TraceSpan(const char *, uint64_t = 0) {}
+  void setFlow(uint64_t) {}
+};
+
+class TraceAsyncSpan {
+public:
+  TraceAsyncSpan(const char *, uint64_t = 0) {}
+};
+
+inline uint64_t traceNewFlow() { return 0; }
+inline void traceThreadName(const char *) {}
+inline bool traceFlush(const std::string & = TRACE_FILE) { return false; }
+
+#endif